@@ -1,15 +1,53 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/KnownBits.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include <vector>
 #include <map>
+#include <set>
+
+#include "../Plugin/PassLog.h"
 
 using namespace llvm;
 
+static cl::opt<bool> DefaultPipelinePeephole(
+    "default-pipeline-peephole", cl::init(true), cl::Hidden,
+    cl::desc("Add the peephole, strength reduction and specialization passes to the default -O1/-O2/-O3 pipelines"));
+
+static cl::opt<bool> DefaultPipelinePeepholeLog(
+    "default-pipeline-peephole-log", cl::init(false), cl::Hidden,
+    cl::desc("Keep the logging of the peephole, strength reduction and specialization passes when they run in the default pipelines"));
+
+static cl::opt<unsigned> SpecializationGrowthBudget(
+    "const-arg-spec-growth-budget", cl::init(20), cl::Hidden,
+    cl::desc("Maximum growth of the module due to specialized clones, in percent of its instructions"));
+
+static cl::opt<unsigned> SpecializationMaxClones(
+    "const-arg-spec-max-clones", cl::init(3), cl::Hidden,
+    cl::desc("Maximum number of specialized clones of a single function"));
+
+static cl::opt<unsigned> SpecializationMinBudget(
+    "const-arg-spec-min-budget", cl::init(100), cl::Hidden,
+    cl::desc("Instructions available to specialized clones regardless of the module size"));
+
+namespace {
+
 // --- Funzioni di utilità per l'analisi ---
 
 // Funzione per separare operando costante e non costante
@@ -26,6 +64,62 @@ void getConstantAndNonConstantOperands(BinaryOperator *BinOp, Value *&ConstantOp
     }
 }
 
+// Funzione per trovare, in una moltiplicazione dentro un loop, l'operando che cresce come una
+// ricorrenza affine del loop (es. i, i + 1, sext i) e l'operando invariante nello stesso loop
+const SCEVAddRecExpr *getRecurrenceAndInvariantOperands(BinaryOperator *BinOp, ScalarEvolution &SE, Value *&InvariantOp) {
+    for (unsigned Idx = 0; Idx < 2; ++Idx) {
+        Value *Op = BinOp->getOperand(Idx);
+        Value *Other = BinOp->getOperand(1 - Idx);
+        if (!SE.isSCEVable(Op->getType())) {
+            return nullptr;
+        }
+        auto *Rec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Op));
+        if (!Rec || !Rec->isAffine() || !Rec->getLoop()->contains(BinOp) || !Rec->getLoop()->isLoopInvariant(Other)) {
+            continue;
+        }
+        // Servono un preheader per il valore iniziale e un unico latch per l'incremento
+        if (!Rec->getLoop()->getLoopPreheader() || !Rec->getLoop()->getLoopLatch()) {
+            continue;
+        }
+        InvariantOp = Other;
+        return Rec;
+    }
+    InvariantOp = nullptr;
+    return nullptr;
+}
+
+// Funzione per capire se conviene specializzare un argomento: al posto della costante deve comparire
+// in un'operazione che i pass di peephole o il constant folding possono semplificare
+bool isSpecializationUseful(Argument *Arg) {
+    for (User *U : Arg->users()) {
+        if (isa<BinaryOperator>(U) || isa<CmpInst>(U) || isa<SwitchInst>(U)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Funzione per propagare le costanti in un clone specializzato: le istruzioni con soli operandi costanti
+// vengono calcolate, i branch su condizioni costanti diventano incondizionati e i blocchi irraggiungibili spariscono
+void propagateConstants(Function &F) {
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : make_early_inc_range(BB)) {
+                if (Constant *C = ConstantFoldInstruction(&I, DL)) {
+                    I.replaceAllUsesWith(C);
+                    I.eraseFromParent();
+                    Changed = true;
+                }
+            }
+            Changed |= ConstantFoldTerminator(&BB, true);
+        }
+        Changed |= removeUnreachableBlocks(F);
+    }
+}
+
 
 // --- Pass di Ottimizzazione ---
 
@@ -152,8 +246,18 @@ struct StrengthReductionPass : public PassInfoMixin<StrengthReductionPass> {
                             if (val > 0 && isPowerOf2_64(val)) {
                                 uint64_t shiftAmt = Log2_64(val);
                                 Value *Shift = nullptr;
+                                Value *Dividend = op->getOperand(0);
+                                unsigned BitWidth = Dividend->getType()->getScalarSizeInBits();
                                 if (op->getOpcode() == Instruction::SDiv) {
-                                    Shift = Builder.CreateAShr(op->getOperand(0), shiftAmt); // Shift aritmetico
+                                    // L'ashr arrotonda verso -infinito, la sdiv verso zero: se il dividendo puo' essere
+                                    // negativo gli si somma prima 2^k - 1, ricavato dal bit di segno (-7 / 4 => (-7 + 3) >> 2)
+                                    if (shiftAmt > 0 && !op->isExact() &&
+                                        !computeKnownBits(Dividend, F.getParent()->getDataLayout()).isNonNegative()) {
+                                        Value *Sign = Builder.CreateAShr(Dividend, BitWidth - 1);
+                                        Value *Bias = Builder.CreateLShr(Sign, BitWidth - shiftAmt);
+                                        Dividend = Builder.CreateAdd(Dividend, Bias);
+                                    }
+                                    Shift = Builder.CreateAShr(Dividend, shiftAmt); // Shift aritmetico
                                 } else {
                                     Shift = Builder.CreateLShr(op->getOperand(0), shiftAmt); // Shift logico
                                 }
@@ -175,6 +279,242 @@ struct StrengthReductionPass : public PassInfoMixin<StrengthReductionPass> {
     }
 };
 
+// Strength reduction nei loop: i * k, con k invariante nel loop, viene ricalcolato a ogni iterazione.
+// Se i e' una ricorrenza {start, +, step}, anche i * k lo e': {start * k, +, step * k}. La moltiplicazione
+// diventa una nuova PHI nell'header, inizializzata nel preheader e incrementata una volta nel latch
+struct LoopStrengthReductionPass : public PassInfoMixin<LoopStrengthReductionPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+        LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        SCEVExpander Expander(SE, DL, "lsr");
+
+        std::vector<Instruction*> toErase;
+        std::set<const Loop*> changedLoops;
+        // Una sola nuova ricorrenza per ogni coppia (ricorrenza, invariante), anche se la moltiplicazione si ripete
+        std::map<std::pair<const SCEV*, Value*>, PHINode*> newIVs;
+        bool changed = false;
+
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                auto *op = dyn_cast<BinaryOperator>(&I);
+                if (!op || op->getOpcode() != Instruction::Mul || !LI.getLoopFor(&BB)) continue;
+
+                Value *InvariantOp = nullptr;
+                const SCEVAddRecExpr *Rec = getRecurrenceAndInvariantOperands(op, SE, InvariantOp);
+                if (!Rec) continue;
+                // Le moltiplicazioni per costanti restano a StrengthReductionPass se diventano shift
+                if (auto *C = dyn_cast<ConstantInt>(InvariantOp)) {
+                    if (C->getValue().isPowerOf2()) continue;
+                }
+
+                const Loop *L = Rec->getLoop();
+                PHINode *&NewIV = newIVs[{Rec, InvariantOp}];
+                if (!NewIV) {
+                    // Valore iniziale e passo della nuova ricorrenza, calcolati una volta nel preheader
+                    const SCEV *K = SE.getSCEV(InvariantOp);
+                    Type *Ty = op->getType();
+                    Instruction *InsertPt = L->getLoopPreheader()->getTerminator();
+                    Value *Init = Expander.expandCodeFor(SE.getMulExpr(Rec->getStart(), K), Ty, InsertPt);
+                    Value *Step = Expander.expandCodeFor(SE.getMulExpr(Rec->getStepRecurrence(SE), K), Ty, InsertPt);
+
+                    BasicBlock *Header = L->getHeader();
+                    BasicBlock *Latch = L->getLoopLatch();
+                    NewIV = PHINode::Create(Ty, 2, op->getName() + ".lsr", &Header->front());
+                    IRBuilder<> Builder(Latch->getTerminator());
+                    Value *Next = Builder.CreateAdd(NewIV, Step, op->getName() + ".lsr.next");
+                    for (BasicBlock *Pred : predecessors(Header)) {
+                        NewIV->addIncoming(Pred == Latch ? Next : Init, Pred);
+                    }
+                    changedLoops.insert(L);
+                }
+
+                PASS_LOG << "Replaced " << *op << " with the recurrence " << NewIV->getName() << "\n";
+                op->replaceAllUsesWith(NewIV);
+                toErase.push_back(op);
+                changed = true;
+            }
+        }
+
+        for (Instruction *I : toErase) {
+            I->eraseFromParent();
+        }
+
+        // Le vecchie variabili di induzione usate solo dal proprio incremento ora sono morte
+        for (const Loop *L : changedLoops) {
+            std::vector<WeakTrackingVH> Phis;
+            for (PHINode &Phi : L->getHeader()->phis()) {
+                Phis.push_back(&Phi);
+            }
+            for (WeakTrackingVH &Phi : Phis) {
+                if (auto *OldIV = dyn_cast_or_null<PHINode>(Phi)) {
+                    if (RecursivelyDeleteDeadPHINode(OldIV)) {
+                        PASS_LOG << "Removed a dead induction variable of the loop " << L->getHeader()->getName() << "\n";
+                    }
+                }
+            }
+        }
+
+        return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+};
+
+// Specializzazione di funzioni: le chiamate che passano costanti intere a una funzione vengono ridirette
+// a un suo clone, in cui gli argomenti costanti sono sostituiti dal loro valore. Nel clone x / stride diventa
+// x / 8 e i pass di peephole lo possono ridurre. Le specializzazioni con le chiamate piu' frequenti (dal profilo,
+// o dalla frequenza stimata dei blocchi) vengono create per prime, finche' resta budget di crescita del codice
+struct ConstantArgSpecializationPass : public PassInfoMixin<ConstantArgSpecializationPass> {
+    // Una specializzazione: la funzione, la costante di ogni argomento (nullptr se resta un parametro)
+    // e le chiamate che la possono usare
+    struct Specialization {
+        Function *Callee;
+        std::vector<ConstantInt*> Args;
+        std::vector<CallInst*> Calls;
+        double Hotness;
+    };
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        LLVMContext &Ctx = M.getContext();
+
+        // Candidati in ordine di programma, raggruppati per funzione e costanti passate
+        std::vector<Specialization> Candidates;
+        std::map<std::pair<Function*, std::vector<ConstantInt*>>, size_t> CandidateIndex;
+        unsigned ModuleSize = 0;
+
+        for (Function &Caller : M) {
+            if (Caller.isDeclaration()) continue;
+            ModuleSize += Caller.getInstructionCount();
+            BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(Caller);
+            double EntryFreq = BFI.getBlockFreq(&Caller.getEntryBlock()).getFrequency();
+
+            for (auto &BB : Caller) {
+                for (auto &I : BB) {
+                    auto *Call = dyn_cast<CallInst>(&I);
+                    Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+                    if (!Callee || Callee->isDeclaration() || Callee->isVarArg() || Callee == &Caller ||
+                        Call->getFunctionType() != Callee->getFunctionType()) continue;
+
+                    std::vector<ConstantInt*> Args(Call->arg_size(), nullptr);
+                    bool Useful = false;
+                    for (unsigned Idx = 0; Idx < Call->arg_size(); ++Idx) {
+                        auto *C = dyn_cast<ConstantInt>(Call->getArgOperand(Idx));
+                        if (C && isSpecializationUseful(Callee->getArg(Idx))) {
+                            Args[Idx] = C;
+                            Useful = true;
+                        }
+                    }
+                    if (!Useful) continue;
+
+                    // Con il profilo conta quante volte il blocco e' stato eseguito, altrimenti la sua frequenza
+                    // stimata rispetto all'entry del chiamante (es. 8 dentro un loop, 1 fuori)
+                    double Hotness;
+                    if (auto Count = BFI.getBlockProfileCount(&BB)) {
+                        Hotness = *Count;
+                    } else {
+                        Hotness = BFI.getBlockFreq(&BB).getFrequency() / EntryFreq;
+                    }
+
+                    auto Inserted = CandidateIndex.insert({{Callee, Args}, Candidates.size()});
+                    if (Inserted.second) {
+                        Candidates.push_back({Callee, Args, {}, 0});
+                    }
+                    Specialization &S = Candidates[Inserted.first->second];
+                    S.Calls.push_back(Call);
+                    S.Hotness += Hotness;
+                }
+            }
+        }
+
+        std::vector<Specialization*> Ranked;
+        for (Specialization &S : Candidates) {
+            Ranked.push_back(&S);
+        }
+        std::stable_sort(Ranked.begin(), Ranked.end(), [](Specialization *A, Specialization *B) {
+            return A->Hotness > B->Hotness;
+        });
+
+        // Nei moduli piccoli la percentuale darebbe poche istruzioni: vale comunque il budget minimo
+        unsigned Budget = std::max<unsigned>((uint64_t)ModuleSize * SpecializationGrowthBudget / 100,
+                                             SpecializationMinBudget);
+        unsigned Growth = 0;
+        std::map<Function*, unsigned> ClonesPerFunction;
+        bool changed = false;
+
+        for (Specialization *S : Ranked) {
+            Function *Callee = S->Callee;
+            PASS_LOG << "Candidate " << Callee->getName() << "(";
+            for (unsigned Idx = 0; Idx < S->Args.size(); ++Idx) {
+                PASS_LOG << (Idx ? ", " : "");
+                if (S->Args[Idx]) {
+                    PASS_LOG << S->Args[Idx]->getValue();
+                } else {
+                    PASS_LOG << "_";
+                }
+            }
+            PASS_LOG << "): " << S->Calls.size() << " calls, hotness " << format("%.1f", S->Hotness) << "\n";
+
+            if (ClonesPerFunction[Callee] >= SpecializationMaxClones) {
+                PASS_LOG << "  " << Callee->getName() << " already has " << SpecializationMaxClones << " clones\n";
+                continue;
+            }
+            unsigned Size = Callee->getInstructionCount();
+            if (Growth + Size > Budget) {
+                PASS_LOG << "  The clone (" << Size << " instructions) exceeds the code growth budget ("
+                       << Budget - Growth << " instructions left)\n";
+                continue;
+            }
+
+            // CloneFunction toglie dal clone i parametri mappati: al loro posto restano le costanti
+            ValueToValueMapTy VMap;
+            for (unsigned Idx = 0; Idx < S->Args.size(); ++Idx) {
+                if (S->Args[Idx]) VMap[Callee->getArg(Idx)] = S->Args[Idx];
+            }
+            Function *Clone = CloneFunction(Callee, VMap);
+            Clone->setName(Callee->getName() + ".spec");
+            Clone->setLinkage(GlobalValue::InternalLinkage);
+            Clone->setVisibility(GlobalValue::DefaultVisibility);
+            propagateConstants(*Clone);
+
+            // Le chiamate passano solo gli argomenti rimasti, con i loro attributi
+            for (CallInst *Call : S->Calls) {
+                AttributeList Attrs = Call->getAttributes();
+                std::vector<Value*> NewArgs;
+                std::vector<AttributeSet> ArgAttrs;
+                for (unsigned Idx = 0; Idx < S->Args.size(); ++Idx) {
+                    if (S->Args[Idx]) continue;
+                    NewArgs.push_back(Call->getArgOperand(Idx));
+                    ArgAttrs.push_back(Attrs.getParamAttrs(Idx));
+                }
+                CallInst *NewCall = CallInst::Create(Clone, NewArgs, "", Call);
+                NewCall->takeName(Call);
+                NewCall->setCallingConv(Call->getCallingConv());
+                NewCall->setTailCallKind(Call->getTailCallKind());
+                NewCall->setAttributes(AttributeList::get(Ctx, Attrs.getFnAttrs(), Attrs.getRetAttrs(), ArgAttrs));
+                NewCall->setDebugLoc(Call->getDebugLoc());
+                Call->replaceAllUsesWith(NewCall);
+                Call->eraseFromParent();
+            }
+
+            Growth += Clone->getInstructionCount();
+            ++ClonesPerFunction[Callee];
+            PASS_LOG << "  Created " << Clone->getName() << " with " << Clone->getInstructionCount() << " instructions\n";
+            changed = true;
+        }
+
+        // Le funzioni locali senza piu' chiamate vengono eliminate
+        for (auto &Entry : ClonesPerFunction) {
+            Function *F = Entry.first;
+            if (Entry.second && F->hasLocalLinkage() && F->use_empty()) {
+                PASS_LOG << "Removed " << F->getName() << ", all its calls use a clone\n";
+                F->eraseFromParent();
+            }
+        }
+
+        return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+};
+
 struct MultiInstructionOptPass : public PassInfoMixin<MultiInstructionOptPass> {
     PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
         std::vector<Instruction*> toErase;
@@ -189,6 +529,9 @@ struct MultiInstructionOptPass : public PassInfoMixin<MultiInstructionOptPass> {
 
                     if (!ConstantOp) continue;
 
+                    // Per sottrazione e divisione la costante deve essere il secondo operando: k - b e k / b non si annullano
+                    if (!firstOp->isCommutative() && firstOp->getOperand(1) != ConstantOp) continue;
+
                     // Itera su tutti gli usi della prima istruzione
                     for (auto &U : firstOp->uses()) {
                         User *user = U.getUser();
@@ -200,9 +543,10 @@ struct MultiInstructionOptPass : public PassInfoMixin<MultiInstructionOptPass> {
                                 if (firstOp->getOpcode() == Instruction::Add && secondOp->getOpcode() == Instruction::Sub) {
                                     patternFound = true;
                                 }
-                                // Pattern: (b * k) / k => b
-                                else if (firstOp->getOpcode() == Instruction::Mul && 
-                                           (secondOp->getOpcode() == Instruction::SDiv || secondOp->getOpcode() == Instruction::UDiv)) {
+                                // Pattern: (b * k) / k => b, solo se la moltiplicazione non puo' andare in overflow
+                                else if (firstOp->getOpcode() == Instruction::Mul &&
+                                           ((secondOp->getOpcode() == Instruction::SDiv && firstOp->hasNoSignedWrap()) ||
+                                            (secondOp->getOpcode() == Instruction::UDiv && firstOp->hasNoUnsignedWrap()))) {
                                     patternFound = true;
                                 }
 
@@ -219,8 +563,9 @@ struct MultiInstructionOptPass : public PassInfoMixin<MultiInstructionOptPass> {
                                 if (firstOp->getOpcode() == Instruction::Sub && secondOp->getOpcode() == Instruction::Add) {
                                      patternFound = true;
                                 }
-                                // Pattern: k * (b / k) => b
-                                else if ((firstOp->getOpcode() == Instruction::SDiv || firstOp->getOpcode() == Instruction::UDiv) && secondOp->getOpcode() == Instruction::Mul) {
+                                // Pattern: k * (b / k) => b, solo se la divisione e' esatta (senza resto)
+                                else if ((firstOp->getOpcode() == Instruction::SDiv || firstOp->getOpcode() == Instruction::UDiv) &&
+                                         firstOp->isExact() && secondOp->getOpcode() == Instruction::Mul) {
                                      patternFound = true;
                                 }
 
@@ -267,37 +612,97 @@ struct MultiInstructionOptPass : public PassInfoMixin<MultiInstructionOptPass> {
 };
 
 
+} // namespace
+
+
 // --- Registrazione del Plugin ---
 
+// Registrazione dei pass per nome, per opt -passes="..."
+void registerAssignment1Pipelines(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "algebraic-identity") {
+                FPM.addPass(AlgebraicIdentityPass());
+                return true;
+            }
+            if (Name == "strength-reduction") {
+                FPM.addPass(StrengthReductionPass());
+                return true;
+            }
+            if (Name == "loop-strength-reduction") {
+                FPM.addPass(LoopStrengthReductionPass());
+                return true;
+            }
+            if (Name == "multi-instruction-opt"){
+                FPM.addPass(MultiInstructionOptPass());
+                return true;
+            }
+            if (Name == "all-opts") {
+                FPM.addPass(AlgebraicIdentityPass());
+                FPM.addPass(StrengthReductionPass());
+                FPM.addPass(MultiInstructionOptPass());
+                return true;
+            }
+            return false;
+        }
+    );
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "constant-arg-specialization") {
+                MPM.addPass(ConstantArgSpecializationPass());
+                return true;
+            }
+            return false;
+        }
+    );
+}
+
+// Registrazione dei pass nelle pipeline di default (clang -O2), usata dal plugin unificato.
+// A -O0 non e' stato eseguito mem2reg e i pass non vengono aggiunti
+void registerAssignment1ExtensionPoints(PassBuilder &PB) {
+    // I pass di peephole girano dopo ogni instcombine della pipeline
+    PB.registerPeepholeEPCallback(
+        [](FunctionPassManager &FPM, OptimizationLevel Level) {
+            if (Level == OptimizationLevel::O0 || !DefaultPipelinePeephole) return;
+            FPM.addPass(DefaultPipelinePass(AlgebraicIdentityPass(), DefaultPipelinePeepholeLog));
+            FPM.addPass(DefaultPipelinePass(StrengthReductionPass(), DefaultPipelinePeepholeLog));
+            FPM.addPass(DefaultPipelinePass(MultiInstructionOptPass(), DefaultPipelinePeepholeLog));
+        }
+    );
+    // La specializzazione va fatta prima dell'inliner e della semplificazione delle funzioni,
+    // che poi lavorano sui cloni con le costanti gia' propagate
+    PB.registerPipelineEarlySimplificationEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel Level) {
+            if (Level == OptimizationLevel::O0 || !DefaultPipelinePeephole) return;
+            MPM.addPass(DefaultPipelinePass(ConstantArgSpecializationPass(), DefaultPipelinePeepholeLog));
+        }
+    );
+    // La strength reduction nei loop crea nuove ricorrenze: va fatta dopo la vettorizzazione,
+    // come la LSR di LLVM. Servono i preheader
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel Level) {
+            if (Level == OptimizationLevel::O0 || !DefaultPipelinePeephole) return;
+            FunctionPassManager FPM;
+            FPM.addPass(LoopSimplifyPass());
+            FPM.addPass(DefaultPipelinePass(LoopStrengthReductionPass(), DefaultPipelinePeepholeLog));
+            MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+        }
+    );
+}
+
+// Versione dei pass, fa parte anche della chiave della cache per funzione del driver
+const char *getAssignment1Version() {
+    return "v0.4";
+}
+
+#ifndef UNIFIED_PLUGIN
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
     return {
-        LLVM_PLUGIN_API_VERSION, "MyLLVMPasses", "v0.4",
-        [](PassBuilder &PB) {
-            PB.registerPipelineParsingCallback(
-                [](StringRef Name, FunctionPassManager &FPM,
-                   ArrayRef<PassBuilder::PipelineElement>) {
-                    if (Name == "algebraic-identity") {
-                        FPM.addPass(AlgebraicIdentityPass());
-                        return true;
-                    }
-                    if (Name == "strength-reduction") {
-                        FPM.addPass(StrengthReductionPass());
-                        return true;
-                    }
-                    if (Name == "multi-instruction-opt"){
-                        FPM.addPass(MultiInstructionOptPass());
-                        return true;
-                    }
-                    if (Name == "all-opts") {
-                        FPM.addPass(AlgebraicIdentityPass());
-                        FPM.addPass(StrengthReductionPass());
-                        FPM.addPass(MultiInstructionOptPass());
-                        return true;
-                    }
-                    return false;
-                }
-            );
-        }
+        LLVM_PLUGIN_API_VERSION, "MyLLVMPasses", getAssignment1Version(),
+        registerAssignment1Pipelines
     };
 }
+#endif
@@ -16,4 +16,24 @@ int multi_instruction_opt_test(int b) {
     int a = b + 1;
     int c = a - 1; // Questa sequenza deve diventare c = b
     return c;
-}
\ No newline at end of file
+}
+// Casi che NON devono diventare b: sarebbero ottimizzazioni sbagliate
+int signed_division_test(int x) {
+    return x / 4; // x puo' essere negativo: -7 / 4 = -1, ma -7 >> 2 = -2. Serve la correzione prima dello shift
+}
+unsigned mul_div_overflow_test(unsigned b) {
+    unsigned a = b * 8;
+    return a / 8; // La moltiplicazione unsigned puo' andare in overflow: (b * 8) / 8 != b
+}
+int div_mul_remainder_test(int b) {
+    int a = b / 4;
+    return 4 * a; // La divisione ha un resto: 4 * (7 / 4) = 4, non 7
+}
+int constant_first_sub_test(int b) {
+    int a = 1 - b;
+    return 1 + a; // 1 + (1 - b) = 2 - b, non b
+}
+int constant_first_div_test(int b) {
+    int a = 8 / b;
+    return 8 * a; // 8 * (8 / b) non e' b
+}
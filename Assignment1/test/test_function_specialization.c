@@ -0,0 +1,43 @@
+// test/test_function_specialization.c
+
+// stride e scale sono parametri: x / stride e x * scale restano operazioni generiche
+static int rescale(int x, int stride, int scale) {
+    return x / stride * scale;
+}
+
+// Con mode costante lo switch si risolve nel clone e resta un solo caso
+static int combine(int a, int b, int mode) {
+    switch (mode) {
+    case 0:
+        return a + b;
+    case 1:
+        return a - b;
+    default:
+        return a * b;
+    }
+}
+
+// Chiamata nel loop con costanti: la specializzazione rescale(_, 8, 4) viene creata per prima
+// e nel clone la divisione e la moltiplicazione diventano shift
+int hot_loop(int *a, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += rescale(a[i], 8, 4);
+    }
+    return sum;
+}
+
+// Chiamata fuori dai loop: clone rescale(_, 3, _), la divisione per 3 resta
+int cold_call(int x, int s) {
+    return rescale(x, 3, s);
+}
+
+// Tutte le chiamate passano una costante per mode: dopo la specializzazione combine non serve piu'
+int combine_all(int a, int b) {
+    return combine(a, b, 0) + combine(a, b, 2);
+}
+
+// Nessun argomento costante: nessuna specializzazione
+int no_constants(int x, int s, int k) {
+    return rescale(x, s, k);
+}
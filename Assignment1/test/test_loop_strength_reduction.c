@@ -0,0 +1,44 @@
+// test/test_loop_strength_reduction.c
+
+// i * stride ricalcolato a ogni iterazione: diventa una ricorrenza incrementata di stride
+void strided_store(int *a, int stride, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i * stride] = i;
+    }
+}
+
+// base + i * k: la moltiplicazione diventa una ricorrenza, la somma con base resta
+int strided_sum(int *a, int base, int k, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += a[base + i * k];
+    }
+    return sum;
+}
+
+// i compare solo nella moltiplicazione: dopo la riduzione la vecchia variabile di induzione e' morta
+int dead_induction_variable(int s, int n) {
+    int sum = 0;
+    int i = s;
+    for (int j = 0; j < n; j++) {
+        sum += i * 13;
+        i += 3;
+    }
+    return sum;
+}
+
+// Nel nest la riga i * cols e' invariante nel loop interno: la ricorrenza viene creata nel loop esterno
+void matrix_rows(int *m, int rows, int cols) {
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            m[i * cols + j] = 0;
+        }
+    }
+}
+
+// Caso di controllo: la moltiplicazione per una potenza di 2 resta a StrengthReductionPass (shift)
+void power_of_two_stride(int *a, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i * 8] = i;
+    }
+}
@@ -1,21 +1,36 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
 
 #include <functional>
 #include <vector>
 #include <unordered_set>
 
+#include "../Plugin/PassLog.h"
+
 using namespace llvm;
 
+static cl::opt<bool> DefaultPipelineLICM(
+    "default-pipeline-licm", cl::init(true), cl::Hidden,
+    cl::desc("Add the custom LICM to the loop passes of the default -O1/-O2/-O3 pipelines"));
+
+static cl::opt<bool> DefaultPipelineLICMLog(
+    "default-pipeline-licm-log", cl::init(false), cl::Hidden,
+    cl::desc("Keep the logging of the custom LICM when they run in the default pipelines"));
+
+namespace {
+
 //Caso speciale:
 //Ignora la condizione DOMINA TUTTI I BLOCCHI DEL LOOP
 //SE E SOLO SE NON VIENE USATA ALL'USCITA
@@ -97,10 +112,22 @@ bool dominatesAllUsesInLoop(DominatorTree &DT, Loop* L, Instruction* inst) {
     return true;
 }
 
+// Funzione per capire se qualche istruzione del loop puo' scrivere in memoria
+bool loopMayWriteToMemory(Loop* L) {
+    for (BasicBlock* BB : L->getBlocks()) {
+        for (Instruction &I : *BB) {
+            if (I.mayWriteToMemory()) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 bool isInvariant(Loop* L, std::vector<Instruction*>& invStmts, Instruction* inst) {
-    outs() << "Checking if the instruction: ";
-    inst->print(outs());
-    outs() << " is Loop Invariant\n";
+    PASS_LOG << "Checking if the instruction: ";
+    if (AssignmentsLog) inst->print(*AssignmentsLog);
+    PASS_LOG << " is Loop Invariant\n";
     
     bool all_operands_defined_outside = true;
     bool all_operands_loop_invariant = true;
@@ -109,34 +136,40 @@ bool isInvariant(Loop* L, std::vector<Instruction*>& invStmts, Instruction* inst
     // Questa condizione è troppo restrittiva, la modifichiamo leggermente per includere
     // istruzioni come 'load' che possono essere invarianti.
     if (inst->isTerminator() || isa<PHINode>(inst) || inst->mayHaveSideEffects()) {
-         outs() << "The instruction is not a candidate (terminator, phi, or has side-effects)\n";
+         PASS_LOG << "The instruction is not a candidate (terminator, phi, or has side-effects)\n";
+         return false;
+    }
+
+    // Una load con indirizzo invariante legge sempre lo stesso valore solo se il loop non scrive in memoria
+    if (inst->mayReadFromMemory() && loopMayWriteToMemory(L)) {
+         PASS_LOG << "The instruction is not a candidate (reads memory written inside the loop)\n";
          return false;
     }
     
-    outs() << "The instruction is a candidate\n";
+    PASS_LOG << "The instruction is a candidate\n";
     if (isa<Constant>(inst)) {
-        outs() << "The instruction is a constant \n";
+        PASS_LOG << "The instruction is a constant \n";
         is_constant = true;
     } else {
-        outs() << "The instruction is NOT a constant \n";
+        PASS_LOG << "The instruction is NOT a constant \n";
         
         // Scorro gli operandi dell'istruzione
         for (User::op_iterator OI = inst->op_begin(), OE = inst->op_end(); OI != OE; ++OI) {
             Value *op = *OI;
-            outs() << "Checking operand: ";
-            op->print(outs());
-            outs() << ":\n";
+            PASS_LOG << "Checking operand: ";
+            if (AssignmentsLog) op->print(*AssignmentsLog);
+            PASS_LOG << ":\n";
 
             // Se l'operando non è una istruzione (es. una costante), è per definizione invariante
             Instruction *opInst = dyn_cast<Instruction>(op);
             if (!opInst) {
-                outs() << "The operand is not an instruction (e.g., a constant), it is invariant.\n";
+                PASS_LOG << "The operand is not an instruction (e.g., a constant), it is invariant.\n";
                 continue;
             }
 
             // Se la reaching definition dell'operando si trova all'interno del loop
             if (L->contains(opInst)) {
-                outs() << "The operand is defined inside the loop ";
+                PASS_LOG << "The operand is defined inside the loop ";
                 all_operands_defined_outside = false; // Non tutti gli operandi sono definiti esternamente
 
                 // Verifica se l'istruzione che definisce l'operando è invariante nel loop
@@ -149,30 +182,30 @@ bool isInvariant(Loop* L, std::vector<Instruction*>& invStmts, Instruction* inst
                 }
                 
                 if (!isOpInvariant) {
-                    outs() << "and it is NOT (yet) known to be loop invariant \n";
+                    PASS_LOG << "and it is NOT (yet) known to be loop invariant \n";
                     all_operands_loop_invariant = false;
                 } else {
-                    outs() << "and it is loop invariant \n";
+                    PASS_LOG << "and it is loop invariant \n";
                 }
             } else {
-                outs() << "The operand is defined outside the loop \n";
+                PASS_LOG << "The operand is defined outside the loop \n";
             }
 
             if (!all_operands_loop_invariant) {
-                outs() << "Found a variant operand, so this instruction cannot be invariant.\n";
+                PASS_LOG << "Found a variant operand, so this instruction cannot be invariant.\n";
                 break;
             }
         }
     }
 
-    outs() << "The instruction ";
-    inst->print(outs());
+    PASS_LOG << "The instruction ";
+    if (AssignmentsLog) inst->print(*AssignmentsLog);
     if (is_constant || (all_operands_defined_outside || all_operands_loop_invariant)) {
-        outs() << " is Loop Invariant\n\n";
+        PASS_LOG << " is Loop Invariant\n\n";
         return true;
     }   
     
-    outs() << " is NOT Loop Invariant\n\n";
+    PASS_LOG << " is NOT Loop Invariant\n\n";
     return false;
 }
 
@@ -181,16 +214,16 @@ bool runOnLoop(Loop *L, LoopInfo &LI, DominatorTree &DT) {
     bool modified = false;
 
     if (!L->isLoopSimplifyForm()) {
-        outs() << "Loop is not in simplified form\n";
+        PASS_LOG << "Loop is not in simplified form\n";
         return modified;
     }
 
     BasicBlock* preheader = L->getLoopPreheader();
     if (!preheader) {
-        outs() << "Preheader not found\n";
+        PASS_LOG << "Preheader not found\n";
         return modified;
     }
-    outs() << "Preheader found\n";
+    PASS_LOG << "Preheader found\n";
 
     std::vector<Instruction*> invStmts;
     std::unordered_set<Instruction*> movedStmts;
@@ -220,12 +253,12 @@ bool runOnLoop(Loop *L, LoopInfo &LI, DominatorTree &DT) {
         }
     }
 
-    outs() << "Found Loop Invariant instructions:\n\n";
+    PASS_LOG << "Found Loop Invariant instructions:\n\n";
     for (size_t j = 0; j < invStmts.size(); ++j) {
         Instruction* inst = invStmts[j];
-        outs() << j+1 <<") ";
-        inst->print(outs());
-        outs() <<"\n\n";
+        PASS_LOG << j+1 <<") ";
+        if (AssignmentsLog) inst->print(*AssignmentsLog);
+        PASS_LOG <<"\n\n";
     }
 
     SmallVector<BasicBlock*, 4> exitBlocks;
@@ -234,24 +267,24 @@ bool runOnLoop(Loop *L, LoopInfo &LI, DominatorTree &DT) {
 
     // Ora prova a muovere le istruzioni trovate
     for (Instruction* inst : invStmts) {
-        outs() << "Performing code motion check for the loop invariant instruction ";
-        inst->print(outs());
-        outs() << "\n";
+        PASS_LOG << "Performing code motion check for the loop invariant instruction ";
+        if (AssignmentsLog) inst->print(*AssignmentsLog);
+        PASS_LOG << "\n";
         
         // Condizione 1: L'istruzione domina tutti i suoi usi nel loop
         if (!dominatesAllUsesInLoop(DT, L, inst)) {
-             outs() <<"The instruction doesn't dominate all of its uses inside the loop\n\n";
+             PASS_LOG <<"The instruction doesn't dominate all of its uses inside the loop\n\n";
              continue;
         }
-        outs() <<"The instruction dominates all of its uses inside the loop\n";
+        PASS_LOG <<"The instruction dominates all of its uses inside the loop\n";
 
         // Condizione 2: Non ci sono altre definizioni della stessa "variabile" nel loop
         // Caso Didattico, non serve in SSA
         if (!hasUniqueDefinitionInLoop(L, inst)) {
-            outs() <<"Multiple definitions of the same variable found inside the loop\n\n";
+            PASS_LOG <<"Multiple definitions of the same variable found inside the loop\n\n";
             continue;
         }
-        outs() <<"The variable is defined once inside the loop\n";
+        PASS_LOG <<"The variable is defined once inside the loop\n";
 
         // Condizione 3: L'istruzione domina tutte le uscite del loop O è morta all'uscita
         bool dominatesExits = true;
@@ -263,32 +296,39 @@ bool runOnLoop(Loop *L, LoopInfo &LI, DominatorTree &DT) {
         }
 
         if (dominatesExits) {
-            outs() <<"The instruction dominates all loop exit blocks\n";
+            PASS_LOG <<"The instruction dominates all loop exit blocks\n";
         } else {
-             outs() <<"The instruction does NOT dominate all loop exit blocks\n";
+             PASS_LOG <<"The instruction does NOT dominate all loop exit blocks\n";
              if (!isDeadAtExit(L, inst)) {
-                 outs() <<" and the instruction is NOT dead at the exit of the loop\n\n";
+                 PASS_LOG <<" and the instruction is NOT dead at the exit of the loop\n\n";
                  continue; // Non può essere spostata
              }
-             outs() <<" but the instruction is dead at the exits of the loop\n";
+             PASS_LOG <<" but the instruction is dead at the exits of the loop\n";
+
+             // Nel preheader verrebbe eseguita anche quando nel loop non lo sarebbe:
+             // non deve poter causare eccezioni (es. divisione per zero, load da un puntatore nullo)
+             if (!isSafeToSpeculativelyExecute(inst)) {
+                 PASS_LOG <<"The instruction is not safe to execute speculatively\n\n";
+                 continue;
+             }
         }
 
         // Se tutte le condizioni sono soddisfatte, sposta l'istruzione
-        outs() <<"The instruction is a valid candidate for code motion. \n";
+        PASS_LOG <<"The instruction is a valid candidate for code motion. \n";
         inst->moveBefore(preheader->getTerminator());
         modified = true;
-        outs() <<"The instruction has been moved inside the preheader. \n\n";
+        PASS_LOG <<"The instruction has been moved inside the preheader. \n\n";
         n_moved++;
     }
 
-    outs() << "Moved "<< n_moved <<" instruction(s) inside the preheader \n";
+    PASS_LOG << "Moved "<< n_moved <<" instruction(s) inside the preheader \n";
     return modified;
 }
 
 
 struct CustomLICMPass : public PassInfoMixin<CustomLICMPass> {
     PreservedAnalyses run(Loop &L, LoopAnalysisManager &LAM, LoopStandardAnalysisResults &LAR, LPMUpdater &LU) {
-        outs() << "Custom LICM Pass running on Loop: " << L.getHeader()->getName() << "\n";
+        PASS_LOG << "Custom LICM Pass running on Loop: " << L.getHeader()->getName() << "\n";
         
         if (runOnLoop(&L, LAR.LI, LAR.DT)) {
             return PreservedAnalyses::none();
@@ -299,21 +339,45 @@ struct CustomLICMPass : public PassInfoMixin<CustomLICMPass> {
 };
 
 
+} // namespace
+
+
+// Registrazione del pass per nome, per opt -passes="loop(custom-licm)"
+void registerAssignment3Pipelines(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, LoopPassManager &LPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "custom-licm") {
+                LPM.addPass(CustomLICMPass());
+                return true;
+            }
+            return false;
+        }
+    );
+}
+
+// Registrazione del pass nelle pipeline di default (clang -O2), usata dal plugin unificato.
+// Il loop pass manager garantisce gia' loop-simplify e LCSSA
+void registerAssignment3ExtensionPoints(PassBuilder &PB) {
+    PB.registerLateLoopOptimizationsEPCallback(
+        [](LoopPassManager &LPM, OptimizationLevel Level) {
+            if (Level == OptimizationLevel::O0 || !DefaultPipelineLICM) return;
+            LPM.addPass(DefaultPipelinePass(CustomLICMPass(), DefaultPipelineLICMLog));
+        }
+    );
+}
+
+// Versione dei pass, fa parte anche della chiave della cache per funzione del driver
+const char *getAssignment3Version() {
+    return "v0.1";
+}
+
+#ifndef UNIFIED_PLUGIN
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
     return {
-        LLVM_PLUGIN_API_VERSION, "CustomLICMPass", "v0.1",
-        [](PassBuilder &PB) {
-            PB.registerPipelineParsingCallback(
-                [](StringRef Name, LoopPassManager &LPM,
-                   ArrayRef<PassBuilder::PipelineElement>) {
-                    if (Name == "custom-licm") {
-                        LPM.addPass(CustomLICMPass());
-                        return true;
-                    }
-                    return false;
-                }
-            );
-        }
+        LLVM_PLUGIN_API_VERSION, "CustomLICMPass", getAssignment3Version(),
+        registerAssignment3Pipelines
     };
-}
\ No newline at end of file
+}
+#endif
@@ -84,4 +84,35 @@ int test_case_5_unsafe_to_move(int a, int b, int n) {
         }
     }
     return sum;
-}
\ No newline at end of file
+}
+
+
+// --- CASO 6: Load da Memoria Scritta nel Loop ---
+// L'indirizzo di `v = *p` è invariante, ma il loop scrive proprio in `*p`:
+// a ogni iterazione la load legge il valore scritto in quella precedente.
+// NON deve essere spostata.
+int test_case_6_load_written_in_loop(int *p, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        int v = *p; // Indirizzo invariante, ma la memoria cambia
+        sum += v;
+        *p = i;
+    }
+    return sum;
+}
+
+
+// --- CASO 7: Load Protetta da un Controllo ---
+// Il loop non scrive in memoria e `v = *p` è invariante,
+// ma la load è eseguita solo se p non è nullo.
+// Nel preheader verrebbe eseguita anche con p == 0. NON deve essere spostata.
+int test_case_7_guarded_load(int *p, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        if (p != 0) { // Protezione dal puntatore nullo
+            int v = *p;
+            sum += v;
+        }
+    }
+    return sum;
+}
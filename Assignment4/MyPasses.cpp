@@ -1,29 +1,147 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/VectorUtils.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h" 
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 #include "llvm/IR/Value.h"
 
+#include "../Plugin/PassLog.h"
+
 using namespace llvm;
 
+#define DEBUG_TYPE "loop-fusion-pass"
+
+static cl::opt<unsigned> FusionMaxPeelCount(
+    "loop-fusion-max-peel", cl::init(8), cl::Hidden,
+    cl::desc("Maximum number of iterations peeled to match the trip counts of two loops"));
+
+static cl::opt<unsigned> FusionMaxRuntimeChecks(
+    "loop-fusion-max-runtime-checks", cl::init(8), cl::Hidden,
+    cl::desc("Maximum number of pointer overlap checks emitted to version two loops for fusion"));
+
+static cl::opt<unsigned> DistributionMaxNodes(
+    "loop-distribution-max-nodes", cl::init(64), cl::Hidden,
+    cl::desc("Maximum number of memory instructions and recurrences in a loop considered for distribution"));
+
+static cl::opt<unsigned> DistributionRereadCost(
+    "loop-distribution-reread-cost", cl::init(1), cl::Hidden,
+    cl::desc("Cost of reading a memory stream again in a distributed loop, relative to a vectorizable access"));
+
+static cl::opt<unsigned> FusionCacheSize(
+    "loop-fusion-cache-size", cl::init(32768), cl::Hidden,
+    cl::desc("Size in bytes of the data cache assumed by the loop fusion cost model"));
+
+static cl::opt<bool> FusionIgnoreCostModel(
+    "loop-fusion-ignore-cost-model", cl::init(false), cl::Hidden,
+    cl::desc("Fuse every pair of loops for which fusion is legal"));
+
+static cl::opt<bool> FusionAnnotateParallel(
+    "loop-fusion-annotate-parallel", cl::init(false), cl::Hidden,
+    cl::desc("Mark the fused loops without loop-carried memory dependences with llvm.loop.parallel_accesses"));
+
+static cl::opt<unsigned> TilingTileSize(
+    "loop-tiling-tile-size", cl::init(0), cl::Hidden,
+    cl::desc("Iterations of every level in a tile, derived from the cache size when 0"));
+
+static cl::opt<bool> IdiomAfterTransforms(
+    "loop-idiom-after-transforms", cl::init(true), cl::Hidden,
+    cl::desc("Look for memset/memcpy/memmove idioms in the loops produced by fusion and distribution"));
+
+static cl::opt<unsigned> TilingCacheSize(
+    "loop-tiling-cache-size", cl::init(262144), cl::Hidden,
+    cl::desc("Size in bytes of the cache the tiles of a loop nest must fit in"));
+
+static cl::opt<unsigned> ParallelChunkSize(
+    "loop-parallelize-chunk-size", cl::init(0), cl::Hidden,
+    cl::desc("Iterations handed to a thread at a time, one contiguous block per thread when 0"));
+
+static cl::opt<unsigned> ParallelMinTripCount(
+    "loop-parallelize-min-trip-count", cl::init(1024), cl::Hidden,
+    cl::desc("Minimum number of iterations for which a loop runs in parallel"));
+
+static cl::opt<bool> DefaultPipelineLoopTransforms(
+    "default-pipeline-loop-transforms", cl::init(true), cl::Hidden,
+    cl::desc("Add fusion, distribution, interchange, idiom recognition and the parallel_accesses annotation to the default -O1/-O2/-O3 pipelines"));
+
+static cl::opt<bool> DefaultPipelineParallelize(
+    "default-pipeline-parallelize", cl::init(false), cl::Hidden,
+    cl::desc("Add DOALL parallelization to the default -O1/-O2/-O3 pipelines, the program must be linked with the OpenMP runtime"));
+
+static cl::opt<bool> DefaultPipelineTiling(
+    "default-pipeline-tiling", cl::init(false), cl::Hidden,
+    cl::desc("Add loop tiling to the default -O1/-O2/-O3 pipelines"));
+
+static cl::opt<bool> DefaultPipelineVersioning(
+    "default-pipeline-versioning", cl::init(false), cl::Hidden,
+    cl::desc("Let the loop fusion of the default -O1/-O2/-O3 pipelines version the loops behind runtime overlap checks"));
+
+static cl::opt<bool> DefaultPipelineLoopTransformsLog(
+    "default-pipeline-loop-transforms-log", cl::init(false), cl::Hidden,
+    cl::desc("Keep the logging of the loop transformations and the parallelization when they run in the default pipelines"));
+
+namespace {
+
 struct fusionCandidate {
     const SCEV *tripCount;
     Loop *loop;
+    BasicBlock *header;   //header of the loop, still valid after the loop has been fused into another one
+    bool fusible;         //false once a check that only depends on this loop has failed
+};
+
+//access descriptor of a memory instruction, computed once per fusion candidate
+struct memoryAccess {
+    Instruction *inst;
+    const Value *object;                    //underlying object of the pointer, nullptr if unknown
+    const SCEVAddRecExpr *rec;              //polynomial recurrence of the pointer in an innermost loop
+    const SCEV *base;                       //loop-invariant base of the pointer in a loop nest
+    SmallVector<const SCEV *, 4> strides;   //stride of every level of the nest, outermost first
+};
+
+//dependence information shared by all the fusion attempts of a function
+//result of dependencesAllowFusion: distinct objects that may alias cannot be told apart statically,
+//so fusion is only allowed behind a runtime check that their accessed ranges don't overlap
+struct dependenceResult {
+    bool allowed;
+    SmallVector<std::pair<const Value *, const Value *>, 4> overlapChecks;
+};
+
+struct dependenceCache {
+    //access descriptors of every candidate, valid until the next transform
+    DenseMap<Loop *, SmallVector<memoryAccess, 16>> accesses;
+    //result of dependencesAllowFusion, keyed by the headers of the two loops and the peel count,
+    //valid until the next transform
+    DenseMap<std::pair<std::pair<BasicBlock *, BasicBlock *>, unsigned>, dependenceResult> results;
 };
 
 BranchInst* findGuard(Loop *L, LoopInfo &LI) {
@@ -39,57 +157,326 @@ BranchInst* findGuard(Loop *L, LoopInfo &LI) {
     
     if (auto *guardBranch = dyn_cast<BranchInst>(guardCandidateBlock->getTerminator())) {
         if (guardBranch->isConditional()) {
+            //a guard skips the loop, going where the exit of the loop leads (unlike a runtime versioning check)
+            BasicBlock *exit = L->getExitBlock();
+            BasicBlock *skip = (guardBranch->getSuccessor(0) == preheader) ? guardBranch->getSuccessor(1) : guardBranch->getSuccessor(0);
+            if (!exit || (skip != exit && skip != exit->getSingleSuccessor())) {
+                return nullptr;
+            }
             return guardBranch; 
         }
     }
     return nullptr;
 }
 
-void updateAnalysisInfo(Function &F, DominatorTree &DT, PostDominatorTree &PDT) {
-    // Ricalcolare il Dominator Tree e il Post Dominator Tree
-    DT.recalculate(F);
-    PDT.recalculate(F);
+//a rotated loop leaves from its latch (the shape produced by loop-rotate), the header is part of the body
+bool isRotatedLoop(Loop *L) {
+    BasicBlock *latch = L->getLoopLatch();
+    return latch && L->isLoopExiting(latch) && !L->isLoopExiting(L->getHeader());
 }
 
-void fuseLoops(Loop *L1, Loop *L2, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, Function &F, DependenceInfo &DI, ScalarEvolution &SE, FunctionAnalysisManager &AM) {
+//collect the loops of a perfect nest, from the outermost to the innermost one. Every level
+//has a single subloop, entered right after the header and left right before the latch,
+//so it runs exactly once per iteration of the enclosing loop
+bool getPerfectNestLevels(Loop *L, SmallVectorImpl<Loop *> &levels) {
+    levels.push_back(L);
+    while (!L->isInnermost()) {
+        if (L->getSubLoops().size() != 1) {
+            return false;
+        }
 
-    BranchInst *L1Guard = findGuard(L1, LI);
-    BranchInst *L2Guard = findGuard(L2, LI);
+        Loop *inner = L->getSubLoops().front();
+        BasicBlock *innerPreheader = inner->getLoopPreheader();
+        BasicBlock *innerExit = inner->getExitBlock();
+        BasicBlock *latch = L->getLoopLatch();
+        if (!innerPreheader || !innerExit || !latch) {
+            return false;
+        }
 
-    if (L1Guard && L2Guard) {
-        outs() << "Fusing guarded loops. Rewiring guards...\n";
+        //header, preheader and exit block of the inner loop, latch: nothing else in between
+        if (innerPreheader->getUniquePredecessor() != L->getHeader() || innerPreheader->size() != 1 ||
+            innerExit->getSingleSuccessor() != latch || innerExit->size() != 1 ||
+            L->getNumBlocks() != inner->getNumBlocks() + 4) {
+            return false;
+        }
 
-        BasicBlock *L1Preheader = L1->getLoopPreheader();
-        BasicBlock *finalExitBlock = (L2Guard->getSuccessor(0) == L2->getLoopPreheader()) ? L2Guard->getSuccessor(1) : L2Guard->getSuccessor(0);
+        levels.push_back(inner);
+        L = inner;
+    }
+    return true;
+}
 
-        unsigned fallthroughIndex = (L1Guard->getSuccessor(0) == L1Preheader) ? 1 : 0;
-        L1Guard->setSuccessor(fallthroughIndex, finalExitBlock);
-        
-        outs() << "Guard CFG rewired. First guard now jumps to final exit.\n";
+//tell the DomTreeUpdater how the successors of BB changed after an edit of its terminator
+void updateSuccessors(BasicBlock *BB, ArrayRef<BasicBlock *> oldSuccs, DomTreeUpdater &DTU) {
+    SmallSetVector<BasicBlock *, 4> oldSet(oldSuccs.begin(), oldSuccs.end());
+    SmallSetVector<BasicBlock *, 4> newSet;
+    if (BB->getTerminator()) {
+        newSet.insert(succ_begin(BB), succ_end(BB));
+    }
 
-        BasicBlock *L1ExitBlock = L1->getExitBlock();
-        
-        if (L1ExitBlock && finalExitBlock) {
-            BranchInst *newTerminator = BranchInst::Create(finalExitBlock);
-            
-            ReplaceInstWithInst(L1ExitBlock->getTerminator(), newTerminator);
-            outs() << "Redirected L1 exit block to the final destination.\n";
+    SmallVector<DominatorTree::UpdateType, 4> updates;
+    for (BasicBlock *succ : oldSet) {
+        if (!newSet.count(succ)) {
+            updates.push_back({DominatorTree::Delete, BB, succ});
         }
-        
     }
+    for (BasicBlock *succ : newSet) {
+        if (!oldSet.count(succ)) {
+            updates.push_back({DominatorTree::Insert, BB, succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+}
 
-    
-    PHINode *index1 = L1->getCanonicalInductionVariable();
-    PHINode *index2 = L2->getCanonicalInductionVariable();
+//replace the terminator of a block, keeping the dominator trees up to date
+void replaceTerminator(BasicBlock *BB, Instruction *newTerminator, DomTreeUpdater &DTU) {
+    SmallVector<BasicBlock *, 2> oldSuccs(successors(BB));
+    ReplaceInstWithInst(BB->getTerminator(), newTerminator);
+    updateSuccessors(BB, oldSuccs, DTU);
+}
 
-    if (!index1 || !index2) {
-        outs() << "Induction variables not found\n";
-        return;
+//move every block and subloop of L2, except the dropped ones, into L1
+void mergeLoopInto(Loop *L1, Loop *L2, LoopInfo &LI, ArrayRef<BasicBlock *> dropped) {
+    SmallVector<BasicBlock *, 8> L2Blocks(L2->blocks());
+    for (BasicBlock *BB : L2Blocks) {
+        if (is_contained(dropped, BB)) {
+            continue;
+        }
+        if (LI.getLoopFor(BB) == L2) {
+            LI.changeLoopFor(BB, L1);
+        }
+        //the parents of L1 are the parents of L2, they already contain the block
+        L1->addBlockEntry(BB);
+        L2->removeBlockFromLoop(BB);
+    }
+
+    while (!L2->isInnermost()) {
+        Loop *subLoop = L2->removeChildLoop(std::prev(L2->end()));
+        L1->addChildLoop(subLoop);
+    }
+}
+
+//the affine recurrence of an induction variable of L, null for the other header PHIs
+const SCEVAddRecExpr *getInductionRecurrence(PHINode *phi, Loop *L, ScalarEvolution &SE) {
+    if (!SE.isSCEVable(phi->getType())) {
+        return nullptr;
+    }
+    auto *rec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(phi));
+    if (!rec || rec->getLoop() != L || !rec->isAffine()) {
+        return nullptr;
+    }
+    return rec;
+}
+
+//fusion rewrites the header PHIs of L2 on top of L1: induction variables become AddRecs of L1, whose
+//start and step must be available when the nest of L1 is entered, while the other PHIs (reductions,
+//running minimums...) move to the header of L1, so their initial value must be available there too
+bool canCarryHeaderPHIs(Loop *L1, Loop *L2, DominatorTree &DT, ScalarEvolution &SE) {
+    BasicBlock *L2_preheader = L2->getLoopPreheader();
+    BasicBlock *L2_header = L2->getHeader();
+    BasicBlock *L2_latch = L2->getLoopLatch();
+    if (!L2_preheader || !L2_latch) {
+        return false;
+    }
+
+    //the header of a rotated loop is part of its body, only the latch is dropped
+    bool rotated = isRotatedLoop(L2);
+
+    for (PHINode &phi : L2_header->phis()) {
+        if (const SCEVAddRecExpr *rec = getInductionRecurrence(&phi, L2, SE)) {
+            if (!SE.isAvailableAtLoopEntry(rec->getStart(), L1) ||
+                !SE.isAvailableAtLoopEntry(rec->getStepRecurrence(SE), L1)) {
+                PASS_LOG << "Induction variable " << phi << " cannot be computed in L1\n";
+                return false;
+            }
+            continue;
+        }
+
+        //the initial value is used by the header of L1, the value of the next iteration by its latch
+        auto *init = dyn_cast<Instruction>(phi.getIncomingValueForBlock(L2_preheader));
+        if (init && (L1->contains(init) || !DT.properlyDominates(init->getParent(), L1->getHeader()))) {
+            PASS_LOG << "Initial value of " << phi << " is not available before L1\n";
+            return false;
+        }
+        auto *next = dyn_cast<Instruction>(phi.getIncomingValueForBlock(L2_latch));
+        if (!rotated && next && (next->getParent() == L2_header || next->getParent() == L2_latch)) {
+            PASS_LOG << "Header PHI " << phi << " is updated outside of the body of L2\n";
+            return false;
+        }
+    }
+
+    if (rotated) {
+        return true;
+    }
+
+    //the header and the latch of L2 are dropped: only their PHIs and induction updates may be used elsewhere
+    for (BasicBlock *BB : {L2_header, L2_latch}) {
+        for (Instruction &I : *BB) {
+            if (isa<PHINode>(I)) {
+                continue;
+            }
+            for (User *U : I.users()) {
+                auto *user = cast<Instruction>(U);
+                if (user->getParent() != L2_header && user->getParent() != L2_latch) {
+                    PASS_LOG << I << " is used outside of the header and the latch of L2\n";
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//after the fusion L2 would read the values of L1 while they are still being computed
+bool usesValuesOfLoop(Loop *L2, Loop *L1) {
+    for (BasicBlock *BB : L1->blocks()) {
+        for (Instruction &I : *BB) {
+            for (User *U : I.users()) {
+                auto *user = cast<Instruction>(U);
+                SmallVector<Instruction *, 4> readers = {user};
+                //look through the LCSSA PHIs of L1
+                auto *phi = dyn_cast<PHINode>(user);
+                if (phi && !L1->contains(phi) && phi->getNumIncomingValues() == 1) {
+                    for (User *phiUser : phi->users()) {
+                        readers.push_back(cast<Instruction>(phiUser));
+                    }
+                }
+                for (Instruction *reader : readers) {
+                    if (L2->contains(reader)) {
+                        PASS_LOG << "L2 uses the value " << I << " computed by L1\n";
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+//the iteration spaces of L1 and L2 match, so the k-th value of an induction variable {start,+,step}<L2>
+//is the k-th value of {start,+,step}<L1>: expand it in L1 and drop the PHI of L2. The other header PHIs
+//of L2 are moved to the header of L1, taking their values from the preheader and the latch of L1
+void carryHeaderPHIs(Loop *L1, Loop *L2, ScalarEvolution &SE, Function &F) {
+    SCEVExpander expander(SE, F.getParent()->getDataLayout(), "fusion.iv");
+    BasicBlock *L1_header = L1->getHeader();
+    Instruction *insertPt = &*L1_header->getFirstInsertionPt();
+
+    SmallVector<PHINode *, 4> phis;
+    for (PHINode &phi : L2->getHeader()->phis()) {
+        phis.push_back(&phi);
+    }
+    for (PHINode *phi : phis) {
+        if (const SCEVAddRecExpr *rec = getInductionRecurrence(phi, L2, SE)) {
+            const SCEV *newRec = SE.getAddRecExpr(rec->getStart(), rec->getStepRecurrence(SE), L1, SCEV::FlagAnyWrap);
+            Value *newIndex = expander.expandCodeFor(newRec, phi->getType(), insertPt);
+
+            PASS_LOG << "Induction variable " << *phi << " rewritten as " << *newRec << "\n";
+            phi->replaceAllUsesWith(newIndex);
+            phi->eraseFromParent();
+            continue;
+        }
+
+        SE.forgetValue(phi);
+        phi->moveBefore(L1_header->getFirstNonPHI());
+        phi->replaceIncomingBlockWith(L2->getLoopPreheader(), L1->getLoopPreheader());
+        phi->replaceIncomingBlockWith(L2->getLoopLatch(), L1->getLoopLatch());
+        PASS_LOG << "Header PHI " << *phi << " moved to the header of L1\n";
+    }
+}
+
+//the latch of a rotated loop keeps only its exit branch, so that the bodies of two loops can be chained
+BasicBlock *splitLatch(Loop *L, DomTreeUpdater &DTU, LoopInfo &LI) {
+    BasicBlock *latch = L->getLoopLatch();
+    if (&latch->front() == latch->getTerminator()) {
+        return latch;
+    }
+    return SplitBlock(latch, latch->getTerminator(), &DTU, &LI, nullptr, latch->getName() + ".latch");
+}
+
+//guarded loops: the guard of L1 decides for both loops. The exit block of L1 is then chained to the exit
+//block of L2 by the caller
+void rewireGuards(Loop *L1, Loop *L2, BranchInst *L1Guard, BranchInst *L2Guard, DomTreeUpdater &DTU) {
+    PASS_LOG << "Fusing guarded loops. Rewiring guards...\n";
+
+    BasicBlock *L1GuardBlock = L1Guard->getParent();
+    BasicBlock *L2GuardBlock = L2Guard->getParent();
+    BasicBlock *finalExitBlock = (L2Guard->getSuccessor(0) == L2->getLoopPreheader()) ? L2Guard->getSuccessor(1) : L2Guard->getSuccessor(0);
+
+    //the guards are equivalent: when the first one skips L1, L2 is skipped too
+    SmallVector<BasicBlock *, 2> oldSuccs(successors(L1GuardBlock));
+    L1Guard->replaceUsesOfWith(L2GuardBlock, finalExitBlock);
+    updateSuccessors(L1GuardBlock, oldSuccs, DTU);
+    for (PHINode &phi : finalExitBlock->phis()) {
+        phi.addIncoming(phi.getIncomingValueForBlock(L2GuardBlock), L1GuardBlock);
+    }
+    //the guard of L2 is left unreachable, it no longer leads to the final exit
+    finalExitBlock->removePredecessor(L2GuardBlock, true);
+    replaceTerminator(L2GuardBlock, BranchInst::Create(L2->getLoopPreheader()), DTU);
+
+    //the PHIs between the loops merge the results of L1 from its exit and from its guard: they now
+    //merge them where both guards lead, reached from the exit block of L2 once the fused loop is done
+    for (PHINode &phi : make_early_inc_range(L2GuardBlock->phis())) {
+        phi.moveBefore(finalExitBlock->getFirstNonPHI());
+        phi.replaceIncomingBlockWith(L1->getExitBlock(), L2->getExitBlock());
+    }
+    PASS_LOG << "Guard CFG rewired. First guard now jumps to final exit.\n";
+}
+
+//rotated loops exit from their latch and are usually guarded: the body of L2 runs between the body and the
+//latch of L1, the exit block of L1 continues into the exit block of L2 and the guard of L1 decides for both
+bool fuseRotatedLoops(Loop *L1, Loop *L2, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE, Function &F) {
+    BranchInst *L1Guard = findGuard(L1, LI);
+    BranchInst *L2Guard = findGuard(L2, LI);
+    BasicBlock *L1_exit = L1->getExitBlock();
+    BasicBlock *L2_exit = L2->getExitBlock();
+
+    BasicBlock *L1_latch = splitLatch(L1, DTU, LI);
+    BasicBlock *L2_latch = splitLatch(L2, DTU, LI);
+    BasicBlock *L1_body_end = L1_latch->getUniquePredecessor();
+    BasicBlock *L2_body_end = L2_latch->getUniquePredecessor();
+    if (!L1_body_end || !L2_body_end) {
+        PASS_LOG << "The latches of the rotated loops cannot be separated from their bodies\n";
+        return false;
+    }
+
+    DTU.flush();
+    carryHeaderPHIs(L1, L2, SE, F);
+
+    if (L1Guard && L2Guard) {
+        rewireGuards(L1, L2, L1Guard, L2Guard, DTU);
+    }
+
+    //after the last iteration of the fused loop, the exit block of L1 continues into the exit block of L2
+    replaceTerminator(L1_exit, BranchInst::Create(L2_exit), DTU);
+    //the latch of L2 is left unreachable: its incoming values are dropped when it is deleted
+    for (PHINode &phi : L2_exit->phis()) {
+        phi.addIncoming(phi.getIncomingValueForBlock(L2_latch), L1_exit);
     }
+    PASS_LOG << "Redirected L1 exit block to the exit block of L2.\n";
+
+    //the body of L2 runs right after the body of L1, then the latch of L1 decides whether to iterate
+    replaceTerminator(L1_body_end, BranchInst::Create(L2->getHeader()), DTU);
+    replaceTerminator(L2_body_end, BranchInst::Create(L1_latch), DTU);
+
+    mergeLoopInto(L1, L2, LI, {L2_latch});
+    return true;
+}
+
+bool fuseLoops(Loop *L1, Loop *L2, DominatorTree &DT, DomTreeUpdater &DTU, LoopInfo &LI, Function &F, ScalarEvolution &SE) {
 
-    index2->replaceAllUsesWith(index1);
-    index2->eraseFromParent();
+    //SCEV and the expander query the dominator tree: apply the pending updates first
+    DTU.flush();
+    if (!L1->getLoopPreheader() || !L1->getLoopLatch() || !canCarryHeaderPHIs(L1, L2, DT, SE)) {
+        PASS_LOG << "Header PHIs of L2 cannot be carried into L1\n";
+        return false;
+    }
+    if (isRotatedLoop(L1)) {
+        return fuseRotatedLoops(L1, L2, DTU, LI, SE, F);
+    }
+    carryHeaderPHIs(L1, L2, SE, F);
 
+    BranchInst *L1Guard = findGuard(L1, LI);
+    BranchInst *L2Guard = findGuard(L2, LI);
     SmallVector<BasicBlock *> L2_exit_blocks;
     L2->getExitBlocks(L2_exit_blocks);
 
@@ -109,52 +496,113 @@ void fuseLoops(Loop *L1, Loop *L2, DominatorTree &DT, PostDominatorTree &PDT, Lo
         }
     }
 
-    if (!L1Guard) {
+    if (L1Guard && L2Guard) {
+        rewireGuards(L1, L2, L1Guard, L2Guard, DTU);
+    }
+    //guarded loops are not adjacent: the exit block of L1 leads to the guard of L2, or to L2 once its guard is split
+    BasicBlock *L1_exit = L1->getExitBlock();
+    if (L1_exit != L2->getLoopPreheader()) {
+        //the fused loop still leaves from the header of L1: its exit block continues into the exit block of L2
+        BasicBlock *L2_exit = L2->getExitBlock();
+        replaceTerminator(L1_exit, BranchInst::Create(L2_exit), DTU);
+        L2_exit->replacePhiUsesWith(L2_header, L1_exit);
+        PASS_LOG << "Redirected L1 exit block to the exit block of L2.\n";
+    } else {
+        //the exit block of L1 is left unreachable: its LCSSA PHIs only forward values of the header of L1
+        for (PHINode &phi : make_early_inc_range(L1_exit->phis())) {
+            if (phi.getNumIncomingValues() == 1) {
+                phi.replaceAllUsesWith(phi.getIncomingValue(0));
+                phi.eraseFromParent();
+            }
+        }
+
         for (BasicBlock *BB : L2_exit_blocks) {
             for (pred_iterator pit = pred_begin(BB); pit != pred_end(BB); pit++) {
                 BasicBlock *predecessor = dyn_cast<BasicBlock>(*pit);
                 if (predecessor == L2_header) {
+                    SmallVector<BasicBlock *, 2> oldSuccs(successors(L1_header));
                     L1_header->getTerminator()->replaceUsesOfWith(L2->getLoopPreheader(), BB);
-                }
-            }
-        }
-    }
-
-    if (L1_latch->getTerminator()->getNumSuccessors() == 1) {
-        BranchInst *jump_to_L2_body = BranchInst::Create(L2_body_start);
-        ReplaceInstWithInst(L1_body_end->getTerminator(), jump_to_L2_body);
-    } else {
-        Instruction &first = L1_header->front();
-        BasicBlock *oldBB = L1_body_end->getTerminator()->getSuccessor(0);
-        if (PHINode *phi = dyn_cast<PHINode>(&first)) {
-            for (unsigned i = 0; i < phi->getNumIncomingValues(); ++i) {
-                if (phi->getIncomingBlock(i) == oldBB) {
-                    phi->setIncomingBlock(i, L2_body_start);
-                    oldBB->getTerminator()->eraseFromParent();
+                    updateSuccessors(L1_header, oldSuccs, DTU);
+                    //the live-outs of L2 now leave the fused loop from the header of L1
+                    BB->replacePhiUsesWith(L2_header, L1_header);
                     break;
                 }
             }
         }
-        BranchInst *jump_to_L2_body = BranchInst::Create(L2_body_start->getTerminator()->getSuccessor(0));
-        ReplaceInstWithInst(L1_body_end->getTerminator(), jump_to_L2_body);
-        L2_body_start->getTerminator()->replaceUsesOfWith(L2_header, L1_header);
     }
 
+    BranchInst *jump_to_L2_body = BranchInst::Create(L2_body_start);
+    replaceTerminator(L1_body_end, jump_to_L2_body, DTU);
+
     BranchInst *jump_to_L1_latch = BranchInst::Create(L1_latch);
-    ReplaceInstWithInst(L2_body_end->getTerminator(), jump_to_L1_latch);
+    replaceTerminator(L2_body_end, jump_to_L1_latch, DTU);
 
     BranchInst *jump_to_L2_latch = BranchInst::Create(L2_latch);
-    ReplaceInstWithInst(L2_header->getTerminator(), jump_to_L2_latch);
+    replaceTerminator(L2_header, jump_to_L2_latch, DTU);
+
+    mergeLoopInto(L1, L2, LI, {L2_header, L2_latch});
+    return true;
+}
+
+//drop the blocks left unreachable by the fusion from LoopInfo, then delete them
+void deleteUnreachableBlocks(Function &F, LoopInfo &LI, DomTreeUpdater &DTU) {
+    df_iterator_default_set<BasicBlock *> reachable;
+    for (BasicBlock *BB : depth_first_ext(&F, reachable)) {
+        (void)BB;
+    }
+
+    for (BasicBlock &BB : F) {
+        if (!reachable.count(&BB)) {
+            LI.removeBlock(&BB);
+        }
+    }
+    EliminateUnreachableBlocks(F, &DTU);
+}
+
+//fuse two perfect nests level by level, from the outermost to the innermost loops. The caller has checked
+//every level beforehand: a level failing here leaves the enclosing ones fused, and false is returned
+bool fuseLoopNests(ArrayRef<Loop *> levels1, ArrayRef<Loop *> levels2, DominatorTree &DT, DomTreeUpdater &DTU, LoopInfo &LI, Function &F, ScalarEvolution &SE) {
+    //only the SCEVs of the two nests are affected by the fusion
+    SE.forgetLoop(levels1.front());
+    SE.forgetLoop(levels2.front());
+
+    unsigned fusedLevels = 0;
+    for (unsigned k = 0; k < levels1.size(); ++k) {
+        if (k > 0) {
+            //after fusing the enclosing loops, the exit block of the inner loop of L1 jumps to the
+            //(empty) preheader of the inner loop of L2: merge them to make the inner loops adjacent
+            MergeBlockIntoPredecessor(levels2[k]->getLoopPreheader(), &DTU, &LI);
+        }
+        if (!fuseLoops(levels1[k], levels2[k], DT, DTU, LI, F, SE)) {
+            break;
+        }
+        ++fusedLevels;
+    }
 
-    EliminateUnreachableBlocks(F);
-    updateAnalysisInfo(F, DT, PDT);
+    deleteUnreachableBlocks(F, LI, DTU);
+    PASS_LOG << "Deleted unreachable blocks\n";
 
-    outs() << "Deleted unreachable blocks\n";
+    //the fused loops of L2 are now empty: remove them from the loop forest
+    for (unsigned k = fusedLevels; k > 0; --k) {
+        Loop *L2 = levels2[k - 1];
+        if (Loop *parent = L2->getParentLoop()) {
+            parent->removeChildLoop(L2);
+        } else {
+            LI.removeLoop(llvm::find(LI, L2));
+        }
+        LI.destroy(L2);
+    }
+
+    //the LCSSA PHIs of L1 are folded and the exit blocks merged: values of the fused loop may now be used
+    //after it directly, so the PHIs are created again
+    DTU.flush();
+    formLCSSARecursively(*levels1.front(), DT, &LI, &SE);
+    return fusedLevels == levels1.size();
 }
 
 bool areLoopsAdjacent(Loop *L1, Loop *L2, LoopInfo &LI) {
     if (!L1 || !L2) {
-        outs() << "Either L1 or L2 is a NULL pointer \n";
+        PASS_LOG << "Either L1 or L2 is a NULL pointer \n";
         return false;
     }
 
@@ -163,7 +611,7 @@ bool areLoopsAdjacent(Loop *L1, Loop *L2, LoopInfo &LI) {
     
 
     if (L1Guard && L2Guard) {
-        outs() << "L1 and L2 are guarded loops (didactic check)\n";
+        PASS_LOG << "L1 and L2 are guarded loops (didactic check)\n";
 
         BasicBlock *L1GuardBlock = L1Guard->getParent();
         BasicBlock *L2GuardBlock = L2Guard->getParent();
@@ -171,23 +619,23 @@ bool areLoopsAdjacent(Loop *L1, Loop *L2, LoopInfo &LI) {
         BasicBlock *FallthroughBlock = (L1Guard->getSuccessor(0) == L1Preheader) ? L1Guard->getSuccessor(1) : L1Guard->getSuccessor(0);
 
         if (FallthroughBlock == L2GuardBlock) {
-             outs() << "Guarded loops are adjacent.\n";
+             PASS_LOG << "Guarded loops are adjacent.\n";
              return true;
         }
         
     } else if (!L1Guard && !L2Guard) {
-        outs() << "L1 and L2 are unguarded loops \n";
+        PASS_LOG << "L1 and L2 are unguarded loops \n";
         BasicBlock *L1ExitingBlock = L1->getExitBlock();
         BasicBlock *L2Preheader = L2->getLoopPreheader();
 
         if (!L2Preheader) {
-            outs() << "L2 has a NULL Preheader! \n";
+            PASS_LOG << "L2 has a NULL Preheader! \n";
             return false;
         }
 
-        outs() << "L2Preheader: ";
-        L2Preheader->print(outs());
-        outs() << "\n";
+        PASS_LOG << "L2Preheader: ";
+        if (AssignmentsLog) L2Preheader->print(*AssignmentsLog);
+        PASS_LOG << "\n";
 
 
         if (!L1ExitingBlock) {
@@ -202,20 +650,24 @@ bool areLoopsAdjacent(Loop *L1, Loop *L2, LoopInfo &LI) {
         }
 
 
-        outs() << "L1ExitingBlock: ";
-        L1ExitingBlock->print(outs());
-        outs() << "\n";
+        PASS_LOG << "L1ExitingBlock: ";
+        if (AssignmentsLog) L1ExitingBlock->print(*AssignmentsLog);
+        PASS_LOG << "\n";
 
         if (L1ExitingBlock && L2Preheader) {
             if (L1ExitingBlock == L2Preheader) {
                 int instructionCount = 0;
                 for (Instruction &I : *L1ExitingBlock) {
-                    (void)I; // Suppress unused variable warning
+                    //LCSSA PHIs only forward the live-outs of L1, fusion folds them away
+                    auto *phi = dyn_cast<PHINode>(&I);
+                    if (phi && phi->getNumIncomingValues() == 1) {
+                        continue;
+                    }
                     ++instructionCount;
-                    outs() << "Found instruction " << I << " inside the preheader \n";
+                    PASS_LOG << "Found instruction " << I << " inside the preheader \n";
                 }
                 if (instructionCount == 1) {
-                    outs() << "The exit block of L1 corresponds to the preheader of L2 \n";
+                    PASS_LOG << "The exit block of L1 corresponds to the preheader of L2 \n";
                     return true;
                 }
                 return false;
@@ -224,92 +676,414 @@ bool areLoopsAdjacent(Loop *L1, Loop *L2, LoopInfo &LI) {
 
 
     } else {
-        outs() << "One loop is guarded, the other one is not \n";
+        PASS_LOG << "One loop is guarded, the other one is not \n";
     }
 
     return false;
 }
 
-bool controlFlowEquivalent(Loop *L1, Loop *L2, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI) {
-    
-    BranchInst *L1Guard = findGuard(L1, LI);
-    BranchInst *L2Guard = findGuard(L2, LI);
-
-    if (L1Guard && L2Guard) {
-        outs() << "Checking control flow equivalence for GUARDED loops.\n";
-        
-        Value *Cond1_Value = L1Guard->getCondition();
-        Value *Cond2_Value = L2Guard->getCondition();
+//fusion rewires two shapes of loops: loops leaving from the header (the output of mem2reg and loop-simplify)
+//and rotated loops leaving from the latch. Both loops must have the same shape, and may be guarded
+bool haveFusibleShapes(Loop *L1, Loop *L2, LoopInfo &LI) {
+    for (Loop *L : {L1, L2}) {
+        if (!L->getLoopPreheader() || !L->getLoopLatch() || !L->getExitingBlock() || !L->getExitBlock()) {
+            PASS_LOG << "Loops must have a single exit, a preheader and a latch \n";
+            return false;
+        }
+    }
 
-        auto *Cond1_Inst = dyn_cast<Instruction>(Cond1_Value);
-        auto *Cond2_Inst = dyn_cast<Instruction>(Cond2_Value);
+    bool rotated = isRotatedLoop(L1);
+    if (rotated != isRotatedLoop(L2)) {
+        PASS_LOG << "Only one of the loops is rotated \n";
+        return false;
+    }
 
-        if (Cond1_Inst && Cond2_Inst && Cond1_Inst->isIdenticalTo(Cond2_Inst)) {
-            outs() << "Guard conditions are semantically equivalent.\n";
+    BranchInst *L1Guard = findGuard(L1, LI);
+    BranchInst *L2Guard = findGuard(L2, LI);
+    if (!rotated) {
+        for (Loop *L : {L1, L2}) {
+            if (L->getExitingBlock() != L->getHeader() || L->getHeader() == L->getLoopLatch()) {
+                PASS_LOG << "Loops must leave from their header \n";
+                return false;
+            }
+            //the end of the body is chained to the other loop
+            if (!L->getLoopLatch()->getUniquePredecessor()) {
+                PASS_LOG << "The latch must be reached from a single block of the body \n";
+                return false;
+            }
+        }
+        //unguarded loops leave the fused loop from the header of L1 to the exit block of L2
+        if (!L1Guard) {
             return true;
-        } else {
-            outs() << "Guard conditions are NOT semantically equivalent.\n";
-            return false;
+        }
+    } else {
+        //the latches are split from their bodies, the bodies are then chained
+        for (Loop *L : {L1, L2}) {
+            BasicBlock *latch = L->getLoopLatch();
+            if (&latch->front() == latch->getTerminator() && !latch->getUniquePredecessor()) {
+                PASS_LOG << "The latch of a rotated loop must have a single predecessor \n";
+                return false;
+            }
         }
     }
-    
-    else if (!L1Guard && !L2Guard) {
-        outs() << "Checking control flow equivalence for UNGUARDED loops.\n";
-        return (DT.dominates(L1->getHeader(), L2->getHeader()) && 
-                PDT.dominates(L2->getHeader(), L1->getHeader()));
+
+    //the exit block of L1 jumps to the exit block of L2, which is then only reached from the fused loop
+    BasicBlock *L1Exit = L1->getExitBlock();
+    BasicBlock *L2Exit = L2->getExitBlock();
+    if (L2Exit->getSinglePredecessor() != L2->getExitingBlock()) {
+        PASS_LOG << "The exit block of L2 must be reached only from its exiting block \n";
+        return false;
     }
-    
-    else {
-        outs() << "Mixed loop types (guarded/unguarded), not equivalent.\n";
+    if (&*L1Exit->getFirstInsertionPt() != L1Exit->getTerminator()) {
+        PASS_LOG << "The exit block of L1 must only contain PHIs \n";
         return false;
     }
-}
+    if (!L1Guard) {
+        return L1Exit == L2->getLoopPreheader();
+    }
 
-const SCEVAddRecExpr *getSCEVAddRec(Instruction *I, Loop *L, ScalarEvolution &SE) {
-    SmallPtrSet<const SCEVPredicate *, 4> preds;
-    //SCEV representation of the pointer operand of the load/store instruction inside the scope of the loop
-    const SCEV *Instruction_SCEV = SE.getSCEVAtScope(getLoadStorePointerOperand(I), L);
-    //convert the SCEV instruction to a polynomial recurrence on the trip count of the specified loop
-    const SCEVAddRecExpr *rec = SE.convertSCEVToAddRecWithPredicates(Instruction_SCEV, L, preds);
-    return rec;
+    //the preheader of L2 is no longer reached: it must not compute anything
+    BasicBlock *L2Preheader = L2->getLoopPreheader();
+    if (&L2Preheader->front() != L2Preheader->getTerminator()) {
+        PASS_LOG << "The preheader of a guarded L2 must be empty \n";
+        return false;
+    }
+
+    //the guard of L2 is removed: its block must only hold the PHIs of the results of L1 and the guard itself
+    BasicBlock *L1GuardBlock = L1Guard->getParent();
+    BasicBlock *L2GuardBlock = L2Guard->getParent();
+    BasicBlock *finalExitBlock = (L2Guard->getSuccessor(0) == L2->getLoopPreheader()) ? L2Guard->getSuccessor(1) : L2Guard->getSuccessor(0);
+    if (L1Exit->getSingleSuccessor() != L2GuardBlock || L2Exit->getSingleSuccessor() != finalExitBlock) {
+        PASS_LOG << "The exit blocks of the guarded loops must lead to their guards \n";
+        return false;
+    }
+    for (Instruction &I : *L2GuardBlock) {
+        for (User *U : I.users()) {
+            auto *user = cast<Instruction>(U);
+            BasicBlock *userBlock = user->getParent();
+            if (isa<PHINode>(I) ? (userBlock == L2GuardBlock || userBlock == L2Exit || L2->contains(userBlock))
+                                : userBlock != L2GuardBlock) {
+                PASS_LOG << I << " is used across the guard of L2 \n";
+                return false;
+            }
+        }
+        auto *phi = dyn_cast<PHINode>(&I);
+        if (!phi) {
+            continue;
+        }
+        for (BasicBlock *incoming : phi->blocks()) {
+            if (incoming != L1Exit && incoming != L1GuardBlock) {
+                PASS_LOG << *phi << " is not a result of the guarded L1 \n";
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
-bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instruction *inst2, ScalarEvolution &SE) {
-    outs() << "Checking if the access distance between " << *inst1 << " and " << *inst2 << " is negative\n";
-    //get polynomial recurrences on the trip count for the dependend instructions
-    const SCEVAddRecExpr *inst1_add_rec = getSCEVAddRec(inst1, loop1, SE); //es: {%a,+,4}<nw><%for.cond>
-    const SCEVAddRecExpr *inst2_add_rec = getSCEVAddRec(inst2, loop2, SE);
+//collect the instructions of the loop that may read or write memory
+void collectMemoryInstructions(Loop *L, SmallVectorImpl<Instruction *> &memInsts) {
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (I.mayReadOrWriteMemory()) {
+                memInsts.push_back(&I);
+            }
+        }
+    }
+}
 
-    //check if both polynomial recurrences were found
-    if (!(inst1_add_rec && inst2_add_rec)) {
-        outs() << "Can't find a polynomial recurrence for inst!\n";
+//check if two instructions may access the same memory location with at least one write
+bool mayConflict(Instruction *I1, Instruction *I2, DependenceInfo &DI) {
+    if (!I1->mayReadOrWriteMemory() || !I2->mayReadOrWriteMemory()) {
+        return false;
+    }
+    if (!I1->mayWriteToMemory() && !I2->mayWriteToMemory()) {
         return false;
     }
+    return DI.depends(I1, I2, true) != nullptr;
+}
 
-    outs() << "Polynomial recurrence of " << *inst1 << ": ";
-    inst1_add_rec->print(outs());
-    outs() << "\n";
+//check if the code between two unguarded loops can be moved above L1 (into its preheader)
+//or below L2 (into its exit block), so that the exit block of L1 becomes an empty preheader of L2
+bool canMakeLoopsAdjacent(Loop *L1, Loop *L2, DominatorTree &DT, DependenceInfo &DI, LoopInfo &LI,
+                          SmallVectorImpl<Instruction *> &toHoist, SmallVectorImpl<Instruction *> &toSink) {
+    if (findGuard(L1, LI) || findGuard(L2, LI)) {
+        PASS_LOG << "Code motion is only supported between unguarded loops \n";
+        return false;
+    }
 
-    outs() << "Pointer base of ";
-    inst1_add_rec->print(outs());
-    outs() << ": ";
-    SE.getPointerBase(inst1_add_rec)->print(outs());
-    outs() << "\n";
+    BasicBlock *L1Preheader = L1->getLoopPreheader();
+    BasicBlock *L2Preheader = L2->getLoopPreheader();
+    if (!L1Preheader || !L2Preheader || L1->getExitBlock() != L2Preheader) {
+        PASS_LOG << "The exit block of L1 is not the preheader of L2 \n";
+        return false;
+    }
 
+    //collect the intervening instructions and make sure they can be moved at all
+    SmallVector<Instruction *, 8> intervening;
+    for (Instruction &I : *L2Preheader) {
+        auto *phi = dyn_cast<PHINode>(&I);
+        if (I.isTerminator() || (phi && phi->getNumIncomingValues() == 1)) {
+            continue;
+        }
+        bool isSimpleAccess = true;
+        if (auto *load = dyn_cast<LoadInst>(&I)) {
+            isSimpleAccess = load->isSimple();
+        } else if (auto *store = dyn_cast<StoreInst>(&I)) {
+            isSimpleAccess = store->isSimple();
+        }
+        if (isa<PHINode>(I) || I.isEHPad() || I.mayThrow() || !isSimpleAccess ||
+            (I.mayHaveSideEffects() && !isa<StoreInst>(I))) {
+            PASS_LOG << "Cannot move " << I << "\n";
+            return false;
+        }
+        intervening.push_back(&I);
+    }
 
-    outs() << "Polynomial recurrence of " << *inst2 << ": ";
-    inst2_add_rec->print(outs());
-    outs() << "\n";
+    SmallVector<Instruction *, 16> L1MemInsts;
+    SmallVector<Instruction *, 16> L2MemInsts;
+    collectMemoryInstructions(L1, L1MemInsts);
+    collectMemoryInstructions(L2, L2MemInsts);
 
-    outs() << "Pointer base of ";
-    inst2_add_rec->print(outs());
-    outs() << ": ";
-    SE.getPointerBase(inst2_add_rec)->print(outs());
-    outs() << "\n";
+    //hoisting: walk forward, an instruction can go above L1 if its operands are available
+    //in the preheader of L1 and it doesn't conflict with L1 or with the instructions it overtakes
+    SmallPtrSet<Instruction *, 8> hoisted;
+    Instruction *hoistPoint = L1Preheader->getTerminator();
+    for (unsigned i = 0; i < intervening.size(); ++i) {
+        Instruction *I = intervening[i];
+        bool canHoist = true;
 
-    //if the instructions don't share the same pointer base, then the dependence is not negative
+        for (Value *op : I->operands()) {
+            auto *opInst = dyn_cast<Instruction>(op);
+            if (opInst && !hoisted.count(opInst) && !DT.dominates(opInst, hoistPoint)) {
+                canHoist = false;
+                break;
+            }
+        }
+
+        for (unsigned j = 0; canHoist && j < i; ++j) {
+            if (!hoisted.count(intervening[j]) && mayConflict(intervening[j], I, DI)) {
+                canHoist = false;
+            }
+        }
+
+        for (Instruction *memInst : L1MemInsts) {
+            if (!canHoist) {
+                break;
+            }
+            if (mayConflict(memInst, I, DI)) {
+                canHoist = false;
+            }
+        }
+
+        if (canHoist) {
+            PASS_LOG << "Hoisting " << *I << " above L1\n";
+            hoisted.insert(I);
+            toHoist.push_back(I);
+        }
+    }
+
+    //sinking: walk backward, an instruction can go below L2 if all its users are already sunk
+    //or dominated by the exit block of L2, and it doesn't conflict with L2
+    BasicBlock *L2Exit = L2->getExitBlock();
+    SmallPtrSet<Instruction *, 8> sunk;
+    for (Instruction *I : reverse(intervening)) {
+        if (hoisted.count(I)) {
+            continue;
+        }
+
+        if (!L2Exit) {
+            PASS_LOG << "L2 has no unique exit block, cannot sink " << *I << "\n";
+            return false;
+        }
+
+        for (Use &U : I->uses()) {
+            auto *userInst = cast<Instruction>(U.getUser());
+            if (sunk.count(userInst)) {
+                continue;
+            }
+            BasicBlock *useBlock = userInst->getParent();
+            if (auto *phi = dyn_cast<PHINode>(userInst)) {
+                useBlock = phi->getIncomingBlock(U);
+            }
+            if (useBlock == L2Preheader || L2->contains(useBlock) || !DT.dominates(L2Exit, useBlock)) {
+                PASS_LOG << "Cannot move " << *I << ": used by " << *userInst << "\n";
+                return false;
+            }
+        }
+
+        for (Instruction *memInst : L2MemInsts) {
+            if (mayConflict(I, memInst, DI)) {
+                PASS_LOG << "Cannot move " << *I << ": conflicts with both loops\n";
+                return false;
+            }
+        }
+
+        PASS_LOG << "Sinking " << *I << " below L2\n";
+        sunk.insert(I);
+        toSink.push_back(I);
+    }
+
+    //restore the original order of the sunk instructions
+    std::reverse(toSink.begin(), toSink.end());
+    return true;
+}
+
+//move the intervening code computed by canMakeLoopsAdjacent out of the way
+void moveInterveningCode(Loop *L1, Loop *L2, ArrayRef<Instruction *> toHoist, ArrayRef<Instruction *> toSink) {
+    Instruction *hoistPoint = L1->getLoopPreheader()->getTerminator();
+    for (Instruction *I : toHoist) {
+        I->moveBefore(hoistPoint);
+    }
+
+    if (toSink.empty()) {
+        return;
+    }
+
+    Instruction *sinkPoint = &*L2->getExitBlock()->getFirstInsertionPt();
+    for (Instruction *I : toSink) {
+        I->moveBefore(sinkPoint);
+    }
+}
+
+//the comparison that lets a guarded loop run: the predicate is inverted when the guard enters the loop on false
+bool getGuardComparison(BranchInst *guard, Loop *L, ICmpInst::Predicate &pred, Value *&lhs, Value *&rhs) {
+    auto *cmp = dyn_cast<ICmpInst>(guard->getCondition());
+    if (!cmp) {
+        return false;
+    }
+    pred = cmp->getPredicate();
+    lhs = cmp->getOperand(0);
+    rhs = cmp->getOperand(1);
+    if (guard->getSuccessor(1) == L->getLoopPreheader()) {
+        pred = ICmpInst::getInversePredicate(pred);
+    }
+    return true;
+}
+
+//two guards are equivalent when each loop is entered exactly when the other one is
+bool guardsAreEquivalent(Loop *L1, BranchInst *L1Guard, Loop *L2, BranchInst *L2Guard, ScalarEvolution &SE) {
+    //the same comparison, possibly written with swapped operands or on values SCEV proves equal
+    ICmpInst::Predicate pred1, pred2;
+    Value *lhs1, *rhs1, *lhs2, *rhs2;
+    if (getGuardComparison(L1Guard, L1, pred1, lhs1, rhs1) && getGuardComparison(L2Guard, L2, pred2, lhs2, rhs2)) {
+        if (pred1 != pred2) {
+            std::swap(lhs2, rhs2);
+            pred2 = ICmpInst::getSwappedPredicate(pred2);
+        }
+        if (pred1 == pred2 && lhs1->getType() == lhs2->getType() && SE.isSCEVable(lhs1->getType()) &&
+            SE.isKnownPredicate(ICmpInst::ICMP_EQ, SE.getSCEV(lhs1), SE.getSCEV(lhs2)) &&
+            SE.isKnownPredicate(ICmpInst::ICMP_EQ, SE.getSCEV(rhs1), SE.getSCEV(rhs2))) {
+            return true;
+        }
+    }
+
+    //otherwise the outcome of the first guard must decide the outcome of the second one, both when
+    //it enters L1 and when it skips it: an implication in a single direction is not enough
+    const DataLayout &DL = L1->getHeader()->getModule()->getDataLayout();
+    bool enters1 = L1Guard->getSuccessor(0) == L1->getLoopPreheader();
+    bool enters2 = L2Guard->getSuccessor(0) == L2->getLoopPreheader();
+    auto whenEntered = isImpliedCondition(L1Guard->getCondition(), L2Guard->getCondition(), DL, enters1);
+    auto whenSkipped = isImpliedCondition(L1Guard->getCondition(), L2Guard->getCondition(), DL, !enters1);
+    return whenEntered && *whenEntered == enters2 && whenSkipped && *whenSkipped == !enters2;
+}
+
+//the guard of L2 is implied by the one of L1 in a single direction: L2 always runs after L1, but it may also
+//run when L1 is skipped. The guard of L2 is then only kept on the path that skips L1
+bool guardImpliesGuard(Loop *L1, BranchInst *L1Guard, Loop *L2, BranchInst *L2Guard) {
+    const DataLayout &DL = L1->getHeader()->getModule()->getDataLayout();
+    bool enters1 = L1Guard->getSuccessor(0) == L1->getLoopPreheader();
+    bool enters2 = L2Guard->getSuccessor(0) == L2->getLoopPreheader();
+    auto whenEntered = isImpliedCondition(L1Guard->getCondition(), L2Guard->getCondition(), DL, enters1);
+    return whenEntered && *whenEntered == enters2;
+}
+
+bool controlFlowEquivalent(Loop *L1, Loop *L2, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, ScalarEvolution &SE) {
+    
+    BranchInst *L1Guard = findGuard(L1, LI);
+    BranchInst *L2Guard = findGuard(L2, LI);
+
+    if (L1Guard && L2Guard) {
+        PASS_LOG << "Checking control flow equivalence for GUARDED loops.\n";
+
+        BasicBlock *L1GuardBlock = L1Guard->getParent();
+        BasicBlock *L2GuardBlock = L2Guard->getParent();
+        if (!DT.dominates(L1GuardBlock, L2GuardBlock) || !PDT.dominates(L2GuardBlock, L1GuardBlock)) {
+            PASS_LOG << "Guards are not executed under the same conditions.\n";
+            return false;
+        }
+
+        if (guardsAreEquivalent(L1, L1Guard, L2, L2Guard, SE)) {
+            PASS_LOG << "Guard conditions are semantically equivalent.\n";
+            return true;
+        } else if (guardImpliesGuard(L1, L1Guard, L2, L2Guard)) {
+            PASS_LOG << "The guard of L1 implies the guard of L2.\n";
+            return true;
+        } else {
+            PASS_LOG << "Guard conditions are NOT semantically equivalent.\n";
+            return false;
+        }
+    }
+    
+    else if (!L1Guard && !L2Guard) {
+        PASS_LOG << "Checking control flow equivalence for UNGUARDED loops.\n";
+        return (DT.dominates(L1->getHeader(), L2->getHeader()) && 
+                PDT.dominates(L2->getHeader(), L1->getHeader()));
+    }
+    
+    else {
+        PASS_LOG << "Mixed loop types (guarded/unguarded), not equivalent.\n";
+        return false;
+    }
+}
+
+const SCEVAddRecExpr *getSCEVAddRec(Instruction *I, Loop *L, ScalarEvolution &SE) {
+    SmallPtrSet<const SCEVPredicate *, 4> preds;
+    //SCEV representation of the pointer operand of the load/store instruction inside the scope of the loop
+    const SCEV *Instruction_SCEV = SE.getSCEVAtScope(getLoadStorePointerOperand(I), L);
+    //convert the SCEV instruction to a polynomial recurrence on the trip count of the specified loop
+    const SCEVAddRecExpr *rec = SE.convertSCEVToAddRecWithPredicates(Instruction_SCEV, L, preds);
+    return rec;
+}
+
+bool isDistanceNegative(const memoryAccess &access1, const memoryAccess &access2, ScalarEvolution &SE, unsigned peelCount = 0) {
+    Instruction *inst1 = access1.inst;
+    Instruction *inst2 = access2.inst;
+    PASS_LOG << "Checking if the access distance between " << *inst1 << " and " << *inst2 << " is negative\n";
+    //polynomial recurrences on the trip count of the dependent instructions, from their access descriptors
+    const SCEVAddRecExpr *inst1_add_rec = access1.rec; //es: {%a,+,4}<nw><%for.cond>
+    const SCEVAddRecExpr *inst2_add_rec = access2.rec;
+
+    //without both polynomial recurrences the distance is unknown: assume it may be negative
+    if (!(inst1_add_rec && inst2_add_rec)) {
+        PASS_LOG << "Can't find a polynomial recurrence for inst!\n";
+        return true;
+    }
+
+    PASS_LOG << "Polynomial recurrence of " << *inst1 << ": ";
+    if (AssignmentsLog) inst1_add_rec->print(*AssignmentsLog);
+    PASS_LOG << "\n";
+
+    PASS_LOG << "Pointer base of ";
+    if (AssignmentsLog) inst1_add_rec->print(*AssignmentsLog);
+    PASS_LOG << ": ";
+    if (AssignmentsLog) SE.getPointerBase(inst1_add_rec)->print(*AssignmentsLog);
+    PASS_LOG << "\n";
+
+
+    PASS_LOG << "Polynomial recurrence of " << *inst2 << ": ";
+    if (AssignmentsLog) inst2_add_rec->print(*AssignmentsLog);
+    PASS_LOG << "\n";
+
+    PASS_LOG << "Pointer base of ";
+    if (AssignmentsLog) inst2_add_rec->print(*AssignmentsLog);
+    PASS_LOG << ": ";
+    if (AssignmentsLog) SE.getPointerBase(inst2_add_rec)->print(*AssignmentsLog);
+    PASS_LOG << "\n";
+
+    //if the instructions don't share the same pointer base, then the dependence is not negative
     if (SE.getPointerBase(inst1_add_rec) != SE.getPointerBase(inst2_add_rec)) { //es: %a != %b
-        outs() << "Different pointer base\n";
+        PASS_LOG << "Different pointer base\n";
         return false;
     }
 
@@ -318,47 +1092,53 @@ bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instructio
     const SCEV *start_first_inst = inst1_add_rec->getStart(); //es: %a
     const SCEV *start_second_inst = inst2_add_rec->getStart();
 
-    outs() << "Start index of ";
-    inst1_add_rec->print(outs());
-    outs() << ": ";
-    start_first_inst->print(outs());
-    outs() << "\n";
+    //if the first iterations of loop1 are peeled, the fused loop starts from iteration peelCount of loop1
+    if (peelCount) {
+        const SCEV *step = inst1_add_rec->getStepRecurrence(SE);
+        start_first_inst = SE.getAddExpr(start_first_inst, SE.getMulExpr(SE.getConstant(step->getType(), peelCount), step));
+    }
+
+    PASS_LOG << "Start index of ";
+    if (AssignmentsLog) inst1_add_rec->print(*AssignmentsLog);
+    PASS_LOG << ": ";
+    if (AssignmentsLog) start_first_inst->print(*AssignmentsLog);
+    PASS_LOG << "\n";
 
-    outs() << "Start index of ";
-    inst2_add_rec->print(outs());
-    outs() << ": ";
-    start_second_inst->print(outs());
-    outs() << "\n";
+    PASS_LOG << "Start index of ";
+    if (AssignmentsLog) inst2_add_rec->print(*AssignmentsLog);
+    PASS_LOG << ": ";
+    if (AssignmentsLog) start_second_inst->print(*AssignmentsLog);
+    PASS_LOG << "\n";
 
     //extract the stride of the polynomial recurrences
     //change of the address at each loop iteration
     const SCEV *stride_first_inst = inst1_add_rec->getStepRecurrence(SE); //es: 4
     const SCEV *stride_second_inst = inst2_add_rec->getStepRecurrence(SE);
 
-    outs() << "Stride index of ";
-    inst1_add_rec->print(outs());
-    outs() << ": ";
-    stride_first_inst->print(outs());
-    outs() << "\n";
+    PASS_LOG << "Stride index of ";
+    if (AssignmentsLog) inst1_add_rec->print(*AssignmentsLog);
+    PASS_LOG << ": ";
+    if (AssignmentsLog) stride_first_inst->print(*AssignmentsLog);
+    PASS_LOG << "\n";
 
-    outs() << "Stride index of ";
-    inst2_add_rec->print(outs());
-    outs() << ": ";
-    stride_second_inst->print(outs());
-    outs() << "\n";
+    PASS_LOG << "Stride index of ";
+    if (AssignmentsLog) inst2_add_rec->print(*AssignmentsLog);
+    PASS_LOG << ": ";
+    if (AssignmentsLog) stride_second_inst->print(*AssignmentsLog);
+    PASS_LOG << "\n";
 
     //ensure the stride is non-zero and both strides are equal
     if (!SE.isKnownNonZero(stride_first_inst) || stride_first_inst != stride_second_inst) {
-        outs() << "Cannot compute distance\n";
+        PASS_LOG << "Cannot compute distance\n";
         return true;
     }
 
     //compute the distance (delta) between the start addresses
     const SCEV *inst_delta = SE.getMinusSCEV(start_first_inst, start_second_inst);
 
-    outs() << "Delta: ";
-    inst_delta->print(outs());
-    outs() << "\n";
+    PASS_LOG << "Delta: ";
+    if (AssignmentsLog) inst_delta->print(*AssignmentsLog);
+    PASS_LOG << "\n";
 
     //cast the delta and the stride to SCEVConstant
     const SCEVConstant *const_delta = dyn_cast<SCEVConstant>(inst_delta);
@@ -373,11 +1153,11 @@ bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instructio
         //check if |delta| % |stride| != 0
         if ((int_delta != 0 && int_delta.abs().urem(int_stride.abs()) != 0)) {
             //delta is not multiple of the stride
-            outs() << "|delta|: ";
-            int_delta.abs().print(outs(), false);
-            outs() << " not multiple of |stride|: ";
-            int_stride.abs().print(outs(), false);
-            outs() << "\n";
+            PASS_LOG << "|delta|: ";
+            if (AssignmentsLog) int_delta.abs().print(*AssignmentsLog, false);
+            PASS_LOG << " not multiple of |stride|: ";
+            if (AssignmentsLog) int_stride.abs().print(*AssignmentsLog, false);
+            PASS_LOG << "\n";
             return false;
         }
 
@@ -393,239 +1173,3421 @@ bool isDistanceNegative(Loop *loop1, Loop *loop2, Instruction *inst1, Instructio
         }
 
     } else {
-        outs() << "Cannot compute distance\n";
+        PASS_LOG << "Cannot compute distance\n";
         return true;
     }
 
     //check if the dependence distance is negative
     bool isDistanceNegative = SE.isKnownPredicate(ICmpInst::ICMP_SLT, dependence_dist, SE.getZero(stride_first_inst->getType()));
     if (isDistanceNegative) {
-        outs() << *inst1 << " and " << *inst2 << " are dependent with a negative distance \n";
+        PASS_LOG << *inst1 << " and " << *inst2 << " are dependent with a negative distance \n";
     } else {
-        outs() << *inst1 << " and " << *inst2 << " are dependent with a NON-negative distance \n";
+        PASS_LOG << *inst1 << " and " << *inst2 << " are dependent with a NON-negative distance \n";
     }
 
-    outs() << "\n";
+    PASS_LOG << "\n";
     return isDistanceNegative;
 }
 
-//check if all the dependencies between the two loops are non-negative
-bool dependencesAllowFusion(Loop *L0, Loop *L1, DominatorTree &DT, ScalarEvolution &SE, DependenceInfo &DI) {
-    std::vector<Instruction *> L0MemReads;
-    std::vector<Instruction *> L0MemWrites;
+//decompose the address accessed by I into a loop-invariant base and the stride of every level
+//of the nest, from the outermost to the innermost loop
+bool getNestStrides(Instruction *I, ArrayRef<Loop *> levels, ScalarEvolution &SE, const SCEV *&base, SmallVectorImpl<const SCEV *> &strides) {
+    Value *ptr = getLoadStorePointerOperand(I);
+    if (!ptr) {
+        return false;
+    }
+
+    const SCEV *S = SE.getSCEV(ptr);
+    strides.assign(levels.size(), nullptr);
+    for (int k = levels.size() - 1; k >= 0; --k) {
+        auto *rec = dyn_cast<SCEVAddRecExpr>(S);
+        if (!rec || rec->getLoop() != levels[k] || !rec->isAffine()) {
+            return false;
+        }
+        strides[k] = rec->getStepRecurrence(SE); //es: {{%a,+,400}<%for.cond>,+,4}<%for.cond1> -> 400, 4
+        S = rec->getStart();
+    }
+
+    base = S;
+    return true;
+}
 
-    std::vector<Instruction *> L1MemReads;
-    std::vector<Instruction *> L1MemWrites;
+//build the access descriptors of the memory instructions of a fusion candidate
+void collectMemoryAccesses(Loop *L, ScalarEvolution &SE, SmallVectorImpl<memoryAccess> &accesses) {
+    SmallVector<Loop *, 4> levels;
+    bool isNest = getPerfectNestLevels(L, levels) && levels.size() > 1;
 
-    //collect load and store instructions of L0
-    for (BasicBlock *BB : L0->blocks()) {
+    for (BasicBlock *BB : L->blocks()) {
         for (Instruction &I : *BB) {
-            if (I.mayWriteToMemory()) {
-                L0MemWrites.push_back(&I);
+            if (!I.mayReadOrWriteMemory()) {
+                continue;
             }
 
-            if (I.mayReadFromMemory()) {
-                L0MemReads.push_back(&I);
+            memoryAccess access;
+            access.inst = &I;
+            access.object = nullptr;
+            access.rec = nullptr;
+            access.base = nullptr;
+            if (Value *ptr = getLoadStorePointerOperand(&I)) {
+                access.object = getUnderlyingObject(ptr);
+                if (!isNest) {
+                    access.rec = getSCEVAddRec(&I, L, SE);
+                } else if (!getNestStrides(&I, levels, SE, access.base, access.strides)) {
+                    access.base = nullptr;
+                    access.strides.clear();
+                }
             }
+            accesses.push_back(access);
         }
     }
+}
 
-    //collect load and store instructions of L1
-    for (BasicBlock *BB : L1->blocks()) {
-        for (Instruction &I : *BB) {
-            if (I.mayWriteToMemory()) {
-                L1MemWrites.push_back(&I);
-            }
+//multi-level version of isDistanceNegative: check if, once the nests are fused, inst2 may access a
+//location in an iteration lexicographically preceding the one in which inst1 accesses it
+bool isNestDistanceNegative(ArrayRef<Loop *> levels1, const memoryAccess &access1, const memoryAccess &access2, ScalarEvolution &SE) {
+    Instruction *inst1 = access1.inst;
+    Instruction *inst2 = access2.inst;
+    PASS_LOG << "Checking the direction vector between " << *inst1 << " and " << *inst2 << "\n";
 
-            if (I.mayReadFromMemory()) {
-                L1MemReads.push_back(&I);
-            }
-        }
+    const SCEV *base1 = access1.base;
+    const SCEV *base2 = access2.base;
+    ArrayRef<const SCEV *> strides1 = access1.strides;
+    ArrayRef<const SCEV *> strides2 = access2.strides;
+    if (!base1 || !base2) {
+        PASS_LOG << "Can't find a polynomial recurrence for every level!\n";
+        return true;
     }
-    /*
-        Caso a[i] = qualcosa NEL LOOP 1
-        print a[i+1] nel LOOP 2
-        a i+1 non è pronto alla stessa iterazione di a[i]
-    */
-    //check for any negative distance dependency between the store instructions of L0 and the load instructions of L1
-    for (Instruction *WriteL0 : L0MemWrites) {
-        for (Instruction *ReadL1 : L1MemReads) {
-            if (DI.depends(WriteL0, ReadL1, true) && isDistanceNegative(L0, L1, WriteL0, ReadL1, SE)) {
-                return false;
-            }
+
+    //the accesses must walk the memory with the same constant, non-zero strides of the same sign
+    bool negativeStrides = false;
+    for (unsigned k = 0; k < strides1.size(); ++k) {
+        auto *stride = dyn_cast<SCEVConstant>(strides1[k]);
+        if (!stride || stride->isZero() || strides1[k] != strides2[k] ||
+            (k > 0 && stride->getAPInt().isNegative() != negativeStrides)) {
+            PASS_LOG << "Cannot compute distance at level " << k << "\n";
+            return true;
         }
+        negativeStrides = stride->getAPInt().isNegative();
     }
-    /*
-        Caso print a[i-1] in LOOP 1
-        a[i] = Valore in LOOP 2
-        a[i] verrebbe sovrascritto nel momento sbagliato
-    */
-    //check for any negative distance dependency between the store instructions of L1 and the load instructions of L0
-    for (Instruction *WriteL1 : L1MemWrites) {
-        for (Instruction *ReadL0 : L0MemReads) {
-            if (DI.depends(WriteL1, ReadL0, true) && isDistanceNegative(L0, L1, ReadL0, WriteL1, SE)) {
-                return false;
-            }
+
+    //the addresses of an inner level must not overlap the next iteration of the enclosing one:
+    //(iterations of level k) * |stride k| <= |stride k-1|. Then the lexicographic order of the
+    //iterations is the order of the addresses, and the sign of the direction vector is the sign of the delta
+    for (unsigned k = 1; k < levels1.size(); ++k) {
+        Loop *L = levels1[k];
+        const SCEV *iterations = SE.getExitCount(L, L->getExitingBlock());
+        if (isa<SCEVCouldNotCompute>(iterations)) {
+            PASS_LOG << "Cannot compute the iterations at level " << k << "\n";
+            return true;
+        }
+        if (L->getExitingBlock() == L->getLoopLatch()) {
+            iterations = SE.getAddExpr(iterations, SE.getOne(iterations->getType()));
+        }
+
+        Type *strideTy = strides1[k]->getType();
+        const SCEV *span = SE.getMulExpr(SE.getTruncateOrZeroExtend(iterations, strideTy), SE.getAbsExpr(strides1[k], false));
+        if (!SE.isKnownPredicate(ICmpInst::ICMP_ULE, span, SE.getAbsExpr(strides1[k - 1], false))) {
+            PASS_LOG << "Level " << k << " may overlap the enclosing level\n";
+            return true;
         }
     }
 
-    //if we reach this point, all the dependencies are non-negative
-    return true;
+    const SCEVConstant *const_delta = dyn_cast<SCEVConstant>(SE.getMinusSCEV(base1, base2));
+    if (!const_delta) {
+        PASS_LOG << "Cannot compute distance\n";
+        return true;
+    }
+
+    //the innermost stride is the smallest one: a delta that is not a multiple means no dependence
+    APInt int_delta = const_delta->getAPInt();
+    APInt int_stride = cast<SCEVConstant>(strides1.back())->getAPInt();
+    if (int_delta != 0 && int_delta.abs().urem(int_stride.abs()) != 0) {
+        PASS_LOG << "|delta| not multiple of the innermost |stride|\n";
+        return false;
+    }
+
+    bool isDirectionNegative = negativeStrides ? int_delta.isStrictlyPositive() : int_delta.isNegative();
+    if (isDirectionNegative) {
+        PASS_LOG << *inst1 << " and " << *inst2 << " are dependent with a negative direction \n";
+    }
+    return isDirectionNegative;
 }
 
-bool tryFuseLoops(fusionCandidate *C1, fusionCandidate *C2, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, LoopInfo &LI, Function &F, FunctionAnalysisManager &AM) {
-    Loop *L1 = C1->loop;
-    Loop *L2 = C2->loop;
+//iteration distance between two accesses to the same location: access2 touches in iteration i + distance
+//the address access1 touches in iteration i. Same derivation as isDistanceNegative, false when unknown
+bool getIterationDistance(const memoryAccess &access1, const memoryAccess &access2, ScalarEvolution &SE, int64_t &distance, bool &disjoint) {
+    const SCEVAddRecExpr *rec1 = access1.rec;
+    const SCEVAddRecExpr *rec2 = access2.rec;
+    if (!rec1 || !rec2 || SE.getPointerBase(rec1) != SE.getPointerBase(rec2)) {
+        return false;
+    }
 
-    if (!areLoopsAdjacent(L1, L2, LI)) {
-        outs() << "Loops are not adjacent \n";
+    const SCEV *stride = rec1->getStepRecurrence(SE);
+    auto *constStride = dyn_cast<SCEVConstant>(stride);
+    auto *constDelta = dyn_cast<SCEVConstant>(SE.getMinusSCEV(rec1->getStart(), rec2->getStart()));
+    if (!constStride || !constDelta || stride != rec2->getStepRecurrence(SE) || constStride->getAPInt().isZero()) {
         return false;
     }
 
-    outs() << "Loops are adjacent \n";
+    //start1 + i * stride == start2 + j * stride  =>  j - i == (start1 - start2) / stride
+    APInt delta = constDelta->getAPInt();
+    APInt step = constStride->getAPInt();
+    if (delta.srem(step) != 0) {
+        disjoint = true;
+        return true;
+    }
+    disjoint = false;
+    distance = delta.sdiv(step).getSExtValue();
+    return true;
+}
 
-    // Get the trip counts using getExitCount
-    if (!C1->tripCount) {
-        const SCEV *tripCountL1 = SE.getExitCount(L1, L1->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
-        C1->tripCount = tripCountL1;
+//get the access descriptors of a candidate, computing them the first time
+ArrayRef<memoryAccess> getMemoryAccesses(Loop *L, ScalarEvolution &SE, dependenceCache &cache) {
+    auto it = cache.accesses.find(L);
+    if (it == cache.accesses.end()) {
+        it = cache.accesses.insert({L, SmallVector<memoryAccess, 16>()}).first;
+        collectMemoryAccesses(L, SE, it->second);
     }
+    return it->second;
+}
 
-    if (!C2->tripCount) {
-        const SCEV *tripCountL2 = SE.getExitCount(L2, L2->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
-        C2->tripCount = tripCountL2;
+//check if all the dependencies between the two loops are non-negative
+bool dependencesAllowFusion(Loop *L0, Loop *L1, DominatorTree &DT, ScalarEvolution &SE, DependenceInfo &DI, AAResults &AA, dependenceCache &cache,
+                            SmallVectorImpl<std::pair<const Value *, const Value *>> &overlapChecks, unsigned peelCount = 0) {
+    auto key = std::make_pair(std::make_pair(L0->getHeader(), L1->getHeader()), peelCount);
+    auto cached = cache.results.find(key);
+    if (cached != cache.results.end()) {
+        PASS_LOG << "Dependences already checked for these loops \n";
+        overlapChecks.assign(cached->second.overlapChecks.begin(), cached->second.overlapChecks.end());
+        return cached->second.allowed;
     }
 
+    //loop nests are checked on the whole direction vector, one entry for each fused level
+    SmallVector<Loop *, 4> levels0;
+    getPerfectNestLevels(L0, levels0);
+    bool isNest = levels0.size() > 1;
 
-    // Print the trip counts
-    outs() << "Trip count of L1: ";
-    C1->tripCount->print(outs());
-    outs() << "\n";
+    //group the accesses of each loop by underlying object, so that only the groups
+    //that may alias are tested against each other
+    MapVector<const Value *, SmallVector<const memoryAccess *, 8>> L0Buckets;
+    MapVector<const Value *, SmallVector<const memoryAccess *, 8>> L1Buckets;
+    for (const memoryAccess &access : getMemoryAccesses(L0, SE, cache)) {
+        L0Buckets[access.object].push_back(&access);
+    }
+    for (const memoryAccess &access : getMemoryAccesses(L1, SE, cache)) {
+        L1Buckets[access.object].push_back(&access);
+    }
 
-    outs() << "Trip count of L2: ";
-    C2->tripCount->print(outs());
-    outs() << "\n";
+    auto hasWrite = [](ArrayRef<const memoryAccess *> bucket) {
+        return llvm::any_of(bucket, [](const memoryAccess *access) { return access->inst->mayWriteToMemory(); });
+    };
 
-    // Check if both trip counts are equal
-    if (C1->tripCount != C2->tripCount) {
-        outs() << "Loops have a different trip count \n";
-        return false;
+    bool allowed = true;
+    SmallVector<std::pair<const Value *, const Value *>, 4> checks;
+    for (auto &L0Bucket : L0Buckets) {
+        for (auto &L1Bucket : L1Buckets) {
+            const Value *object0 = L0Bucket.first;
+            const Value *object1 = L1Bucket.first;
+            if (object0 && object1 && object0 != object1) {
+                if (AA.isNoAlias(object0, object1)) {
+                    continue;
+                }
+                //two objects that may alias: the distance between their accesses is unknown,
+                //the caller has to prove at runtime that they don't overlap
+                if (hasWrite(L0Bucket.second) || hasWrite(L1Bucket.second)) {
+                    PASS_LOG << "Objects " << *object0 << " and " << *object1 << " may alias \n";
+                    checks.push_back({object0, object1});
+                }
+                continue;
+            }
+
+            for (const memoryAccess *access0 : L0Bucket.second) {
+                for (const memoryAccess *access1 : L1Bucket.second) {
+                    Instruction *inst0 = access0->inst;
+                    Instruction *inst1 = access1->inst;
+                    //calls have no pointer operand and an address without recurrence cannot be ordered:
+                    //DependenceInfo reports them as confused, so if one of the two writes fusion may change
+                    //the value the other one sees
+                    bool unknown = !access0->object || !access1->object ||
+                                   (isNest ? !access0->base || !access1->base : !access0->rec || !access1->rec);
+                    if (unknown && (inst0->mayWriteToMemory() || inst1->mayWriteToMemory())) {
+                        PASS_LOG << "Unknown access between " << *inst0 << " and " << *inst1 << "\n";
+                        allowed = false;
+                        break;
+                    }
+                    /*
+                        Caso a[i] = qualcosa NEL LOOP 1
+                        print a[i+1] nel LOOP 2
+                        a i+1 non è pronto alla stessa iterazione di a[i]
+                    */
+                    //check for a negative distance dependency between a store of L0 and a load of L1
+                    if (inst0->mayWriteToMemory() && inst1->mayReadFromMemory() && DI.depends(inst0, inst1, true) &&
+                        (isNest ? isNestDistanceNegative(levels0, *access0, *access1, SE)
+                                : isDistanceNegative(*access0, *access1, SE, peelCount))) {
+                        allowed = false;
+                        break;
+                    }
+                    /*
+                        Caso print a[i-1] in LOOP 1
+                        a[i] = Valore in LOOP 2
+                        a[i] verrebbe sovrascritto nel momento sbagliato
+                    */
+                    //check for a negative distance dependency between a store of L1 and a load of L0
+                    if (inst1->mayWriteToMemory() && inst0->mayReadFromMemory() && DI.depends(inst1, inst0, true) &&
+                        (isNest ? isNestDistanceNegative(levels0, *access0, *access1, SE)
+                                : isDistanceNegative(*access0, *access1, SE, peelCount))) {
+                        allowed = false;
+                        break;
+                    }
+                }
+                if (!allowed) {
+                    break;
+                }
+            }
+            if (!allowed) {
+                break;
+            }
+        }
+        if (!allowed) {
+            break;
+        }
     }
 
-    outs() << "Loops have the same trip count \n";
+    //if allowed is still true, all the dependencies are non-negative
+    if (!allowed) {
+        checks.clear();
+    }
+    overlapChecks.assign(checks.begin(), checks.end());
+    cache.results[key] = {allowed, std::move(checks)};
+    return allowed;
+}
 
-    if (!controlFlowEquivalent(L1, L2, DT, PDT, LI)) {
-        outs() << "Loops are not control flow equivalent \n";
-        return false;
+//if L1 runs a small, known number of iterations more than L2, return how many (0 otherwise)
+unsigned getPeelCount(const fusionCandidate &C1, const fusionCandidate &C2, ScalarEvolution &SE) {
+    if (isa<SCEVCouldNotCompute>(C1.tripCount) || isa<SCEVCouldNotCompute>(C2.tripCount) ||
+        C1.tripCount->getType() != C2.tripCount->getType()) {
+        return 0;
     }
-    outs() << "Loops are control flow equivalent \n";
 
-    if (!dependencesAllowFusion(L1, L2, DT, SE, DI)) {
-        outs() << "Loops are dependent \n";
-        return false;
+    auto *diff = dyn_cast<SCEVConstant>(SE.getMinusSCEV(C1.tripCount, C2.tripCount));
+    if (!diff) {
+        PASS_LOG << "The trip count difference is not a constant \n";
+        return 0;
     }
 
-    outs() << "Loops don't have any negative distance dependences \n";
-    outs() << "All Loop Fusion conditions satisfied. \n";
+    const APInt &intDiff = diff->getAPInt();
+    if (intDiff.isNegative()) {
+        PASS_LOG << "L2 runs more iterations than L1, epilogue peeling is not supported \n";
+        return 0;
+    }
 
-    fuseLoops(L1, L2, DT, PDT, LI, F, DI, SE, AM);
+    if (intDiff.ugt(FusionMaxPeelCount)) {
+        PASS_LOG << "Too many iterations to peel \n";
+        return 0;
+    }
 
-    outs() << "The code has been transformed. \n";
-    return true;
+    //the peeled iterations must never leave the loop
+    if (!SE.isKnownPredicate(ICmpInst::ICMP_UGE, C1.tripCount, diff)) {
+        PASS_LOG << "L1 may exit during the peeled iterations \n";
+        return 0;
+    }
+
+    return intDiff.getZExtValue();
 }
 
-bool runOnFunction(Function &F, FunctionAnalysisManager &AM) {
-    outs() << "Start \n";
-    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
-    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
-    PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
-    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
-    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+//down-counting loops get trip counts like (%n - (0 smin %n)), up-counting ones (0 smax %n):
+//rewrite x - (a smin b) as (x - a) smax (x - b) when none of the subtractions can overflow
+const SCEV *normalizeTripCount(const SCEV *tripCount, ScalarEvolution &SE) {
+    auto *add = dyn_cast<SCEVAddExpr>(tripCount);
+    if (!add) {
+        return tripCount;
+    }
+
+    const SCEVSMinExpr *smin = nullptr;
+    SmallVector<const SCEV *, 4> others;
+    for (const SCEV *op : add->operands()) {
+        auto *mul = dyn_cast<SCEVMulExpr>(op);
+        if (!smin && mul && mul->getNumOperands() == 2 && mul->getOperand(0)->isAllOnesValue() &&
+            isa<SCEVSMinExpr>(mul->getOperand(1))) {
+            smin = cast<SCEVSMinExpr>(mul->getOperand(1));
+            continue;
+        }
+        others.push_back(op);
+    }
+    if (!smin) {
+        return tripCount;
+    }
 
-    // Build up a worklist of inner-loops to version.
-    SmallVector<Loop *, 8> Worklist;
-    for (Loop *TopLevelLoop : LI)
-        for (Loop *L : depth_first(TopLevelLoop))
-            if (L->isInnermost())
-                Worklist.push_back(L);
+    const SCEV *rest = SE.getAddExpr(others);
+    SmallVector<const SCEV *, 4> maxOperands;
+    for (const SCEV *op : smin->operands()) {
+        if (!SE.willNotOverflow(Instruction::Sub, /*Signed=*/true, rest, op)) {
+            return tripCount;
+        }
+        maxOperands.push_back(SE.getMinusSCEV(rest, op));
+    }
+    return SE.getSMaxExpr(maxOperands);
+}
 
-    // Convert the worklist of loops to fusion candidates.
-    std::vector<fusionCandidate *> loops;
-    for (Loop *L : Worklist) {
-        fusionCandidate *f = new fusionCandidate;
-        f->tripCount = nullptr;
-        f->loop = L;
-        loops.push_back(f);
+//loops with different starts or strides express the same number of iterations with different
+//SCEVs (es: (0 smax %n) and (%n - (0 smin %n))), so compare them through SCEV
+bool haveSameTripCount(const SCEV *tripCount1, const SCEV *tripCount2, ScalarEvolution &SE) {
+    if (tripCount1 == tripCount2) {
+        return true;
+    }
+    if (isa<SCEVCouldNotCompute>(tripCount1) || isa<SCEVCouldNotCompute>(tripCount2) ||
+        tripCount1->getType() != tripCount2->getType()) {
+        return false;
+    }
+    if (normalizeTripCount(tripCount1, SE) == normalizeTripCount(tripCount2, SE)) {
+        return true;
     }
+    return SE.isKnownPredicate(ICmpInst::ICMP_EQ, tripCount1, tripCount2) ||
+           (SE.isKnownPredicate(ICmpInst::ICMP_ULE, tripCount1, tripCount2) &&
+            SE.isKnownPredicate(ICmpInst::ICMP_UGE, tripCount1, tripCount2));
+}
 
-    outs() << "Found " << loops.size() << " loops! \n";
+//the peeled copies need the simplified form, and a conditional branch to drop from their exiting block
+bool canPeelLoop(Loop *L) {
+    BasicBlock *exitingBlock = L->getExitingBlock();
+    auto *exitBranch = exitingBlock ? dyn_cast<BranchInst>(exitingBlock->getTerminator()) : nullptr;
+    return L->getLoopPreheader() && L->getLoopLatch() && L->getExitBlock() && exitBranch && exitBranch->isConditional();
+}
 
-    if (loops.size() < 2) {
+//peel the first peelCount iterations of L in front of its header. The caller guarantees
+//that the loop doesn't exit during these iterations, so the exit branches of the copies are removed
+bool peelFirstIterations(Loop *L, unsigned peelCount, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE, Function &F) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *header = L->getHeader();
+    BasicBlock *latch = L->getLoopLatch();
+    BasicBlock *exitingBlock = L->getExitingBlock();
+    if (!canPeelLoop(L)) {
+        PASS_LOG << "Cannot peel a loop that is not in simplified form \n";
         return false;
     }
-    
-    bool changed = false;
-    while (true) {
-        bool fused = false;
-        fusionCandidate *secondLoop = nullptr;
-        // NOTA: Il loop originale `for (size_t i = loops.size() - 1; i > 0; --i)`
-        // ha un bug con `size_t` se `loops.size()` è 0 o 1.
-        // Lo correggo per evitare un loop infinito o underflow, mantenendo la logica.
-        for (size_t i = loops.size() - 1; i > 0; --i) {
-            // Tentativo di fusione di loop[i] e loop[i-1]
-            if (tryFuseLoops(loops[i], loops[i - 1], SE, DT, PDT, DI, LI, F, AM)) {
-                fused = true;
-                changed = true;
-                secondLoop = loops[i - 1]; // Il secondo loop (quello che precede) viene fuso nel primo e rimosso
-                break;
+
+    //values flowing into the header for the next iteration, starting from the preheader ones
+    DenseMap<PHINode *, Value *> incoming;
+    for (PHINode &phi : header->phis()) {
+        incoming[&phi] = phi.getIncomingValueForBlock(preheader);
+    }
+
+    SmallVector<BasicBlock *, 16> peeledBlocks;
+    BasicBlock *prevLatch = preheader;
+    for (unsigned it = 0; it < peelCount; ++it) {
+        ValueToValueMapTy VMap;
+        SmallVector<BasicBlock *, 8> newBlocks;
+        for (BasicBlock *BB : L->blocks()) {
+            BasicBlock *newBB = CloneBasicBlock(BB, VMap, ".peel" + Twine(it), &F);
+            newBB->moveBefore(header);
+            VMap[BB] = newBB;
+            newBlocks.push_back(newBB);
+            if (Loop *parent = L->getParentLoop()) {
+                parent->addBasicBlockToLoop(newBB, LI);
             }
         }
 
-        if (fused && secondLoop) {
-            // Rimuovi il loop fuso dalla worklist
-            auto it = std::remove(loops.begin(), loops.end(), secondLoop);
-            loops.erase(it, loops.end());
-            delete secondLoop; // Libera la memoria
-        } else {
-            // Se non ci sono state fusioni in questa iterazione, esci.
-            break;
+        //the header PHIs of the copy are replaced by the values of the previous iteration
+        for (PHINode &phi : header->phis()) {
+            auto *newPhi = cast<PHINode>(VMap[&phi]);
+            VMap[&phi] = incoming[&phi];
+            newPhi->eraseFromParent();
+        }
+        remapInstructionsInBlocks(newBlocks, VMap);
+
+        //the backedge of the copy goes to the original header, it is redirected by the next copy
+        BasicBlock *newHeader = cast<BasicBlock>(VMap[header]);
+        BasicBlock *newLatch = cast<BasicBlock>(VMap[latch]);
+        newLatch->getTerminator()->replaceUsesOfWith(newHeader, header);
+
+        //the copy never exits, so its exit branch becomes unconditional
+        auto *exitBranch = cast<BranchInst>(cast<BasicBlock>(VMap[exitingBlock])->getTerminator());
+        BasicBlock *stay = L->contains(exitingBlock->getTerminator()->getSuccessor(0)) ?
+            exitBranch->getSuccessor(0) : exitBranch->getSuccessor(1);
+        ReplaceInstWithInst(exitBranch, BranchInst::Create(stay));
+
+        prevLatch->getTerminator()->replaceUsesOfWith(header, newHeader);
+        prevLatch = newLatch;
+        peeledBlocks.append(newBlocks.begin(), newBlocks.end());
+
+        for (PHINode &phi : header->phis()) {
+            Value *next = phi.getIncomingValueForBlock(latch);
+            incoming[&phi] = VMap.count(next) ? (Value *)VMap[next] : next;
         }
     }
-    
-    // Pulisci la memoria rimanente
-    for(auto* candidate : loops) {
-        delete candidate;
+
+    //the loop now starts from the values computed by the last peeled iteration
+    for (PHINode &phi : header->phis()) {
+        int idx = phi.getBasicBlockIndex(preheader);
+        phi.setIncomingBlock(idx, prevLatch);
+        phi.setIncomingValue(idx, incoming[&phi]);
     }
-    
-    return changed; // Restituisce se sono state apportate modifiche
-}
-struct LoopFusionPass : public PassInfoMixin<LoopFusionPass> {
-    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-        bool changed = runOnFunction(F, AM);
-        
-        // Se `runOnFunction` ha modificato l'IR, dobbiamo invalidare le analisi.
-        // Altrimenti, possiamo preservarle tutte.
-        if (changed) {
-            return PreservedAnalyses::none();
+
+    //the preheader now enters the first copy, and every edge of the copies is new
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    updates.push_back({DominatorTree::Delete, preheader, header});
+    updates.push_back({DominatorTree::Insert, preheader, peeledBlocks.front()});
+    for (BasicBlock *BB : peeledBlocks) {
+        for (BasicBlock *succ : successors(BB)) {
+            updates.push_back({DominatorTree::Insert, BB, succ});
         }
-        return PreservedAnalyses::all();
     }
-};
+    DTU.applyUpdates(updates);
 
-extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
-llvmGetPassPluginInfo() {
-    return {
-        LLVM_PLUGIN_API_VERSION, "MyLoopFusionPlugin", "v0.1",
-        [](PassBuilder &PB) {
-            PB.registerPipelineParsingCallback(
-                [](StringRef Name, FunctionPassManager &FPM,
-                   ArrayRef<PassBuilder::PipelineElement>) {
-                    if (Name == "loop-fusion-pass") {
-                        FPM.addPass(LoopFusionPass());
-                        return true;
-                    }
+    SE.forgetLoop(L);
+    PASS_LOG << "Peeled " << peelCount << " iterations of L1 \n";
+    return true;
+}
+
+//the byte range [low, high) accessed by a loop nest on object, as integer SCEVs that can be computed before
+//the nest starting with first: every access must be an affine AddRec on each level of the nest
+bool getAccessedRange(ArrayRef<Loop *> levels, const Value *object, Loop *first, ScalarEvolution &SE, const DataLayout &DL, const SCEV *&low, const SCEV *&high) {
+    low = nullptr;
+    high = nullptr;
+    for (BasicBlock *BB : levels.front()->blocks()) {
+        for (Instruction &I : *BB) {
+            Value *ptr = getLoadStorePointerOperand(&I);
+            if (!ptr || getUnderlyingObject(ptr) != object) {
+                continue;
+            }
+
+            const SCEV *base;
+            SmallVector<const SCEV *, 4> strides;
+            if (!getNestStrides(&I, levels, SE, base, strides) || !SE.isAvailableAtLoopEntry(base, first)) {
+                PASS_LOG << "Cannot compute the range accessed by " << I << "\n";
+                return false;
+            }
+            const SCEV *accessLow = SE.getPtrToIntExpr(base, DL.getIntPtrType(ptr->getType()));
+            if (isa<SCEVCouldNotCompute>(accessLow)) {
+                return false;
+            }
+            const SCEV *accessHigh = accessLow;
+
+            //the last iteration of every level moves the address by (tripCount - 1) * stride. A loop leaving
+            //from its latch runs the body once more than its exit count, which is then the last iteration itself
+            for (unsigned k = 0; k < levels.size(); ++k) {
+                Loop *L = levels[k];
+                const SCEV *lastIteration = SE.getExitCount(L, L->getExitingBlock());
+                if (isa<SCEVCouldNotCompute>(lastIteration) || !SE.isAvailableAtLoopEntry(lastIteration, first)) {
+                    PASS_LOG << "Cannot compute the range accessed by " << I << "\n";
                     return false;
                 }
-            );
+                if (L->getExitingBlock() != L->getLoopLatch()) {
+                    lastIteration = SE.getMinusSCEV(lastIteration, SE.getOne(lastIteration->getType()));
+                }
+                lastIteration = SE.getTruncateOrZeroExtend(lastIteration, accessLow->getType());
+                const SCEV *stride = SE.getTruncateOrSignExtend(strides[k], accessLow->getType());
+                const SCEV *extent = SE.getMulExpr(lastIteration, stride);
+                const SCEV *zero = SE.getZero(extent->getType());
+                accessLow = SE.getAddExpr(accessLow, SE.getSMinExpr(zero, extent));
+                accessHigh = SE.getAddExpr(accessHigh, SE.getSMaxExpr(zero, extent));
+            }
+            accessHigh = SE.getAddExpr(accessHigh, SE.getConstant(accessHigh->getType(), DL.getTypeStoreSize(getLoadStoreType(&I))));
+
+            low = low ? SE.getUMinExpr(low, accessLow) : accessLow;
+            high = high ? SE.getUMaxExpr(high, accessHigh) : accessHigh;
+        }
+    }
+    return low != nullptr;
+}
+
+//the ranges compared by the runtime checks, one {low0, high0, low1, high1} entry for each pair of objects
+//that may alias; false if versioning is not possible and nothing has to be changed
+bool getOverlapRanges(ArrayRef<Loop *> levels1, ArrayRef<Loop *> levels2, ArrayRef<std::pair<const Value *, const Value *>> overlapChecks,
+                      ScalarEvolution &SE, Function &F, SmallVectorImpl<std::array<const SCEV *, 4>> &ranges) {
+    Loop *L1 = levels1.front();
+    Loop *L2 = levels2.front();
+    BasicBlock *L2Exiting = L2->getExitingBlock();
+    BasicBlock *L2Exit = L2->getExitBlock();
+    if (!L1->getLoopPreheader() || L1->getExitBlock() != L2->getLoopPreheader() || !L2Exiting || !L2Exit ||
+        L2Exit->getSinglePredecessor() != L2Exiting) {
+        PASS_LOG << "The loops cannot be versioned as a single region \n";
+        return false;
+    }
+
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    for (auto &check : overlapChecks) {
+        const SCEV *low0, *high0, *low1, *high1;
+        if (!getAccessedRange(levels1, check.first, L1, SE, DL, low0, high0) ||
+            !getAccessedRange(levels2, check.second, L1, SE, DL, low1, high1) || low0->getType() != low1->getType()) {
+            return false;
+        }
+        ranges.push_back({low0, high0, low1, high1});
+    }
+    return true;
+}
+
+//recreate the loop tree of L on the cloned blocks
+Loop *cloneLoopTree(Loop *L, Loop *parent, ValueToValueMapTy &VMap, LoopInfo &LI) {
+    Loop *newLoop = LI.AllocateLoop();
+    if (parent) {
+        parent->addChildLoop(newLoop);
+    } else {
+        LI.addTopLevelLoop(newLoop);
+    }
+
+    for (BasicBlock *BB : L->blocks()) {
+        if (LI.getLoopFor(BB) == L) {
+            newLoop->addBasicBlockToLoop(cast<BasicBlock>(VMap[BB]), LI);
+        }
+    }
+    for (Loop *subLoop : *L) {
+        cloneLoopTree(subLoop, newLoop, VMap, LI);
+    }
+    return newLoop;
+}
+
+//the values of L2 must only be used after it through the PHIs of the block its guard skips to, which can
+//merge them with the ones of a copy of L2
+bool canSplitImpliedGuard(Loop *L2, BranchInst *L2Guard) {
+    BasicBlock *L2Exit = L2->getExitBlock();
+    BasicBlock *finalExitBlock = (L2Guard->getSuccessor(0) == L2->getLoopPreheader()) ? L2Guard->getSuccessor(1) : L2Guard->getSuccessor(0);
+    SmallPtrSet<BasicBlock *, 16> region(L2->block_begin(), L2->block_end());
+    region.insert(L2->getLoopPreheader());
+    region.insert(L2Exit);
+    for (BasicBlock *BB : region) {
+        for (Instruction &I : *BB) {
+            for (Use &U : I.uses()) {
+                auto *user = cast<Instruction>(U.getUser());
+                auto *phi = dyn_cast<PHINode>(user);
+                if (!region.count(user->getParent()) &&
+                    !(phi && phi->getParent() == finalExitBlock && phi->getIncomingBlock(U) == L2Exit)) {
+                    PASS_LOG << I << " is used after L2 outside of the PHIs of its final exit \n";
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//the guard of L1 implies the guard of L2 only when L1 runs: L1 now continues straight into L2, while the
+//path that skips L1 still checks the guard of L2 and runs an unfused copy of it. L2 is then no longer guarded
+void splitImpliedGuard(Loop *L1, Loop *L2, BranchInst *L2Guard, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE, Function &F) {
+    BasicBlock *L1Exit = L1->getExitBlock();
+    BasicBlock *L2GuardBlock = L2Guard->getParent();
+    BasicBlock *L2Preheader = L2->getLoopPreheader();
+    BasicBlock *L2Exit = L2->getExitBlock();
+    BasicBlock *finalExitBlock = (L2Guard->getSuccessor(0) == L2Preheader) ? L2Guard->getSuccessor(1) : L2Guard->getSuccessor(0);
+
+    SmallVector<BasicBlock *, 16> region;
+    region.push_back(L2Preheader);
+    region.append(L2->block_begin(), L2->block_end());
+    region.push_back(L2Exit);
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 16> clones;
+    for (BasicBlock *BB : region) {
+        BasicBlock *clone = CloneBasicBlock(BB, VMap, ".guarded", &F);
+        VMap[BB] = clone;
+        clones.push_back(clone);
+    }
+    remapInstructionsInBlocks(clones, VMap);
+
+    //the final exit is also reached from the copy
+    auto *clonedExit = cast<BasicBlock>(VMap[L2Exit]);
+    for (PHINode &phi : finalExitBlock->phis()) {
+        Value *incoming = phi.getIncomingValueForBlock(L2Exit);
+        Value *clonedIncoming = VMap.lookup(incoming);
+        phi.addIncoming(clonedIncoming ? clonedIncoming : incoming, clonedExit);
+    }
+
+    SmallVector<BasicBlock *, 2> oldSuccs(successors(L2GuardBlock));
+    L2Guard->replaceUsesOfWith(L2Preheader, cast<BasicBlock>(VMap[L2Preheader]));
+    updateSuccessors(L2GuardBlock, oldSuccs, DTU);
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    for (BasicBlock *clone : clones) {
+        for (BasicBlock *succ : successors(clone)) {
+            updates.push_back({DominatorTree::Insert, clone, succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+
+    //the PHIs of the guard block merge the results of L1 from its exit and from its guard: after L1 the
+    //guard block is skipped, so they are merged again in the final exit
+    DenseMap<PHINode *, Value *> afterL1;
+    for (PHINode &phi : L2GuardBlock->phis()) {
+        afterL1[&phi] = phi.getIncomingValueForBlock(L1Exit);
+    }
+    L2GuardBlock->removePredecessor(L1Exit, true);
+    replaceTerminator(L1Exit, BranchInst::Create(L2Preheader), DTU);
+    for (auto &entry : afterL1) {
+        PHINode *phi = entry.first;
+        SE.forgetValue(phi);
+        for (PHINode &exitPhi : finalExitBlock->phis()) {
+            for (unsigned i = 0; i < exitPhi.getNumIncomingValues(); ++i) {
+                if (exitPhi.getIncomingBlock(i) == L2Exit && exitPhi.getIncomingValue(i) == phi) {
+                    exitPhi.setIncomingValue(i, entry.second);
+                }
+            }
+        }
+        PHINode *merge = PHINode::Create(phi->getType(), 3, phi->getName() + ".guarded", &finalExitBlock->front());
+        merge->addIncoming(entry.second, L2Exit);
+        merge->addIncoming(phi, L2GuardBlock);
+        merge->addIncoming(phi, clonedExit);
+        phi->replaceUsesWithIf(merge, [&](Use &U) {
+            auto *user = cast<Instruction>(U.getUser());
+            return user != merge && !(isa<PHINode>(user) && user->getParent() == finalExitBlock);
+        });
+        if (merge->use_empty()) {
+            merge->eraseFromParent();
+        }
+    }
+
+    Loop *parent = L2->getParentLoop();
+    cloneLoopTree(L2, parent, VMap, LI);
+    if (parent) {
+        parent->addBasicBlockToLoop(cast<BasicBlock>(VMap[L2Preheader]), LI);
+        parent->addBasicBlockToLoop(clonedExit, LI);
+    }
+    PASS_LOG << "The guard of L2 is only checked when L1 is skipped \n";
+}
+
+//keep an unfused copy of the two nests and enter the ones about to be fused only when the ranges of the
+//objects that may alias don't overlap. The checks go in the preheader of L1, which gets a new preheader
+void versionLoops(ArrayRef<Loop *> levels1, ArrayRef<Loop *> levels2, ArrayRef<std::array<const SCEV *, 4>> ranges,
+                  DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE, Function &F) {
+    Loop *L1 = levels1.front();
+    Loop *L2 = levels2.front();
+    BasicBlock *checkBlock = L1->getLoopPreheader();
+    BasicBlock *L2Preheader = L2->getLoopPreheader();
+    BasicBlock *L2Exiting = L2->getExitingBlock();
+    BasicBlock *L2Exit = L2->getExitBlock();
+
+    DTU.flush();
+    BasicBlock *fusedPreheader = SplitBlock(checkBlock, checkBlock->getTerminator(), &DTU, &LI, nullptr, checkBlock->getName() + ".fused");
+
+    SCEVExpander expander(SE, F.getParent()->getDataLayout(), "fusion.rtcheck");
+    Instruction *insertPt = checkBlock->getTerminator();
+    IRBuilder<> builder(insertPt);
+    Value *noOverlap = nullptr;
+    for (auto &range : ranges) {
+        Value *low0 = expander.expandCodeFor(range[0], range[0]->getType(), insertPt);
+        Value *high0 = expander.expandCodeFor(range[1], range[1]->getType(), insertPt);
+        Value *low1 = expander.expandCodeFor(range[2], range[2]->getType(), insertPt);
+        Value *high1 = expander.expandCodeFor(range[3], range[3]->getType(), insertPt);
+        Value *disjoint = builder.CreateOr(builder.CreateICmpULE(high0, low1), builder.CreateICmpULE(high1, low0), "fusion.disjoint");
+        noOverlap = noOverlap ? builder.CreateAnd(noOverlap, disjoint, "fusion.nooverlap") : disjoint;
+    }
+
+    //clone everything between the new preheader and the exit of L2
+    SmallVector<BasicBlock *, 16> region;
+    region.push_back(fusedPreheader);
+    region.append(L1->block_begin(), L1->block_end());
+    region.push_back(L2Preheader);
+    region.append(L2->block_begin(), L2->block_end());
+    SmallPtrSet<BasicBlock *, 16> regionBlocks(region.begin(), region.end());
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 16> clones;
+    for (BasicBlock *BB : region) {
+        BasicBlock *clone = CloneBasicBlock(BB, VMap, ".unfused", &F);
+        VMap[BB] = clone;
+        clones.push_back(clone);
+    }
+    remapInstructionsInBlocks(clones, VMap);
+
+    //the exit of L2 is now reached by both versions
+    auto *clonedExiting = cast<BasicBlock>(VMap[L2Exiting]);
+    for (PHINode &phi : L2Exit->phis()) {
+        Value *incoming = phi.getIncomingValueForBlock(L2Exiting);
+        Value *clonedIncoming = VMap.lookup(incoming);
+        phi.addIncoming(clonedIncoming ? clonedIncoming : incoming, clonedExiting);
+    }
+
+    //the values of the region used after it are merged in the exit of L2
+    for (BasicBlock *BB : region) {
+        for (Instruction &I : *BB) {
+            SmallVector<Use *, 4> outsideUses;
+            for (Use &U : I.uses()) {
+                auto *user = cast<Instruction>(U.getUser());
+                if (!regionBlocks.count(user->getParent()) && !(isa<PHINode>(user) && user->getParent() == L2Exit)) {
+                    outsideUses.push_back(&U);
+                }
+            }
+            if (outsideUses.empty()) {
+                continue;
+            }
+
+            PHINode *merge = PHINode::Create(I.getType(), 2, I.getName() + ".versioned", &L2Exit->front());
+            merge->addIncoming(&I, L2Exiting);
+            merge->addIncoming(VMap[&I], clonedExiting);
+            for (Use *U : outsideUses) {
+                U->set(merge);
+            }
+        }
+    }
+
+    auto *clonedPreheader = cast<BasicBlock>(VMap[fusedPreheader]);
+    replaceTerminator(checkBlock, BranchInst::Create(fusedPreheader, clonedPreheader, noOverlap), DTU);
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    for (BasicBlock *clone : clones) {
+        for (BasicBlock *succ : successors(clone)) {
+            updates.push_back({DominatorTree::Insert, clone, succ});
+        }
+    }
+    DTU.applyUpdates(updates);
+
+    Loop *parent = L1->getParentLoop();
+    cloneLoopTree(L1, parent, VMap, LI);
+    cloneLoopTree(L2, parent, VMap, LI);
+    if (parent) {
+        parent->addBasicBlockToLoop(clonedPreheader, LI);
+        parent->addBasicBlockToLoop(cast<BasicBlock>(VMap[L2Preheader]), LI);
+    }
+
+    PASS_LOG << "Versioned the loops behind " << ranges.size() << " runtime overlap checks \n";
+}
+
+//bytes read or written by one iteration of the innermost level of a loop
+uint64_t getBytesPerIteration(ArrayRef<memoryAccess> accesses, const DataLayout &DL) {
+    uint64_t bytes = 0;
+    for (const memoryAccess &access : accesses) {
+        if (Type *type = getLoadStoreType(access.inst)) {
+            bytes += DL.getTypeStoreSize(type);
+        }
+    }
+    return bytes;
+}
+
+//iterations of the inner levels of a nest run for every iteration of the outermost one, 0 if unknown
+uint64_t getInnerIterations(ArrayRef<Loop *> levels, ScalarEvolution &SE) {
+    uint64_t iterations = 1;
+    for (Loop *L : levels.drop_front()) {
+        unsigned tripCount = SE.getSmallConstantMaxTripCount(L);
+        if (!tripCount) {
+            return 0;
+        }
+        iterations *= tripCount;
+    }
+    return iterations;
+}
+
+//values a loop keeps in registers across its iterations: recurrences, pointers of the accessed streams
+//and loop-invariant operands
+void collectLiveValues(ArrayRef<Loop *> levels, ArrayRef<memoryAccess> accesses, ScalarEvolution &SE, SmallPtrSetImpl<const Value *> &live) {
+    Loop *outer = levels.front();
+    for (Loop *L : levels) {
+        for (PHINode &phi : L->getHeader()->phis()) {
+            if (!getInductionRecurrence(&phi, L, SE)) {
+                live.insert(&phi);
+            }
+        }
+    }
+    for (const memoryAccess &access : accesses) {
+        if (access.object) {
+            live.insert(access.object);
+        }
+    }
+    for (BasicBlock *BB : outer->blocks()) {
+        for (Instruction &I : *BB) {
+            for (Value *op : I.operands()) {
+                auto *opInst = dyn_cast<Instruction>(op);
+                if ((opInst && !outer->contains(opInst)) || isa<Argument>(op)) {
+                    live.insert(op);
+                }
+            }
+        }
+    }
+}
+
+//a loop is a good candidate for the vectorizer on its own when it carries no recurrence and all its
+//accesses are unit-stride
+bool isVectorizableAlone(ArrayRef<Loop *> levels, ArrayRef<memoryAccess> accesses, ScalarEvolution &SE, const DataLayout &DL) {
+    Loop *inner = levels.back();
+    for (PHINode &phi : inner->getHeader()->phis()) {
+        if (!getInductionRecurrence(&phi, inner, SE)) {
+            return false;
+        }
+    }
+    for (const memoryAccess &access : accesses) {
+        const SCEV *stride = access.rec ? access.rec->getStepRecurrence(SE) : (access.strides.empty() ? nullptr : access.strides.back());
+        auto *constStride = dyn_cast_or_null<SCEVConstant>(stride);
+        if (!constStride || constStride->getAPInt().abs() != DL.getTypeStoreSize(getLoadStoreType(access.inst))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//cost model of a legal fusion, in bytes of memory traffic per iteration of the fused innermost loop.
+//Fusion saves the accesses of L2 that find in cache the data L1 has just accessed; it costs the locality
+//lost when the fused working set no longer fits in the cache, the spills of the extra registers and the
+//vector width lost when a vectorizable loop is fused with one that is not
+bool isFusionProfitable(ArrayRef<Loop *> levels1, ArrayRef<Loop *> levels2, ArrayRef<memoryAccess> accesses1, ArrayRef<memoryAccess> accesses2,
+                        unsigned peelCount, ScalarEvolution &SE, TargetTransformInfo &TTI, OptimizationRemarkEmitter &ORE) {
+    Loop *L1 = levels1.front();
+    const DataLayout &DL = L1->getHeader()->getModule()->getDataLayout();
+    uint64_t bytes1 = getBytesPerIteration(accesses1, DL);
+    uint64_t bytes2 = getBytesPerIteration(accesses2, DL);
+    uint64_t fusedBytes = bytes1 + bytes2;
+
+    //reuse: an access of L2 to a stream of L1, close enough that the data is still in cache
+    uint64_t savings = 0;
+    unsigned sharedStreams = 0;
+    for (const memoryAccess &access2 : accesses2) {
+        for (const memoryAccess &access1 : accesses1) {
+            if (!access1.object || access1.object != access2.object) {
+                continue;
+            }
+            int64_t distance = 0;
+            bool disjoint = false;
+            if (access1.rec && access2.rec) {
+                if (!getIterationDistance(access1, access2, SE, distance, disjoint) || disjoint) {
+                    continue;
+                }
+                distance += peelCount;
+            } else if (!access1.base || access1.base != access2.base || access1.strides != access2.strides) {
+                continue;
+            }
+            if ((uint64_t)std::abs(distance) * fusedBytes > FusionCacheSize) {
+                continue;
+            }
+            savings += DL.getTypeStoreSize(getLoadStoreType(access2.inst));
+            ++sharedStreams;
+            break;
+        }
+    }
+
+    //working set of one iteration of the outermost level: the reuse carried by it is lost when it overflows
+    uint64_t penalty = 0;
+    uint64_t innerIterations = getInnerIterations(levels1, SE);
+    uint64_t workingSet1 = innerIterations ? bytes1 * innerIterations : UINT64_MAX;
+    uint64_t workingSet2 = innerIterations ? bytes2 * innerIterations : UINT64_MAX;
+    uint64_t fusedWorkingSet = innerIterations ? fusedBytes * innerIterations : UINT64_MAX;
+    if (fusedWorkingSet > FusionCacheSize && workingSet1 <= FusionCacheSize && workingSet2 <= FusionCacheSize) {
+        penalty += std::min(bytes1, bytes2);
+    }
+
+    //register pressure: the values of both loops are live at the same time
+    SmallPtrSet<const Value *, 32> live1, live2, fusedLive;
+    collectLiveValues(levels1, accesses1, SE, live1);
+    collectLiveValues(levels2, accesses2, SE, live2);
+    fusedLive.insert(live1.begin(), live1.end());
+    fusedLive.insert(live2.begin(), live2.end());
+    unsigned registers = TTI.getNumberOfRegisters(TTI.getRegisterClassForType(false));
+    if (fusedLive.size() > registers && live1.size() <= registers && live2.size() <= registers) {
+        penalty += 2 * (fusedLive.size() - registers) * DL.getPointerSize();
+    }
+
+    //vectorization: the vectorizable loop would run at the speed of the other one
+    bool vectorizable1 = isVectorizableAlone(levels1, accesses1, SE, DL);
+    bool vectorizable2 = isVectorizableAlone(levels2, accesses2, SE, DL);
+    if (vectorizable1 != vectorizable2) {
+        penalty += vectorizable1 ? bytes1 : bytes2;
+    }
+
+    PASS_LOG << "Fusion cost model: " << sharedStreams << " shared streams save " << savings << " bytes per iteration, penalty "
+           << penalty << " (working set " << (innerIterations ? fusedWorkingSet : 0) << ", " << fusedLive.size() << "/" << registers
+           << " registers, vectorizable " << vectorizable1 << "/" << vectorizable2 << ") \n";
+
+    if (savings > penalty) {
+        ORE.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Profitable", L1->getStartLoc(), L1->getHeader())
+                   << "fusion with the following loop is profitable: " << ore::NV("SharedStreams", sharedStreams)
+                   << " shared streams save " << ore::NV("Savings", savings) << " bytes per iteration against a penalty of "
+                   << ore::NV("Penalty", penalty);
+        });
+        return true;
+    }
+    ORE.emit([&]() {
+        auto remark = OptimizationRemarkMissed(DEBUG_TYPE, "NotProfitable", L1->getStartLoc(), L1->getHeader())
+                      << "fusion with the following loop is legal but not profitable: "
+                      << ore::NV("Savings", savings) << " bytes per iteration saved, penalty " << ore::NV("Penalty", penalty);
+        if (!sharedStreams) {
+            remark << " (the loops access disjoint data)";
+        } else if (fusedWorkingSet > FusionCacheSize && innerIterations) {
+            remark << " (working set of " << ore::NV("WorkingSet", fusedWorkingSet) << " bytes exceeds the cache)";
+        } else if (fusedLive.size() > registers) {
+            remark << " (" << ore::NV("LiveValues", (unsigned)fusedLive.size()) << " values live in the fused loop)";
+        } else if (vectorizable1 != vectorizable2) {
+            remark << " (fusion would prevent the vectorization of one loop)";
+        }
+        return remark;
+    });
+    return false;
+}
+
+//try to fuse C2 into C1: changed is set as soon as the IR is modified, even if the fusion then fails
+bool tryFuseLoops(fusionCandidate &C1, fusionCandidate &C2, ScalarEvolution &SE, DominatorTree &DT, DependenceInfo &DI, AAResults &AA, dependenceCache &cache, DomTreeUpdater &DTU, LoopInfo &LI, Function &F, FunctionAnalysisManager &AM, unsigned maxRuntimeChecks, bool &changed) {
+    Loop *L1 = C1.loop;
+    Loop *L2 = C2.loop;
+
+    if (!C1.fusible || !C2.fusible) {
+        PASS_LOG << "A previous check already excluded one of the loops \n";
+        return false;
+    }
+
+    SmallVector<Instruction *, 8> toHoist;
+    SmallVector<Instruction *, 8> toSink;
+    if (!areLoopsAdjacent(L1, L2, LI)) {
+        if (!canMakeLoopsAdjacent(L1, L2, DT, DI, LI, toHoist, toSink)) {
+            PASS_LOG << "Loops are not adjacent \n";
+            return false;
+        }
+        PASS_LOG << "Loops can be made adjacent by moving the intervening code \n";
+    }
+
+    PASS_LOG << "Loops are adjacent \n";
+
+    if (!haveFusibleShapes(L1, L2, LI)) {
+        PASS_LOG << "Loops cannot be rewired into a single loop \n";
+        return false;
+    }
+    if (isRotatedLoop(L1) && (!toHoist.empty() || !toSink.empty())) {
+        PASS_LOG << "Code motion is only supported between loops leaving from their header \n";
+        return false;
+    }
+
+    // Loop nests are fused level by level: collect the loops of every level
+    SmallVector<Loop *, 4> levels1;
+    SmallVector<Loop *, 4> levels2;
+    if (!getPerfectNestLevels(L1, levels1)) {
+        C1.fusible = false;
+    }
+    if (!getPerfectNestLevels(L2, levels2)) {
+        C2.fusible = false;
+    }
+    if (!C1.fusible || !C2.fusible || levels1.size() != levels2.size()) {
+        PASS_LOG << "Loops are not perfect nests of the same depth \n";
+        return false;
+    }
+    if (isRotatedLoop(L1) && levels1.size() > 1) {
+        PASS_LOG << "Rotated loop nests are not supported \n";
+        return false;
+    }
+
+    // Get the trip counts using getExitCount
+    if (!C1.tripCount) {
+        const SCEV *tripCountL1 = SE.getExitCount(L1, L1->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+        C1.tripCount = tripCountL1;
+    }
+
+    if (!C2.tripCount) {
+        const SCEV *tripCountL2 = SE.getExitCount(L2, L2->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+        C2.tripCount = tripCountL2;
+    }
+
+
+    // Print the trip counts
+    PASS_LOG << "Trip count of L1: ";
+    if (AssignmentsLog) C1.tripCount->print(*AssignmentsLog);
+    PASS_LOG << "\n";
+
+    PASS_LOG << "Trip count of L2: ";
+    if (AssignmentsLog) C2.tripCount->print(*AssignmentsLog);
+    PASS_LOG << "\n";
+
+    // Check if both trip counts are equal, or can be made equal by peeling L1
+    unsigned peelCount = 0;
+    if (!haveSameTripCount(C1.tripCount, C2.tripCount, SE)) {
+        peelCount = isRotatedLoop(L1) ? 0 : getPeelCount(C1, C2, SE);
+        if (!peelCount) {
+            PASS_LOG << "Loops have a different trip count \n";
+            return false;
+        }
+        //checked here, before the intervening code is moved: peeling must not fail once the IR has changed
+        if (!canPeelLoop(L1)) {
+            PASS_LOG << "L1 cannot be peeled \n";
+            return false;
+        }
+        PASS_LOG << "L1 runs " << peelCount << " more iterations than L2 \n";
+    } else {
+        PASS_LOG << "Loops have the same trip count \n";
+    }
+
+    // The inner levels of the nests must match exactly, and be rewired like the outer ones
+    for (unsigned k = 1; k < levels1.size(); ++k) {
+        Loop *inner1 = levels1[k];
+        Loop *inner2 = levels2[k];
+        if (peelCount ||
+            !haveSameTripCount(SE.getExitCount(inner1, inner1->getExitingBlock()), SE.getExitCount(inner2, inner2->getExitingBlock()), SE)) {
+            PASS_LOG << "Loops at level " << k << " have a different trip count \n";
+            return false;
+        }
+        if (!haveFusibleShapes(inner1, inner2, LI)) {
+            PASS_LOG << "Loops at level " << k << " cannot be rewired into a single loop \n";
+            return false;
+        }
+    }
+
+    // The header PHIs of L2 are rewritten on top of the iterations of L1, at every level: all the levels
+    // are checked before the IR changes, so that the nests are never left half fused
+    for (unsigned k = 0; k < levels1.size(); ++k) {
+        if (!levels1[k]->getLoopPreheader() || !levels1[k]->getLoopLatch() || !canCarryHeaderPHIs(levels1[k], levels2[k], DT, SE)) {
+            PASS_LOG << "Header PHIs of the loops at level " << k << " cannot be carried into L1 \n";
+            return false;
+        }
+    }
+
+    if (usesValuesOfLoop(L2, L1)) {
+        PASS_LOG << "L2 depends on the scalar results of L1 \n";
+        return false;
+    }
+
+    // Control flow equivalence is guaranteed by the candidate set both loops belong to. A guard implied by
+    // the one of L1 in a single direction is not transitive, so the guards of the two loops are compared again
+    BranchInst *L1Guard = findGuard(L1, LI);
+    BranchInst *L2Guard = findGuard(L2, LI);
+    bool splitGuard = false;
+    if (L1Guard && L2Guard && !guardsAreEquivalent(L1, L1Guard, L2, L2Guard, SE)) {
+        if (!guardImpliesGuard(L1, L1Guard, L2, L2Guard) || !canSplitImpliedGuard(L2, L2Guard)) {
+            PASS_LOG << "The guard of L2 cannot be dropped after L1 \n";
+            return false;
+        }
+        splitGuard = true;
+    }
+
+    SmallVector<std::pair<const Value *, const Value *>, 4> overlapChecks;
+    if (!dependencesAllowFusion(L1, L2, DT, SE, DI, AA, cache, overlapChecks, peelCount)) {
+        PASS_LOG << "Loops are dependent \n";
+        return false;
+    }
+
+    // Objects that may alias are only fused in a version guarded by runtime overlap checks
+    SmallVector<std::array<const SCEV *, 4>, 4> overlapRanges;
+    if (!overlapChecks.empty()) {
+        if (peelCount || L1Guard || overlapChecks.size() > maxRuntimeChecks) {
+            PASS_LOG << "Loops need " << overlapChecks.size() << " runtime overlap checks and cannot be versioned \n";
+            return false;
+        }
+        if (!getOverlapRanges(levels1, levels2, overlapChecks, SE, F, overlapRanges)) {
+            PASS_LOG << "Cannot build the runtime overlap checks \n";
+            return false;
+        }
+    }
+
+    PASS_LOG << "Loops don't have any negative distance dependences \n";
+
+    // Fusione legale: il modello di costo decide se conviene
+    if (!FusionIgnoreCostModel) {
+        //the descriptors are copied: a later lookup in the cache may move them
+        ArrayRef<memoryAccess> cached1 = getMemoryAccesses(L1, SE, cache);
+        SmallVector<memoryAccess, 16> accesses1(cached1.begin(), cached1.end());
+        ArrayRef<memoryAccess> cached2 = getMemoryAccesses(L2, SE, cache);
+        SmallVector<memoryAccess, 16> accesses2(cached2.begin(), cached2.end());
+        if (!isFusionProfitable(levels1, levels2, accesses1, accesses2, peelCount, SE, AM.getResult<TargetIRAnalysis>(F),
+                                AM.getResult<OptimizationRemarkEmitterAnalysis>(F))) {
+            PASS_LOG << "Fusion is legal but not profitable \n";
+            return false;
+        }
+    }
+    PASS_LOG << "All Loop Fusion conditions satisfied. \n";
+
+    //the cache is keyed by loops and headers, which the transforms below reuse: the fused loop keeps the
+    //header of L1, peeling and versioning change its iterations, and destroyed loops may be reallocated.
+    //The cache only saves work between attempts that fail before this point, so drop all of it
+    cache.accesses.clear();
+    cache.results.clear();
+
+    changed = true;
+    moveInterveningCode(L1, L2, toHoist, toSink);
+
+    if (splitGuard) {
+        splitImpliedGuard(L1, L2, L2Guard, DTU, LI, SE, F);
+    }
+
+    if (!overlapRanges.empty()) {
+        versionLoops(levels1, levels2, overlapRanges, DTU, LI, SE, F);
+    }
+
+    if (peelCount) {
+        if (!peelFirstIterations(L1, peelCount, DTU, LI, SE, F)) {
+            return false;
+        }
+        C1.tripCount = C2.tripCount;
+    }
+
+    if (!fuseLoopNests(levels1, levels2, DT, DTU, LI, F, SE)) {
+        PASS_LOG << "The loops could not be fused at every level \n";
+        return false;
+    }
+
+    PASS_LOG << "The code has been transformed. \n";
+    return true;
+}
+
+//split a group of sibling loops, sorted in program order, into sets of control flow equivalent loops
+void collectCandidateSets(ArrayRef<Loop *> siblings, DenseMap<BasicBlock *, unsigned> &order, DominatorTree &DT, PostDominatorTree &PDT, LoopInfo &LI, ScalarEvolution &SE, SmallVectorImpl<SmallVector<fusionCandidate, 4>> &sets) {
+    SmallVector<Loop *, 8> sorted(siblings.begin(), siblings.end());
+    llvm::sort(sorted, [&](Loop *A, Loop *B) {
+        return order[A->getHeader()] < order[B->getHeader()];
+    });
+
+    //subloops first, so that inner loops are fused before their parents are considered
+    for (Loop *L : sorted) {
+        collectCandidateSets(L->getSubLoops(), order, DT, PDT, LI, SE, sets);
+    }
+
+    SmallVector<SmallVector<fusionCandidate, 4>, 4> groupSets;
+    for (Loop *L : sorted) {
+        fusionCandidate candidate = {nullptr, L, L->getHeader(), true};
+
+        //the loops of a set are ordered by dominance: L can only follow the ones already there
+        bool added = false;
+        for (auto &set : groupSets) {
+            if (controlFlowEquivalent(set.front().loop, L, DT, PDT, LI, SE)) {
+                set.push_back(candidate);
+                added = true;
+                break;
+            }
+        }
+        if (!added) {
+            groupSets.push_back({candidate});
+        }
+    }
+
+    for (auto &set : groupSets) {
+        if (set.size() > 1) {
+            sets.push_back(std::move(set));
+        }
+    }
+}
+
+//after the fusion the consumer of an array often reads a[i] right after the producer stored it:
+//forward the stored value to the loads of the same iteration that access the same AddRec, and
+//collect the underlying objects of the forwarded stores
+void forwardStoredValues(Loop *L, DominatorTree &DT, AAResults &AA, ScalarEvolution &SE, SmallPtrSetImpl<const Value *> &objects) {
+    SmallVector<StoreInst *, 8> stores;
+    SmallVector<LoadInst *, 8> loads;
+    SmallVector<Instruction *, 8> writers;
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (auto *store = dyn_cast<StoreInst>(&I)) {
+                if (store->isSimple()) {
+                    stores.push_back(store);
+                }
+            } else if (auto *load = dyn_cast<LoadInst>(&I)) {
+                if (load->isSimple()) {
+                    loads.push_back(load);
+                }
+            }
+            if (I.mayWriteToMemory()) {
+                writers.push_back(&I);
+            }
+        }
+    }
+
+    for (LoadInst *load : loads) {
+        const SCEV *loadAddress = SE.getSCEV(load->getPointerOperand());
+        MemoryLocation location = MemoryLocation::get(load);
+
+        for (StoreInst *store : stores) {
+            //same iteration: the store is executed before the load every time the load is
+            if (store->getValueOperand()->getType() != load->getType() || !DT.dominates(store, load) ||
+                SE.getSCEV(store->getPointerOperand()) != loadAddress) {
+                continue;
+            }
+
+            //no other instruction of the loop may overwrite the location in between
+            bool clobbered = llvm::any_of(writers, [&](Instruction *writer) {
+                return writer != store && isModSet(AA.getModRefInfo(writer, location));
+            });
+            if (clobbered) {
+                continue;
+            }
+
+            PASS_LOG << "Forwarding " << *store << " to " << *load << "\n";
+            objects.insert(getUnderlyingObject(store->getPointerOperand()));
+            SE.forgetValue(load);
+            load->replaceAllUsesWith(store->getValueOperand());
+            load->eraseFromParent();
+            break;
+        }
+    }
+}
+
+//collect the users of an object that is only written: address computations, stores into it and lifetime markers
+bool collectWriteOnlyUsers(Value *V, SmallSetVector<Instruction *, 16> &users) {
+    for (User *U : V->users()) {
+        auto *I = cast<Instruction>(U);
+        if (isa<GetElementPtrInst>(I) || isa<BitCastInst>(I)) {
+            if (users.insert(I) && !collectWriteOnlyUsers(I, users)) {
+                return false;
+            }
+        } else if (auto *store = dyn_cast<StoreInst>(I)) {
+            if (store->getValueOperand() == V) {
+                return false;
+            }
+            users.insert(store);
+        } else if (I->isLifetimeStartOrEnd()) {
+            users.insert(I);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+//a local temporary whose loads have all been forwarded is never read again: delete its stores and the allocation
+void deleteWriteOnlyAllocas(SmallPtrSetImpl<const Value *> &objects, ScalarEvolution &SE) {
+    for (const Value *object : objects) {
+        auto *alloca = dyn_cast<AllocaInst>(const_cast<Value *>(object));
+        SmallSetVector<Instruction *, 16> users;
+        if (!alloca || !collectWriteOnlyUsers(alloca, users)) {
+            continue;
+        }
+
+        PASS_LOG << "Deleting the temporary array " << *alloca << "\n";
+        //the users were collected top-down: erase them bottom-up. SCEV may still describe the addresses
+        for (Instruction *I : reverse(users)) {
+            SE.forgetValue(I);
+            I->eraseFromParent();
+        }
+        SE.forgetValue(alloca);
+        alloca->eraseFromParent();
+    }
+}
+
+//a level of a rectangular nest: the loop runs from start while iv <pred> bound, by a constant positive step
+struct nestLevel {
+    Loop *loop;
+    PHINode *iv;
+    ICmpInst *exitCmp;
+    Value *start;
+    Value *bound;
+    int64_t step;
+};
+
+//a top-tested loop counting up from start to bound: the header holds just the induction variable, the exit
+//compare and the branch, the latch the increment. Start and bound must be available outside the outer loop,
+//where the transformations build their new code
+bool getNestLevel(Loop *L, Loop *outer, ScalarEvolution &SE, nestLevel &level) {
+    BasicBlock *header = L->getHeader();
+    auto *branch = dyn_cast<BranchInst>(header->getTerminator());
+    if (isRotatedLoop(L) || !L->getLoopPreheader() || L->getExitingBlock() != header || !branch ||
+        !branch->isConditional() || !L->contains(branch->getSuccessor(0))) {
+        return false;
+    }
+
+    auto *cmp = dyn_cast<ICmpInst>(branch->getCondition());
+    if (!cmp || !cmp->hasOneUse() || (cmp->getPredicate() != ICmpInst::ICMP_SLT && cmp->getPredicate() != ICmpInst::ICMP_ULT)) {
+        return false;
+    }
+    auto *iv = dyn_cast<PHINode>(cmp->getOperand(0));
+    const SCEVAddRecExpr *rec = iv && iv->getParent() == header ? getInductionRecurrence(iv, L, SE) : nullptr;
+    auto *step = rec ? dyn_cast<SCEVConstant>(rec->getStepRecurrence(SE)) : nullptr;
+    if (!step || !step->getAPInt().isStrictlyPositive()) {
+        return false;
+    }
+
+    Value *start = iv->getIncomingValueForBlock(L->getLoopPreheader());
+    Value *bound = cmp->getOperand(1);
+    for (Value *V : {start, bound}) {
+        auto *I = dyn_cast<Instruction>(V);
+        if (I && outer->contains(I)) {
+            return false;
+        }
+    }
+
+    for (PHINode &phi : header->phis()) {
+        if (&phi != iv) {
+            PASS_LOG << "Loop " << header->getName() << " carries a recurrence across its iterations \n";
+            return false;
+        }
+    }
+
+    //es: %inc = add nsw i32 %i, 1 in the latch, used only by %i
+    auto *next = dyn_cast<BinaryOperator>(iv->getIncomingValueForBlock(L->getLoopLatch()));
+    if (header->size() != 3 || !next || next->getParent() != L->getLoopLatch() || !next->hasOneUse() ||
+        !llvm::all_of(next->operands(), [&](Value *V) { return V == iv || isa<Constant>(V); })) {
+        return false;
+    }
+    level = {L, iv, cmp, start, bound, step->getAPInt().getSExtValue()};
+    return true;
+}
+
+//collect the levels of a 2-D or 3-D perfect nest whose loops run over a rectangular iteration space:
+//every bound and start is invariant in the whole nest, and the nest computes no value used after it.
+//The latches of the outer levels hold just the increment: all the work of the nest is in the innermost body
+bool getRectangularNestLevels(Loop *outer, ScalarEvolution &SE, SmallVectorImpl<nestLevel> &nest) {
+    SmallVector<Loop *, 4> levels;
+    if (!getPerfectNestLevels(outer, levels) || levels.size() < 2 || levels.size() > 3 || !outer->getLoopPreheader() ||
+        !outer->getExitBlock() || !outer->getExitBlock()->phis().empty()) {
+        return false;
+    }
+
+    for (Loop *L : levels) {
+        nestLevel level;
+        if (!getNestLevel(L, outer, SE, level) || (!L->isInnermost() && L->getLoopLatch()->size() != 2)) {
+            return false;
+        }
+        nest.push_back(level);
+    }
+
+    for (BasicBlock *BB : outer->blocks()) {
+        for (Instruction &I : *BB) {
+            for (User *U : I.users()) {
+                if (!outer->contains(cast<Instruction>(U))) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//an access of the nest seen as base + scale * (start + the sum of stride * index over the levels)
+struct nestAccess {
+    const SCEV *base;
+    uint64_t scale;
+    const SCEV *start;
+    SmallVector<const SCEV *, 3> strides;
+};
+
+//stride of an access at every level of the nest, zero where its address doesn't change. The offset from
+//the base is often a scaled and extended index: both steps keep distinct indices distinct, so the strides
+//are taken on the index itself. Calls have no single address and are never described
+bool getNestAccess(Instruction *I, ArrayRef<nestLevel> nest, ScalarEvolution &SE, nestAccess &access) {
+    Value *ptr = getLoadStorePointerOperand(I);
+    if (!ptr) {
+        return false;
+    }
+    const SCEV *S = SE.getSCEV(ptr);
+    access.base = SE.getPointerBase(S);
+    S = SE.getMinusSCEV(S, access.base);
+    access.scale = 1;
+    while (true) {
+        auto *mul = dyn_cast<SCEVMulExpr>(S);
+        if (mul && mul->getNumOperands() == 2 && isa<SCEVConstant>(mul->getOperand(0)) &&
+            cast<SCEVConstant>(mul->getOperand(0))->getAPInt().isStrictlyPositive()) {
+            access.scale *= cast<SCEVConstant>(mul->getOperand(0))->getAPInt().getZExtValue();
+            S = mul->getOperand(1);
+        } else if (isa<SCEVSignExtendExpr>(S) || isa<SCEVZeroExtendExpr>(S)) {
+            S = cast<SCEVCastExpr>(S)->getOperand();
+        } else {
+            break;
+        }
+    }
+
+    access.strides.assign(nest.size(), nullptr);
+    for (int k = nest.size() - 1; k >= 0; --k) {
+        Loop *L = nest[k].loop;
+        auto *rec = dyn_cast<SCEVAddRecExpr>(S);
+        if (rec && rec->getLoop() == L && rec->isAffine()) {
+            access.strides[k] = rec->getStepRecurrence(SE);
+            S = rec->getStart();
+        } else if (SE.isLoopInvariant(S, L)) {
+            access.strides[k] = SE.getZero(S->getType());
+        } else {
+            return false;
+        }
+    }
+    access.start = S;
+    return true;
+}
+
+//fallback for the subscripts DependenceInfo cannot separate, like a[i * n + j]: two accesses with the same
+//base and strides touch the same element only when the indices of the levels where they move are equal,
+//if the range of each of these levels is within the stride of the others. The levels where the address
+//doesn't move are free: any two of their iterations may touch the same element. Accesses starting at
+//least a whole span of the nest apart, like a[(i - 1) * n + j] and a[i * n + j] in the loop on j, never meet
+bool getFreeNestLevels(Instruction *src, Instruction *dst, ArrayRef<nestLevel> nest, ScalarEvolution &SE, BitVector &freeLevels) {
+    nestAccess access1, access2;
+    if (!getNestAccess(src, nest, SE, access1) || !getNestAccess(dst, nest, SE, access2) ||
+        access1.base != access2.base || access1.scale != access2.scale || access1.start->getType() != access2.start->getType() ||
+        access1.strides != access2.strides) {
+        return false;
+    }
+    ArrayRef<const SCEV *> strides = access1.strides;
+
+    freeLevels.reset();
+    freeLevels.resize(nest.size());
+    SmallVector<const SCEV *, 3> ranges(nest.size(), nullptr);
+    for (unsigned k = 0; k < nest.size(); ++k) {
+        const SCEV *stride = strides[k];
+        if (stride->isZero()) {
+            freeLevels.set(k);
+            continue;
+        }
+        //span of the addresses of the level: its iterations, from start to bound (excluded), times the stride
+        const nestLevel &level = nest[k];
+        Type *type = stride->getType();
+        bool isSigned = level.exitCmp->isSigned();
+        const SCEV *start = isSigned ? SE.getTruncateOrSignExtend(SE.getSCEV(level.start), type) : SE.getTruncateOrZeroExtend(SE.getSCEV(level.start), type);
+        const SCEV *bound = isSigned ? SE.getTruncateOrSignExtend(SE.getSCEV(level.bound), type) : SE.getTruncateOrZeroExtend(SE.getSCEV(level.bound), type);
+        const SCEV *step = SE.getConstant(type, level.step);
+        const SCEV *iterations = SE.getUDivExpr(SE.getAddExpr(SE.getMinusSCEV(bound, start), SE.getMinusSCEV(step, SE.getOne(type))), step);
+        ranges[k] = SE.getMulExpr(iterations, stride);
+    }
+
+    //every pair of moving levels must be ordered: the span of one within the stride of the other. A symbolic
+    //stride, like the n of a[i * n + j], is positive when it contains the span of a level with a positive stride
+    for (unsigned a = 0; a < nest.size(); ++a) {
+        if (!ranges[a]) {
+            continue;
+        }
+        bool positive = SE.isKnownPositive(strides[a]);
+        for (unsigned b = 0; b < nest.size(); ++b) {
+            if (b == a || !ranges[b]) {
+                continue;
+            }
+            bool aContainsB = SE.isKnownPredicate(ICmpInst::ICMP_SLE, ranges[b], strides[a]);
+            if (!aContainsB && !SE.isKnownPredicate(ICmpInst::ICMP_SLE, ranges[a], strides[b])) {
+                return false;
+            }
+            positive |= aContainsB && SE.isKnownPositive(strides[b]);
+        }
+        if (!positive) {
+            return false;
+        }
+    }
+
+    if (access1.start != access2.start) {
+        //with positive strides every access stays within the sum of the spans of the levels from its start
+        const SCEV *span = SE.getZero(access1.start->getType());
+        for (const SCEV *range : ranges) {
+            if (range) {
+                span = SE.getAddExpr(span, range);
+            }
+        }
+        const SCEV *distance = SE.getMinusSCEV(access2.start, access1.start);
+        if (!SE.isKnownPredicate(ICmpInst::ICMP_SGE, distance, span) &&
+            !SE.isKnownPredicate(ICmpInst::ICMP_SGE, SE.getNegativeSCEV(distance), span)) {
+            return false;
+        }
+        freeLevels.reset();
+    }
+    return true;
+}
+
+//a store of an innermost loop that, over all the iterations, fills a contiguous region of memory:
+//with a loop-invariant byte pattern (memset) or with the values loaded from another region (memcpy/memmove)
+struct loopIdiom {
+    StoreInst *store;
+    LoadInst *load;           //null for a memset
+    Value *byteValue;         //null for a memcpy/memmove
+    const SCEVAddRecExpr *storeRec;
+    const SCEVAddRecExpr *loadRec;
+    bool overlapping;         //the regions may overlap: memmove instead of memcpy
+};
+
+//polynomial recurrence of an access that walks the memory one element per iteration, without gaps.
+//getSCEVAddRec may rely on runtime predicates: the recurrence is accepted only when it is the plain SCEV
+const SCEVAddRecExpr *getContiguousRecurrence(Instruction *I, Loop *L, ScalarEvolution &SE, const DataLayout &DL) {
+    const SCEVAddRecExpr *rec = getSCEVAddRec(I, L, SE);
+    if (!rec || !rec->isAffine() || rec != SE.getSCEVAtScope(getLoadStorePointerOperand(I), L)) {
+        return nullptr;
+    }
+    auto *stride = dyn_cast<SCEVConstant>(rec->getStepRecurrence(SE));
+    uint64_t size = DL.getTypeStoreSize(getLoadStoreType(I));
+    if (!stride || stride->getAPInt().abs() != size || DL.getTypeAllocSize(getLoadStoreType(I)) != size) {
+        return nullptr;
+    }
+    return rec;
+}
+
+//number of times the blocks dominating the latch run: the exit count of the header, or one more
+//than the exit count of the latch when the loop leaves from there (rotated or single block loops)
+const SCEV *getStoreExecutions(Loop *L, ScalarEvolution &SE) {
+    const SCEV *exitCount = SE.getExitCount(L, L->getExitingBlock(), ScalarEvolution::ExitCountKind::Exact);
+    if (isa<SCEVCouldNotCompute>(exitCount)) {
+        return exitCount;
+    }
+    if (L->getExitingBlock() == L->getLoopLatch()) {
+        exitCount = SE.getAddExpr(exitCount, SE.getOne(exitCount->getType()));
+    }
+    return exitCount;
+}
+
+//collect the stores of L that form an idiom. Every other memory access of the loop must be independent
+//from the idioms: the whole region of an idiom is written before the loop, all at once
+bool collectLoopIdioms(Loop *L, ScalarEvolution &SE, DependenceInfo &DI, DominatorTree &DT, const DataLayout &DL, SmallVectorImpl<loopIdiom> &idioms) {
+    BasicBlock *latch = L->getLoopLatch();
+    SmallVector<Instruction *, 16> memInsts;
+    collectMemoryInstructions(L, memInsts);
+
+    SmallPtrSet<Instruction *, 16> idiomInsts;
+    for (Instruction *I : memInsts) {
+        auto *store = dyn_cast<StoreInst>(I);
+        //the store must run once per iteration: not in an exiting header, in a block dominating the latch
+        if (!store || !store->isSimple() || !DT.dominates(store->getParent(), latch) ||
+            (store->getParent() == L->getExitingBlock() && L->getExitingBlock() != latch)) {
+            continue;
+        }
+        const SCEVAddRecExpr *storeRec = getContiguousRecurrence(store, L, SE, DL);
+        if (!storeRec) {
+            continue;
+        }
+
+        loopIdiom idiom = {store, nullptr, nullptr, storeRec, nullptr, false};
+        Value *value = store->getValueOperand();
+        auto *load = dyn_cast<LoadInst>(value);
+        if (L->isLoopInvariant(value)) {
+            idiom.byteValue = isBytewiseValue(value, DL);
+        } else if (load && L->contains(load) && load->isSimple() && load->hasOneUse()) {
+            const SCEVAddRecExpr *loadRec = getContiguousRecurrence(load, L, SE, DL);
+            if (loadRec && loadRec->getStepRecurrence(SE) == storeRec->getStepRecurrence(SE)) {
+                idiom.load = load;
+                idiom.loadRec = loadRec;
+            }
+        }
+        if (!idiom.byteValue && !idiom.load) {
+            continue;
+        }
+
+        //copying a value stored by an earlier iteration (es: a[i + 1] = a[i]) propagates it: no memmove does that
+        if (idiom.load) {
+            if (std::unique_ptr<Dependence> dep = DI.depends(store, load, true)) {
+                if (dep->isConfused() || (dep->getDirection(L->getLoopDepth()) & Dependence::DVEntry::LT)) {
+                    PASS_LOG << *load << " may read a value stored by " << *store << " in an earlier iteration \n";
+                    continue;
+                }
+                idiom.overlapping = true;
+            }
+        }
+        idioms.push_back(idiom);
+        idiomInsts.insert(store);
+        if (idiom.load) {
+            idiomInsts.insert(idiom.load);
+        }
+    }
+
+    for (const loopIdiom &idiom : idioms) {
+        for (Instruction *I : memInsts) {
+            if (I == idiom.store || I == idiom.load) {
+                continue;
+            }
+            for (Instruction *idiomInst : {cast<Instruction>(idiom.store), cast_or_null<Instruction>(idiom.load)}) {
+                if (idiomInst && mayConflict(idiomInst, I, DI)) {
+                    PASS_LOG << *idiom.store << " depends on " << *I << ", which is not part of the idiom \n";
+                    idioms.clear();
+                    return false;
+                }
+            }
+        }
+    }
+    return !idioms.empty();
+}
+
+//the loop computes nothing anymore: the preheader jumps straight to the exit and its blocks are deleted
+bool deleteEmptyLoop(Loop *L, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *exit = L->getExitBlock();
+    if (!exit || !exit->phis().empty()) {
+        return false;
+    }
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (I.mayHaveSideEffects()) {
+                return false;
+            }
+            for (User *U : I.users()) {
+                if (!L->contains(cast<Instruction>(U))) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    SE.forgetLoop(L);
+    BasicBlock *header = L->getHeader();
+    preheader->getTerminator()->replaceUsesOfWith(header, exit);
+    DTU.applyUpdates({{DominatorTree::Delete, preheader, header}, {DominatorTree::Insert, preheader, exit}});
+    LI.erase(L);
+    deleteUnreachableBlocks(*preheader->getParent(), LI, DTU);
+    return true;
+}
+
+//replace the idioms of an innermost loop with calls to llvm.memset/llvm.memcpy/llvm.memmove in its
+//preheader, then delete the loop if nothing else is left in it
+bool recognizeLoopIdioms(Loop *L, ScalarEvolution &SE, DependenceInfo &DI, DominatorTree &DT, DomTreeUpdater &DTU, LoopInfo &LI) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    if (!L->isInnermost() || !preheader || !L->getLoopLatch() || !L->getExitingBlock() ||
+        (L->getExitingBlock() != L->getHeader() && L->getExitingBlock() != L->getLoopLatch())) {
+        return false;
+    }
+    const SCEV *executions = getStoreExecutions(L, SE);
+    if (isa<SCEVCouldNotCompute>(executions)) {
+        return false;
+    }
+
+    const DataLayout &DL = preheader->getModule()->getDataLayout();
+    SmallVector<loopIdiom, 4> idioms;
+    if (!collectLoopIdioms(L, SE, DI, DT, DL, idioms)) {
+        return false;
+    }
+    PASS_LOG << "Analyzing loop " << L->getHeader()->getName() << ": " << idioms.size() << " idioms, stores executed " << *executions << " times \n";
+
+    SCEVExpander expander(SE, DL, "loop-idiom");
+    Instruction *insertPt = preheader->getTerminator();
+    IRBuilder<> builder(insertPt);
+    Type *intPtrTy = DL.getIntPtrType(preheader->getContext());
+    const SCEV *count = SE.getTruncateOrZeroExtend(executions, intPtrTy);
+
+    for (const loopIdiom &idiom : idioms) {
+        StoreInst *store = idiom.store;
+        uint64_t size = DL.getTypeStoreSize(getLoadStoreType(store));
+        Value *bytes = expander.expandCodeFor(SE.getMulExpr(count, SE.getConstant(intPtrTy, size)), intPtrTy, insertPt);
+
+        //a loop walking backwards starts its region from the address of the last iteration
+        auto regionStart = [&](const SCEVAddRecExpr *rec, Instruction *I) {
+            const SCEV *start = rec->getStart();
+            if (cast<SCEVConstant>(rec->getStepRecurrence(SE))->getAPInt().isNegative()) {
+                const SCEV *last = SE.getMinusSCEV(count, SE.getOne(intPtrTy));
+                start = SE.getAddExpr(start, SE.getMulExpr(last, SE.getTruncateOrSignExtend(rec->getStepRecurrence(SE), intPtrTy)));
+            }
+            return expander.expandCodeFor(start, getLoadStorePointerOperand(I)->getType(), insertPt);
+        };
+
+        Value *dst = regionStart(idiom.storeRec, store);
+        if (idiom.byteValue) {
+            builder.CreateMemSet(dst, idiom.byteValue, bytes, store->getAlign());
+            PASS_LOG << *store << " replaced with a memset \n";
+        } else {
+            Value *src = regionStart(idiom.loadRec, idiom.load);
+            if (idiom.overlapping) {
+                builder.CreateMemMove(dst, store->getAlign(), src, idiom.load->getAlign(), bytes);
+            } else {
+                builder.CreateMemCpy(dst, store->getAlign(), src, idiom.load->getAlign(), bytes);
+            }
+            PASS_LOG << *store << " replaced with a " << (idiom.overlapping ? "memmove" : "memcpy") << "\n";
+        }
+
+        //the address computations of the accesses die with them
+        Value *storePtr = store->getPointerOperand();
+        store->eraseFromParent();
+        RecursivelyDeleteTriviallyDeadInstructions(storePtr);
+        if (idiom.load) {
+            Value *loadPtr = idiom.load->getPointerOperand();
+            idiom.load->eraseFromParent();
+            RecursivelyDeleteTriviallyDeadInstructions(loadPtr);
+        }
+    }
+
+    SE.forgetLoop(L);
+    if (deleteEmptyLoop(L, DTU, LI, SE)) {
+        PASS_LOG << "The loop is empty and has been deleted \n";
+    }
+    return true;
+}
+
+bool runIdiomOnFunction(Function &F, FunctionAnalysisManager &AM) {
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Lazy);
+
+    // I loop possono sparire durante la trasformazione: vengono raccolti prima
+    SmallVector<Loop *, 8> innermost;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (L->isInnermost()) {
+            innermost.push_back(L);
+        }
+    }
+
+    bool changed = false;
+    for (Loop *L : innermost) {
+        changed |= recognizeLoopIdioms(L, SE, DI, DT, DTU, LI);
+        DTU.flush();
+    }
+    return changed;
+}
+
+//check that the memory accesses of L may touch the same element only within the same iteration of L. The SCEV
+//fallback looks at the whole nest when L is the outer level of a rectangular one, like the i of a[i * n + j]
+bool areIterationsIndependent(Loop *L, ArrayRef<Instruction *> memInsts, ScalarEvolution &SE, DependenceInfo &DI) {
+    SmallVector<nestLevel, 3> nest;
+    nestLevel level;
+    if (!getRectangularNestLevels(L, SE, nest) && getNestLevel(L, L, SE, level)) {
+        nest.assign(1, level);
+    }
+
+    unsigned depth = L->getLoopDepth();
+    for (unsigned a = 0; a < memInsts.size(); ++a) {
+        for (unsigned b = a; b < memInsts.size(); ++b) {
+            Instruction *src = memInsts[a];
+            Instruction *dst = memInsts[b];
+            if (!src->mayWriteToMemory() && !dst->mayWriteToMemory()) {
+                continue;
+            }
+            std::unique_ptr<Dependence> dep = DI.depends(src, dst, true);
+            if (!dep) {
+                continue;
+            }
+            unsigned direction = dep->isConfused() ? (unsigned)Dependence::DVEntry::ALL : dep->getDirection(depth);
+            //for a[i * n + j] DependenceInfo gives up: with the strides of SCEV the accesses still meet only in the same iteration
+            BitVector freeLevels;
+            if (direction != Dependence::DVEntry::EQ && !nest.empty() && getFreeNestLevels(src, dst, nest, SE, freeLevels) &&
+                !freeLevels.test(0)) {
+                direction = Dependence::DVEntry::EQ;
+            }
+            if (direction != Dependence::DVEntry::EQ) {
+                PASS_LOG << *src << " and " << *dst << " may access the same element in different iterations \n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//record in the metadata of an innermost loop that its iterations don't depend on each other through memory:
+//all its accesses go in a new access group listed by llvm.loop.parallel_accesses, and llvm.loop.vectorize.enable
+//(unless forceVectorize is false) asks for the loop to be vectorized. The vectorizer then skips its own dependence
+//analysis, together with the runtime alias checks it would version the loop with
+bool annotateParallelAccesses(Loop *L, ScalarEvolution &SE, DependenceInfo &DI, bool forceVectorize = true) {
+    if (!L->isInnermost() || !L->getLoopLatch() || L->isAnnotatedParallel()) {
+        return false;
+    }
+    SmallVector<Instruction *, 16> memInsts;
+    collectMemoryInstructions(L, memInsts);
+    for (Instruction *I : memInsts) {
+        if (!isa<LoadInst>(I) && !isa<StoreInst>(I)) {
+            PASS_LOG << "Loop " << L->getHeader()->getName() << " accesses memory through " << *I << "\n";
+            return false;
+        }
+    }
+    if (memInsts.empty() || !areIterationsIndependent(L, memInsts, SE, DI)) {
+        return false;
+    }
+
+    LLVMContext &Ctx = L->getHeader()->getContext();
+    MDNode *accessGroup = MDNode::getDistinct(Ctx, {});
+    for (Instruction *I : memInsts) {
+        I->setMetadata(LLVMContext::MD_access_group, uniteAccessGroups(I->getMetadata(LLVMContext::MD_access_group), accessGroup));
+    }
+
+    //the properties already attached to the loop are kept, a vectorize.enable set by the user included
+    SmallVector<Metadata *, 4> properties = {nullptr};
+    if (MDNode *loopID = L->getLoopID()) {
+        properties.append(loopID->op_begin() + 1, loopID->op_end());
+    }
+    properties.push_back(MDNode::get(Ctx, {MDString::get(Ctx, "llvm.loop.parallel_accesses"), accessGroup}));
+    if (forceVectorize && !findOptionMDForLoop(L, "llvm.loop.vectorize.enable")) {
+        properties.push_back(MDNode::get(Ctx, {MDString::get(Ctx, "llvm.loop.vectorize.enable"),
+                                               ConstantAsMetadata::get(ConstantInt::getTrue(Ctx))}));
+    }
+    MDNode *newID = MDNode::getDistinct(Ctx, properties);
+    newID->replaceOperandWith(0, newID);
+    L->setLoopID(newID);
+
+    PASS_LOG << "Loop " << L->getHeader()->getName() << ": " << memInsts.size() << " accesses marked as parallel \n";
+    return true;
+}
+
+bool runParallelAccessesOnFunction(Function &F, FunctionAnalysisManager &AM, bool forceVectorize) {
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+
+    // Il vectorizer lavora solo sui loop piu' interni
+    bool changed = false;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (L->isInnermost()) {
+            changed |= annotateParallelAccesses(L, SE, DI, forceVectorize);
+        }
+    }
+    return changed;
+}
+
+//maxRuntimeChecks: overlap checks the fused loops may be versioned behind, 0 disables versioning
+bool runOnFunction(Function &F, FunctionAnalysisManager &AM, unsigned maxRuntimeChecks) {
+    PASS_LOG << "Start \n";
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    AAResults &AA = AM.getResult<AAManager>(F);
+    dependenceCache cache;
+    // Tutte le modifiche al CFG passano da qui: gli alberi di dominanza vengono aggiornati a ogni fusione
+    DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+
+    // Numera i blocchi in ordine di programma
+    DenseMap<BasicBlock *, unsigned> order;
+    unsigned index = 0;
+    for (BasicBlock *BB : ReversePostOrderTraversal<Function *>(&F)) {
+        order[BB] = index++;
+    }
+
+    // Insiemi di loop fratelli e control flow equivalenti, ordinati per dominanza
+    SmallVector<SmallVector<fusionCandidate, 4>, 4> sets;
+    collectCandidateSets(LI.getTopLevelLoops(), order, DT, PDT, LI, SE, sets);
+    PASS_LOG << "Found " << sets.size() << " sets of fusion candidates! \n";
+
+    bool changed = false;
+    SmallPtrSet<Loop *, 8> fusedLoops;
+    for (auto &set : sets) {
+        // Un solo passaggio greedy: se set[i] e set[i + 1] vengono fusi, set[i] prova subito con il successivo
+        size_t i = 0;
+        while (i + 1 < set.size()) {
+            // I loop contenuti nel secondo candidato spariscono con la fusione
+            SmallPtrSet<BasicBlock *, 4> deadHeaders;
+            for (Loop *L : depth_first(set[i + 1].loop)) {
+                deadHeaders.insert(L->getHeader());
+            }
+
+            bool modified = false;
+            bool fused = tryFuseLoops(set[i], set[i + 1], SE, DT, DI, AA, cache, DTU, LI, F, AM, maxRuntimeChecks, modified);
+            changed |= modified;
+            if (!fused && !modified) {
+                ++i;
+                continue;
+            }
+
+            // Un tentativo fallito dopo aver gia' modificato l'IR puo' aver eliminato loop del secondo candidato:
+            // il secondo candidato viene scartato come se fosse stato fuso
+            if (fused) {
+                fusedLoops.insert(set[i].loop);
+            }
+            DTU.flush();
+            for (auto &otherSet : sets) {
+                llvm::erase_if(otherSet, [&](const fusionCandidate &candidate) {
+                    return deadHeaders.count(candidate.header);
+                });
+            }
+        }
+    }
+
+    // Scalar replacement sui loop fusi ancora vivi (un loop fuso puo' essere sparito dentro un nest fuso dopo)
+    SmallPtrSet<const Value *, 8> forwardedObjects;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (!fusedLoops.count(L)) {
+            continue;
+        }
+        for (Loop *inner : depth_first(L)) {
+            if (inner->isInnermost()) {
+                forwardStoredValues(inner, DT, AA, SE, forwardedObjects);
+            }
+        }
+    }
+    deleteWriteOnlyAllocas(forwardedObjects, SE);
+
+    // Dopo lo scalar replacement un loop fuso puo' essere diventato una copia o un'inizializzazione pura
+    if (IdiomAfterTransforms) {
+        SmallVector<Loop *, 8> idiomCandidates;
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            if (fusedLoops.count(L)) {
+                for (Loop *inner : depth_first(L)) {
+                    if (inner->isInnermost()) {
+                        idiomCandidates.push_back(inner);
+                    }
+                }
+            }
+        }
+        for (Loop *L : idiomCandidates) {
+            recognizeLoopIdioms(L, SE, DI, DT, DTU, LI);
+            DTU.flush();
+        }
+    }
+
+    // I loop fusi senza dipendenze fra iterazioni diverse vengono marcati per il vectorizer
+    if (FusionAnnotateParallel) {
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            if (!fusedLoops.count(L)) {
+                continue;
+            }
+            for (Loop *inner : depth_first(L)) {
+                if (inner->isInnermost()) {
+                    annotateParallelAccesses(inner, SE, DI);
+                }
+            }
+        }
+    }
+
+    return changed; // Restituisce se sono state apportate modifiche
+}
+//a partition of the body of a loop being distributed: the strongly connected components of the
+//dependence graph it contains run in a loop of their own
+struct distributionPartition {
+    SmallSetVector<Instruction *, 8> insts;   //memory instructions and header recurrences, in program order
+    bool vectorizable;                        //no loop-carried cycle and only affine accesses
+    bool liveOut;                             //computes a value used after the loop
+};
+
+//distribution handles the loops produced by mem2reg and loop-simplify: a header with the exit test,
+//a single body block and a latch with the increment, no calls and only simple loads and stores
+bool isDistributionCandidate(Loop *L) {
+    if (!L->isInnermost() || L->getNumBlocks() != 3 || isRotatedLoop(L) || !L->getLoopPreheader() ||
+        !L->getExitBlock() || L->getExitingBlock() != L->getHeader()) {
+        return false;
+    }
+
+    BasicBlock *header = L->getHeader();
+    BasicBlock *latch = L->getLoopLatch();
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (!I.mayReadOrWriteMemory()) {
+                continue;
+            }
+            bool simple = (isa<LoadInst>(I) && cast<LoadInst>(I).isSimple()) || (isa<StoreInst>(I) && cast<StoreInst>(I).isSimple());
+            if (!simple || BB == header || BB == latch) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//collect the nodes of the dependence graph reached through the pure computations feeding V
+void collectFeedingNodes(Value *V, Loop *L, const DenseMap<Instruction *, unsigned> &nodeIds, SmallPtrSetImpl<Instruction *> &visited, SmallVectorImpl<unsigned> &feeding) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (!I || !L->contains(I) || !visited.insert(I).second) {
+        return;
+    }
+    auto it = nodeIds.find(I);
+    if (it != nodeIds.end()) {
+        feeding.push_back(it->second);
+        return;
+    }
+    //the induction variables are recomputed by every distributed loop
+    if (isa<PHINode>(I)) {
+        return;
+    }
+    for (Value *op : I->operands()) {
+        collectFeedingNodes(op, L, nodeIds, visited, feeding);
+    }
+}
+
+//split the body of L into partitions, in an order that respects every dependence between them
+bool buildDistributionPartitions(Loop *L, ScalarEvolution &SE, DependenceInfo &DI, SmallVectorImpl<distributionPartition> &partitions) {
+    BasicBlock *header = L->getHeader();
+
+    //nodes of the graph: the memory instructions of the body and the header PHIs that are not induction variables
+    SmallVector<Instruction *, 32> nodes;
+    DenseMap<Instruction *, unsigned> nodeIds;
+    for (PHINode &phi : header->phis()) {
+        if (!getInductionRecurrence(&phi, L, SE)) {
+            nodeIds[&phi] = nodes.size();
+            nodes.push_back(&phi);
+        }
+    }
+    SmallVector<memoryAccess, 16> accesses;
+    collectMemoryAccesses(L, SE, accesses);
+    for (memoryAccess &access : accesses) {
+        nodeIds[access.inst] = nodes.size();
+        nodes.push_back(access.inst);
+    }
+    unsigned numNodes = nodes.size();
+    if (numNodes < 2 || numNodes > DistributionMaxNodes) {
+        PASS_LOG << "Loop has " << numNodes << " nodes, nothing to distribute \n";
+        return false;
+    }
+
+    //the exit test must not depend on the body, every distributed loop evaluates it
+    SmallPtrSet<Instruction *, 16> visited;
+    SmallVector<unsigned, 4> feeding;
+    collectFeedingNodes(header->getTerminator(), L, nodeIds, visited, feeding);
+    if (!feeding.empty()) {
+        PASS_LOG << "The exit condition depends on the body of the loop \n";
+        return false;
+    }
+
+    SmallVector<BitVector, 32> edges(numNodes, BitVector(numNodes));
+    SmallVector<std::pair<unsigned, unsigned>, 16> carried;   //dependences between different iterations
+    BitVector liveOut(numNodes);
+
+    //scalar dependences: a value is never passed between two distributed loops, so the nodes computing it
+    //and the nodes using it stay in the same partition
+    for (unsigned j = 0; j < numNodes; ++j) {
+        visited.clear();
+        feeding.clear();
+        Instruction *node = nodes[j];
+        if (auto *phi = dyn_cast<PHINode>(node)) {
+            collectFeedingNodes(phi->getIncomingValueForBlock(L->getLoopLatch()), L, nodeIds, visited, feeding);
+            carried.push_back({j, j});
+        } else {
+            for (Value *op : node->operands()) {
+                collectFeedingNodes(op, L, nodeIds, visited, feeding);
+            }
+        }
+        for (unsigned i : feeding) {
+            edges[i].set(j);
+            edges[j].set(i);
+        }
+    }
+
+    //memory dependences, from the distance of the accesses when SCEV can compute it, from DependenceInfo otherwise
+    for (unsigned a = 0; a < accesses.size(); ++a) {
+        for (unsigned b = a + 1; b < accesses.size(); ++b) {
+            Instruction *src = accesses[a].inst;
+            Instruction *dst = accesses[b].inst;
+            if (!src->mayWriteToMemory() && !dst->mayWriteToMemory()) {
+                continue;
+            }
+            unsigned i = nodeIds[src];
+            unsigned j = nodeIds[dst];
+
+            int64_t distance = 0;
+            bool disjoint = false;
+            if (getIterationDistance(accesses[a], accesses[b], SE, distance, disjoint)) {
+                if (disjoint) {
+                    continue;
+                }
+                //a negative distance means dst reaches the location first, in an earlier iteration
+                if (distance >= 0) {
+                    edges[i].set(j);
+                } else {
+                    edges[j].set(i);
+                }
+                if (distance != 0) {
+                    carried.push_back({i, j});
+                }
+                continue;
+            }
+
+            std::unique_ptr<Dependence> dep = DI.depends(src, dst, true);
+            if (!dep) {
+                continue;
+            }
+            unsigned direction = dep->isConfused() ? (unsigned)Dependence::DVEntry::ALL : dep->getDirection(dep->getLevels());
+            if (direction == Dependence::DVEntry::EQ || direction == Dependence::DVEntry::LT ||
+                direction == Dependence::DVEntry::LE) {
+                edges[i].set(j);
+            } else if (direction == Dependence::DVEntry::GT || direction == Dependence::DVEntry::GE) {
+                edges[j].set(i);
+            } else {
+                edges[i].set(j);
+                edges[j].set(i);
+            }
+            if (direction != Dependence::DVEntry::EQ) {
+                carried.push_back({i, j});
+            }
+        }
+    }
+
+    //the values used after the loop must be computed by the last distributed loop
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            for (User *U : I.users()) {
+                if (!L->contains(cast<Instruction>(U))) {
+                    visited.clear();
+                    feeding.clear();
+                    collectFeedingNodes(&I, L, nodeIds, visited, feeding);
+                    for (unsigned i : feeding) {
+                        liveOut.set(i);
+                    }
+                }
+            }
+        }
+    }
+
+    //transitive closure of the graph: two nodes are in the same component when they reach each other
+    SmallVector<BitVector, 32> reach(edges);
+    for (unsigned k = 0; k < numNodes; ++k) {
+        for (unsigned i = 0; i < numNodes; ++i) {
+            if (reach[i].test(k)) {
+                reach[i] |= reach[k];
+            }
+        }
+    }
+
+    SmallVector<int, 32> component(numNodes, -1);
+    SmallVector<SmallVector<unsigned, 4>, 16> components;
+    for (unsigned i = 0; i < numNodes; ++i) {
+        if (component[i] != -1) {
+            continue;
+        }
+        component[i] = components.size();
+        components.push_back({i});
+        for (unsigned j = i + 1; j < numNodes; ++j) {
+            if (reach[i].test(j) && reach[j].test(i)) {
+                component[j] = component[i];
+                components.back().push_back(j);
+            }
+        }
+    }
+
+    //a component can be vectorized when no dependence inside it crosses iterations and its accesses are affine
+    SmallVector<distributionPartition, 16> componentPartitions;
+    for (auto &nodesOfComponent : components) {
+        distributionPartition partition;
+        partition.vectorizable = true;
+        partition.liveOut = false;
+        for (unsigned i : nodesOfComponent) {
+            partition.insts.insert(nodes[i]);
+            partition.liveOut |= liveOut.test(i);
+            const memoryAccess *access = llvm::find_if(accesses, [&](const memoryAccess &acc) { return acc.inst == nodes[i]; });
+            if (access == accesses.end() || !access->rec || access->rec->getStepRecurrence(SE)->isZero()) {
+                partition.vectorizable = false;
+            }
+        }
+        componentPartitions.push_back(std::move(partition));
+    }
+    for (auto &dep : carried) {
+        if (component[dep.first] == component[dep.second]) {
+            componentPartitions[component[dep.first]].vectorizable = false;
+        }
+    }
+
+    //topological order of the components; among the ready ones the first one in program order, leaving
+    //the ones computing values used after the loop for last
+    BitVector placed(components.size());
+    while (partitions.size() < components.size()) {
+        int next = -1;
+        for (unsigned c = 0; c < components.size(); ++c) {
+            if (placed.test(c)) {
+                continue;
+            }
+            bool ready = true;
+            for (unsigned d = 0; d < components.size() && ready; ++d) {
+                ready = d == c || placed.test(d) || !reach[components[d].front()].test(components[c].front());
+            }
+            if (ready && (next == -1 || (componentPartitions[next].liveOut && !componentPartitions[c].liveOut))) {
+                next = c;
+            }
+        }
+        partitions.push_back(componentPartitions[next]);
+        placed.set(next);
+    }
+    return true;
+}
+
+//loads of the second partition reading a location the first one already accesses: once the loop is
+//distributed that memory is streamed twice
+unsigned countRereads(const distributionPartition &first, const distributionPartition &second, ScalarEvolution &SE) {
+    unsigned rereads = 0;
+    for (Instruction *I : second.insts) {
+        if (!isa<LoadInst>(I)) {
+            continue;
+        }
+        const SCEV *ptr = SE.getSCEV(getLoadStorePointerOperand(I));
+        for (Instruction *J : first.insts) {
+            if (Value *otherPtr = getLoadStorePointerOperand(J)) {
+                if (SE.getSCEV(otherPtr) == ptr) {
+                    ++rereads;
+                    break;
+                }
+            }
+        }
+    }
+    return rereads;
+}
+
+void mergePartitions(SmallVectorImpl<distributionPartition> &partitions, unsigned index) {
+    distributionPartition &first = partitions[index];
+    distributionPartition &second = partitions[index + 1];
+    first.insts.insert(second.insts.begin(), second.insts.end());
+    first.vectorizable &= second.vectorizable;
+    first.liveOut |= second.liveOut;
+    partitions.erase(partitions.begin() + index + 1);
+}
+
+//cost model: splitting only pays off when it separates a vectorizable partition from a recurrence,
+//and the accesses that become vectorizable outweigh the memory the second loop has to read again.
+//Merging two partitions adjacent in the topological order never creates a cycle
+void mergeUnprofitablePartitions(SmallVectorImpl<distributionPartition> &partitions, ScalarEvolution &SE) {
+    //the values used after the loop are computed by the last loop
+    for (unsigned p = 0; p + 1 < partitions.size(); ++p) {
+        if (partitions[p].liveOut) {
+            while (p + 1 < partitions.size()) {
+                mergePartitions(partitions, p);
+            }
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (unsigned p = 0; p + 1 < partitions.size(); ++p) {
+            distributionPartition &first = partitions[p];
+            distributionPartition &second = partitions[p + 1];
+            if (first.vectorizable == second.vectorizable) {
+                mergePartitions(partitions, p);
+                changed = true;
+                break;
+            }
+
+            unsigned benefit = first.vectorizable ? first.insts.size() : second.insts.size();
+            unsigned cost = DistributionRereadCost * countRereads(first, second, SE);
+            if (benefit <= cost) {
+                PASS_LOG << "Splitting would re-read " << countRereads(first, second, SE) << " memory streams for "
+                       << benefit << " vectorizable accesses: keeping the partitions together \n";
+                mergePartitions(partitions, p);
+                changed = true;
+                break;
+            }
+        }
+    }
+}
+
+//drop from a copy of the loop the nodes of the other partitions, then the computations left without users
+void removeOtherPartitions(ArrayRef<BasicBlock *> blocks, ArrayRef<Instruction *> dropped) {
+    for (Instruction *I : dropped) {
+        I->replaceAllUsesWith(PoisonValue::get(I->getType()));
+    }
+    for (Instruction *I : dropped) {
+        I->eraseFromParent();
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (BasicBlock *BB : blocks) {
+            for (Instruction &I : make_early_inc_range(reverse(*BB))) {
+                if (isInstructionTriviallyDead(&I)) {
+                    I.eraseFromParent();
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+//every partition but the last one runs in a copy of L placed before it; L keeps the last partition,
+//so the values used after the loop are still computed by L. The resulting loops go in program order into loops
+void distributeLoop(Loop *L, ArrayRef<distributionPartition> partitions, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE, SmallVectorImpl<Loop *> &loops) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *header = L->getHeader();
+    BasicBlock *exit = L->getExitBlock();
+    Function *F = header->getParent();
+    SE.forgetLoop(L);
+
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    BasicBlock *prevPreheader = preheader;
+    for (unsigned p = 0; p + 1 < partitions.size(); ++p) {
+        ValueToValueMapTy VMap;
+        SmallVector<BasicBlock *, 4> clones;
+        for (BasicBlock *BB : L->blocks()) {
+            BasicBlock *clone = CloneBasicBlock(BB, VMap, ".ldist" + Twine(p), F);
+            clone->moveBefore(header);
+            VMap[BB] = clone;
+            clones.push_back(clone);
+        }
+        remapInstructionsInBlocks(clones, VMap);
+
+        //the copy leaves into a new block, which is the preheader of the next loop
+        auto *clonedHeader = cast<BasicBlock>(VMap[header]);
+        BasicBlock *clonedExit = BasicBlock::Create(F->getContext(), clonedHeader->getName() + ".exit", F, header);
+        BranchInst::Create(header, clonedExit);
+        clonedHeader->getTerminator()->replaceUsesOfWith(exit, clonedExit);
+        for (PHINode &phi : clonedHeader->phis()) {
+            phi.replaceIncomingBlockWith(preheader, prevPreheader);
+        }
+        prevPreheader->getTerminator()->replaceUsesOfWith(header, clonedHeader);
+
+        updates.push_back({DominatorTree::Delete, prevPreheader, header});
+        updates.push_back({DominatorTree::Insert, prevPreheader, clonedHeader});
+        for (BasicBlock *clone : clones) {
+            for (BasicBlock *succ : successors(clone)) {
+                updates.push_back({DominatorTree::Insert, clone, succ});
+            }
+        }
+        updates.push_back({DominatorTree::Insert, clonedExit, header});
+
+        SmallVector<Instruction *, 16> dropped;
+        for (unsigned q = 0; q < partitions.size(); ++q) {
+            if (q != p) {
+                for (Instruction *I : partitions[q].insts) {
+                    dropped.push_back(cast<Instruction>(VMap[I]));
+                }
+            }
+        }
+        removeOtherPartitions(clones, dropped);
+
+        Loop *parent = L->getParentLoop();
+        loops.push_back(cloneLoopTree(L, parent, VMap, LI));
+        if (parent) {
+            parent->addBasicBlockToLoop(clonedExit, LI);
+        }
+        PASS_LOG << "Partition " << p << " (" << partitions[p].insts.size() << " nodes"
+               << (partitions[p].vectorizable ? ", vectorizable" : "") << ") moved to " << clonedHeader->getName() << "\n";
+        prevPreheader = clonedExit;
+    }
+
+    for (PHINode &phi : header->phis()) {
+        phi.replaceIncomingBlockWith(preheader, prevPreheader);
+    }
+    SmallVector<Instruction *, 16> dropped;
+    for (unsigned q = 0; q + 1 < partitions.size(); ++q) {
+        dropped.append(partitions[q].insts.begin(), partitions[q].insts.end());
+    }
+    SmallVector<BasicBlock *, 4> blocks(L->blocks());
+    removeOtherPartitions(blocks, dropped);
+    DTU.applyUpdates(updates);
+    loops.push_back(L);
+}
+
+bool runDistributionOnFunction(Function &F, FunctionAnalysisManager &AM) {
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Lazy);
+
+    // I loop vengono raccolti prima di trasformarli: le copie create non vanno ridistribuite
+    SmallVector<Loop *, 8> candidates;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (isDistributionCandidate(L)) {
+            candidates.push_back(L);
+        }
+    }
+    PASS_LOG << "Found " << candidates.size() << " loops to analyze for distribution \n";
+
+    bool changed = false;
+    for (Loop *L : candidates) {
+        PASS_LOG << "Analyzing loop " << L->getHeader()->getName() << "\n";
+        SmallVector<distributionPartition, 8> partitions;
+        if (!buildDistributionPartitions(L, SE, DI, partitions)) {
+            continue;
+        }
+        PASS_LOG << "Dependence graph has " << partitions.size() << " strongly connected components \n";
+
+        mergeUnprofitablePartitions(partitions, SE);
+        if (partitions.size() < 2) {
+            PASS_LOG << "Distribution is not profitable \n";
+            continue;
+        }
+
+        SmallVector<Loop *, 4> distributed;
+        distributeLoop(L, partitions, DTU, LI, SE, distributed);
+        // SCEV e DependenceInfo interrogano il dominator tree per i loop successivi
+        DTU.flush();
+        PASS_LOG << "Loop distributed into " << partitions.size() << " loops \n";
+        changed = true;
+
+        // Una partizione puo' essere una copia o un'inizializzazione pura
+        if (IdiomAfterTransforms) {
+            for (Loop *newLoop : distributed) {
+                recognizeLoopIdioms(newLoop, SE, DI, DT, DTU, LI);
+                DTU.flush();
+            }
+        }
+    }
+    return changed;
+}
+
+//tiling moves the tile loops outside the nest, running its iterations in a different order: it is legal
+//when the nest is fully permutable, with no dependence going backwards along any of its levels
+bool isTilingLegal(ArrayRef<nestLevel> tiling, ScalarEvolution &SE, DependenceInfo &DI) {
+    Loop *outer = tiling.front().loop;
+    SmallVector<Instruction *, 16> memInsts;
+    collectMemoryInstructions(outer, memInsts);
+
+    for (unsigned a = 0; a < memInsts.size(); ++a) {
+        for (unsigned b = a; b < memInsts.size(); ++b) {
+            Instruction *src = memInsts[a];
+            Instruction *dst = memInsts[b];
+            if (!isa<LoadInst>(src) && !isa<StoreInst>(src)) {
+                return false;
+            }
+            if (!src->mayWriteToMemory() && !dst->mayWriteToMemory()) {
+                continue;
+            }
+            std::unique_ptr<Dependence> dep = DI.depends(src, dst, true);
+            if (!dep) {
+                continue;
+            }
+
+            //all the directions of the nest levels must agree: every one '<' or '=', or every one '>' or '='
+            bool forward = !dep->isConfused();
+            bool backward = !dep->isConfused();
+            for (unsigned level = outer->getLoopDepth(); (forward || backward) && level <= dep->getLevels(); ++level) {
+                unsigned direction = dep->getDirection(level);
+                forward &= !(direction & Dependence::DVEntry::GT);
+                backward &= !(direction & Dependence::DVEntry::LT);
+            }
+            if (forward || backward) {
+                continue;
+            }
+
+            //a dependence free along a single level has a single non-zero distance, which can't be reversed
+            BitVector freeLevels;
+            if (!getFreeNestLevels(src, dst, tiling, SE, freeLevels) || freeLevels.count() > 1) {
+                PASS_LOG << *src << " and " << *dst << " may depend along opposite directions of the nest \n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//tiling pays off when the nest reuses data along a level that is not the innermost one (an access
+//invariant in it) or walks an array with a non-unit stride, and the data doesn't already fit in the cache
+bool isTilingProfitable(ArrayRef<nestLevel> tiling, ScalarEvolution &SE, const DataLayout &DL, unsigned &tileSize) {
+    Loop *outer = tiling.front().loop;
+    bool reuse = false;
+    bool strided = false;
+    SmallPtrSet<const Value *, 8> objects;
+    uint64_t elementSize = 0;
+    for (BasicBlock *BB : outer->blocks()) {
+        for (Instruction &I : *BB) {
+            if (!isa<LoadInst>(I) && !isa<StoreInst>(I)) {
+                continue;
+            }
+            nestAccess access;
+            if (!getNestAccess(&I, tiling, SE, access)) {
+                continue;
+            }
+            uint64_t size = DL.getTypeStoreSize(getLoadStoreType(&I));
+            elementSize = std::max(elementSize, size);
+            objects.insert(getUnderlyingObject(getLoadStorePointerOperand(&I)));
+
+            for (unsigned k = 0; k + 1 < access.strides.size(); ++k) {
+                reuse |= access.strides[k]->isZero();
+            }
+            auto *innerStride = dyn_cast<SCEVConstant>(access.strides.back());
+            strided |= !innerStride || innerStride->getAPInt().abs().getZExtValue() * access.scale > size;
+        }
+    }
+    if (objects.empty() || (!reuse && !strided)) {
+        PASS_LOG << "The nest has no reuse across its levels nor strided accesses \n";
+        return false;
+    }
+
+    //a nest whose whole footprint fits in the cache gains nothing from tiling
+    uint64_t iterations = 1;
+    for (const nestLevel &level : tiling) {
+        unsigned tripCount = SE.getSmallConstantTripCount(level.loop);
+        iterations = tripCount && iterations <= TilingCacheSize ? iterations * tripCount : UINT64_MAX / 2;
+    }
+    if (iterations <= TilingCacheSize && iterations * elementSize * objects.size() <= TilingCacheSize) {
+        PASS_LOG << "The footprint of the nest already fits in the cache \n";
+        return false;
+    }
+
+    //the largest power of two whose tiles of every array, over two levels, fill at most half of the cache
+    tileSize = TilingTileSize;
+    if (!tileSize) {
+        tileSize = 8;
+        while (tileSize < 256 && 2 * (2 * tileSize) * (2 * tileSize) * elementSize * objects.size() <= TilingCacheSize) {
+            tileSize *= 2;
+        }
+    }
+    return true;
+}
+
+//strip-mine every level of the nest and move the tile loops outside it: each level now runs from the
+//start of its tile to the smallest between the end of the tile and its original bound
+void tileLoopNest(ArrayRef<nestLevel> tiling, unsigned tileSize, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE) {
+    Loop *outer = tiling.front().loop;
+    BasicBlock *preheader = outer->getLoopPreheader();
+    BasicBlock *header = outer->getHeader();
+    BasicBlock *exit = outer->getExitBlock();
+    Function *F = header->getParent();
+    LLVMContext &ctx = F->getContext();
+    unsigned depth = tiling.size();
+    SE.forgetLoop(outer);
+
+    SmallVector<BasicBlock *, 3> tileHeaders;
+    SmallVector<BasicBlock *, 3> tileLatches;
+    for (const nestLevel &level : tiling) {
+        tileHeaders.push_back(BasicBlock::Create(ctx, level.loop->getHeader()->getName() + ".tile", F, header));
+        tileLatches.push_back(BasicBlock::Create(ctx, level.loop->getHeader()->getName() + ".tile.latch", F, header));
+    }
+    BasicBlock *nestPreheader = BasicBlock::Create(ctx, header->getName() + ".tile.ph", F, header);
+
+    SmallVector<Value *, 3> tileStarts;
+    SmallVector<Value *, 3> tileEnds;
+    IRBuilder<> builder(nestPreheader);
+    for (unsigned k = 0; k < depth; ++k) {
+        const nestLevel &level = tiling[k];
+        bool isSigned = level.exitCmp->isSigned();
+        Intrinsic::ID addSat = isSigned ? Intrinsic::sadd_sat : Intrinsic::uadd_sat;
+        Type *type = level.iv->getType();
+        Value *tileStep = ConstantInt::get(type, level.step * tileSize);
+
+        //tile loop: t = start; t < bound; t += tileSize * step (saturating, so it never wraps)
+        IRBuilder<> headerBuilder(tileHeaders[k]);
+        PHINode *tileIV = headerBuilder.CreatePHI(type, 2, level.iv->getName() + ".tile");
+        tileIV->addIncoming(level.start, k == 0 ? preheader : tileHeaders[k - 1]);
+        Value *cond = headerBuilder.CreateICmp(level.exitCmp->getPredicate(), tileIV, level.bound, level.exitCmp->getName() + ".tile");
+        headerBuilder.CreateCondBr(cond, k + 1 < depth ? tileHeaders[k + 1] : nestPreheader, k == 0 ? exit : tileLatches[k - 1]);
+
+        IRBuilder<> latchBuilder(tileLatches[k]);
+        Value *next = latchBuilder.CreateBinaryIntrinsic(addSat, tileIV, tileStep, nullptr, tileIV->getName() + ".next");
+        latchBuilder.CreateBr(tileHeaders[k]);
+        tileIV->addIncoming(next, tileLatches[k]);
+
+        Value *tileEnd = builder.CreateBinaryIntrinsic(addSat, tileIV, tileStep, nullptr, tileIV->getName() + ".end");
+        Value *isShorter = builder.CreateICmp(level.exitCmp->getPredicate(), tileEnd, level.bound);
+        tileStarts.push_back(tileIV);
+        tileEnds.push_back(builder.CreateSelect(isShorter, tileEnd, level.bound, level.iv->getName() + ".bound"));
+    }
+    builder.CreateBr(header);
+
+    //the nest is entered from the innermost tile loop and goes back to its latch
+    preheader->getTerminator()->replaceUsesOfWith(header, tileHeaders[0]);
+    for (PHINode &phi : header->phis()) {
+        phi.replaceIncomingBlockWith(preheader, nestPreheader);
+    }
+    header->getTerminator()->replaceUsesOfWith(exit, tileLatches[depth - 1]);
+    for (unsigned k = 0; k < depth; ++k) {
+        const nestLevel &level = tiling[k];
+        level.iv->setIncomingValueForBlock(level.loop->getLoopPreheader(), tileStarts[k]);
+        level.exitCmp->setOperand(1, tileEnds[k]);
+    }
+
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    updates.push_back({DominatorTree::Delete, preheader, header});
+    updates.push_back({DominatorTree::Insert, preheader, tileHeaders[0]});
+    updates.push_back({DominatorTree::Delete, header, exit});
+    updates.push_back({DominatorTree::Insert, header, tileLatches[depth - 1]});
+    updates.push_back({DominatorTree::Insert, nestPreheader, header});
+    for (unsigned k = 0; k < depth; ++k) {
+        for (BasicBlock *BB : {tileHeaders[k], tileLatches[k]}) {
+            for (BasicBlock *succ : successors(BB)) {
+                updates.push_back({DominatorTree::Insert, BB, succ});
+            }
+        }
+    }
+    DTU.applyUpdates(updates);
+
+    //the tile loops wrap the nest in the loop forest
+    Loop *parent = outer->getParentLoop();
+    if (parent) {
+        parent->removeChildLoop(outer);
+    } else {
+        LI.removeLoop(llvm::find(LI, outer));
+    }
+    Loop *enclosing = parent;
+    SmallVector<Loop *, 3> tileLoops;
+    for (unsigned k = 0; k < depth; ++k) {
+        Loop *tileLoop = LI.AllocateLoop();
+        if (enclosing) {
+            enclosing->addChildLoop(tileLoop);
+        } else {
+            LI.addTopLevelLoop(tileLoop);
+        }
+        tileLoop->addBasicBlockToLoop(tileHeaders[k], LI);
+        tileLoops.push_back(tileLoop);
+        enclosing = tileLoop;
+    }
+    for (unsigned k = 0; k < depth; ++k) {
+        tileLoops[k]->addBasicBlockToLoop(tileLatches[k], LI);
+    }
+    tileLoops.back()->addBasicBlockToLoop(nestPreheader, LI);
+    for (BasicBlock *BB : outer->blocks()) {
+        for (Loop *tileLoop : tileLoops) {
+            tileLoop->addBlockEntry(BB);
+        }
+    }
+    tileLoops.back()->addChildLoop(outer);
+
+    PASS_LOG << "Tiled a " << depth << "-level nest with tiles of " << tileSize << " iterations \n";
+}
+
+bool runTilingOnFunction(Function &F, FunctionAnalysisManager &AM) {
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Lazy);
+    const DataLayout &DL = F.getParent()->getDataLayout();
+
+    // I nest vengono scelti prima di trasformarli, dal piu' esterno: i loop di tile creati non vengono riconsiderati
+    SmallVector<SmallVector<nestLevel, 3>, 4> nests;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (llvm::any_of(nests, [&](ArrayRef<nestLevel> nest) { return nest.front().loop->contains(L); })) {
+            continue;
+        }
+        SmallVector<nestLevel, 3> tiling;
+        if (getRectangularNestLevels(L, SE, tiling)) {
+            nests.push_back(std::move(tiling));
+        }
+    }
+
+    bool changed = false;
+    for (auto &tiling : nests) {
+        PASS_LOG << "Analyzing the " << tiling.size() << "-level nest " << tiling.front().loop->getHeader()->getName() << "\n";
+
+        unsigned tileSize = 0;
+        if (!isTilingLegal(tiling, SE, DI)) {
+            PASS_LOG << "Tiling is not legal \n";
+            continue;
+        }
+        if (!isTilingProfitable(tiling, SE, DL, tileSize)) {
+            PASS_LOG << "Tiling is not profitable \n";
+            continue;
+        }
+
+        tileLoopNest(tiling, tileSize, DTU, LI, SE);
+        // SCEV interroga il dominator tree per i nest successivi
+        DTU.flush();
+        changed = true;
+    }
+    return changed;
+}
+
+//sign of the first non-zero distance of a dependence, once its levels are reordered
+int getLexicographicSign(ArrayRef<int> distances, ArrayRef<unsigned> order) {
+    for (unsigned k : order) {
+        if (distances[k]) {
+            return distances[k];
+        }
+    }
+    return 0;
+}
+
+//the interchange runs the level order[k] of the nest at position k. DependenceInfo gives, level by level,
+//the possible signs of the distance of a dependence: the interchange is legal if no combination of them
+//changes its lexicographic sign, so that no access moves before the one it depends on
+bool isInterchangeLegal(ArrayRef<nestLevel> nest, ArrayRef<unsigned> order, ScalarEvolution &SE, DependenceInfo &DI) {
+    Loop *outer = nest.front().loop;
+    unsigned depth = nest.size();
+    SmallVector<Instruction *, 16> memInsts;
+    collectMemoryInstructions(outer, memInsts);
+
+    SmallVector<unsigned, 3> identity;
+    for (unsigned k = 0; k < depth; ++k) {
+        identity.push_back(k);
+    }
+
+    for (unsigned a = 0; a < memInsts.size(); ++a) {
+        for (unsigned b = a; b < memInsts.size(); ++b) {
+            Instruction *src = memInsts[a];
+            Instruction *dst = memInsts[b];
+            if (!isa<LoadInst>(src) && !isa<StoreInst>(src)) {
+                return false;
+            }
+            if (!src->mayWriteToMemory() && !dst->mayWriteToMemory()) {
+                continue;
+            }
+            std::unique_ptr<Dependence> dep = DI.depends(src, dst, true);
+            if (!dep) {
+                continue;
+            }
+
+            SmallVector<unsigned, 3> directions(depth, Dependence::DVEntry::ALL);
+            for (unsigned k = 0; k < depth && !dep->isConfused(); ++k) {
+                directions[k] = dep->getDirection(outer->getLoopDepth() + k);
+            }
+            //for a[i * n + j] DependenceInfo gives up: the accesses still meet only where i and j are the same
+            BitVector freeLevels;
+            if (getFreeNestLevels(src, dst, nest, SE, freeLevels)) {
+                for (unsigned k = 0; k < depth; ++k) {
+                    if (!freeLevels.test(k)) {
+                        directions[k] &= Dependence::DVEntry::EQ;
+                    }
+                }
+            }
+
+            //every combination of the signs: 3^depth distance vectors at most
+            unsigned combinations = depth == 2 ? 9 : 27;
+            for (unsigned c = 0; c < combinations; ++c) {
+                SmallVector<int, 3> distances;
+                bool possible = true;
+                for (unsigned k = 0, code = c; k < depth; ++k, code /= 3) {
+                    static const unsigned signDirections[] = {Dependence::DVEntry::GT, Dependence::DVEntry::EQ, Dependence::DVEntry::LT};
+                    possible &= (directions[k] & signDirections[code % 3]) != 0;
+                    distances.push_back((int)(code % 3) - 1);
+                }
+                if (possible && getLexicographicSign(distances, identity) != getLexicographicSign(distances, order)) {
+                    PASS_LOG << *src << " and " << *dst << " would depend in the opposite direction \n";
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//for every candidate order count, from the innermost level outwards, the accesses that jump between
+//distant elements at that level: the best order has the fewest jumps in its innermost loops. Ties go to
+//the order with the shortest jumps, the bytes of the strides (a symbolic stride counts as a long jump).
+//Orders are sorted by this cost, the original one first among the equal ones
+void getInterchangeOrders(ArrayRef<nestLevel> nest, ScalarEvolution &SE, const DataLayout &DL, SmallVectorImpl<SmallVector<unsigned, 3>> &orders) {
+    Loop *outer = nest.front().loop;
+    unsigned depth = nest.size();
+    SmallVector<unsigned, 3> jumps(depth, 0);
+    SmallVector<uint64_t, 3> jumpBytes(depth, 0);
+    for (BasicBlock *BB : outer->blocks()) {
+        for (Instruction &I : *BB) {
+            nestAccess access;
+            if ((!isa<LoadInst>(I) && !isa<StoreInst>(I)) || !getNestAccess(&I, nest, SE, access)) {
+                continue;
+            }
+            uint64_t size = DL.getTypeStoreSize(getLoadStoreType(&I));
+            for (unsigned k = 0; k < depth; ++k) {
+                auto *stride = dyn_cast<SCEVConstant>(access.strides[k]);
+                uint64_t bytes = stride ? stride->getAPInt().abs().getLimitedValue(UINT32_MAX) * access.scale : UINT32_MAX;
+                if (bytes > size) {
+                    ++jumps[k];
+                    jumpBytes[k] += bytes;
+                }
+            }
+        }
+    }
+
+    SmallVector<unsigned, 3> order;
+    for (unsigned k = 0; k < depth; ++k) {
+        order.push_back(k);
+    }
+    SmallVector<std::pair<SmallVector<uint64_t, 6>, SmallVector<unsigned, 3>>, 6> costs;
+    do {
+        SmallVector<uint64_t, 6> cost;
+        for (int k = depth - 1; k >= 0; --k) {
+            cost.push_back(jumps[order[k]]);
+        }
+        for (int k = depth - 1; k >= 0; --k) {
+            cost.push_back(jumpBytes[order[k]]);
+        }
+        costs.push_back({cost, order});
+    } while (std::next_permutation(order.begin(), order.end()));
+
+    std::stable_sort(costs.begin(), costs.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (auto &cost : costs) {
+        orders.push_back(cost.second);
+    }
+}
+
+//run the level order[k] at position k. The nest is rectangular: moving the induction variables, with their
+//exit compares and increments, between the headers and the latches is enough, the blocks stay where they are
+void interchangeLoops(ArrayRef<nestLevel> nest, ArrayRef<unsigned> order, ScalarEvolution &SE) {
+    SE.forgetLoop(nest.front().loop);
+
+    SmallVector<Instruction *, 3> increments;
+    for (const nestLevel &level : nest) {
+        increments.push_back(cast<Instruction>(level.iv->getIncomingValueForBlock(level.loop->getLoopLatch())));
+    }
+
+    for (unsigned k = 0; k < nest.size(); ++k) {
+        if (order[k] == k) {
+            continue;
+        }
+        const nestLevel &moved = nest[order[k]];
+        Loop *from = moved.loop;
+        Loop *to = nest[k].loop;
+        BasicBlock *header = to->getHeader();
+
+        moved.iv->moveBefore(&header->front());
+        moved.exitCmp->moveBefore(header->getTerminator());
+        cast<BranchInst>(header->getTerminator())->setCondition(moved.exitCmp);
+        increments[order[k]]->moveBefore(to->getLoopLatch()->getTerminator());
+        moved.iv->replaceIncomingBlockWith(from->getLoopPreheader(), to->getLoopPreheader());
+        moved.iv->replaceIncomingBlockWith(from->getLoopLatch(), to->getLoopLatch());
+    }
+
+    PASS_LOG << "Interchanged the nest " << nest.front().loop->getHeader()->getName() << ", new order of the induction variables:";
+    for (unsigned k : order) {
+        PASS_LOG << " " << nest[k].iv->getName();
+    }
+    PASS_LOG << "\n";
+}
+
+bool runInterchangeOnFunction(Function &F, FunctionAnalysisManager &AM) {
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    const DataLayout &DL = F.getParent()->getDataLayout();
+
+    // I nest vengono scelti prima di trasformarli, dal piu' esterno
+    SmallVector<SmallVector<nestLevel, 3>, 4> nests;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (llvm::any_of(nests, [&](ArrayRef<nestLevel> nest) { return nest.front().loop->contains(L); })) {
+            continue;
+        }
+        SmallVector<nestLevel, 3> nest;
+        if (getRectangularNestLevels(L, SE, nest)) {
+            nests.push_back(std::move(nest));
+        }
+    }
+
+    bool changed = false;
+    for (auto &nest : nests) {
+        PASS_LOG << "Analyzing the " << nest.size() << "-level nest " << nest.front().loop->getHeader()->getName() << "\n";
+
+        // Gli ordini vengono provati dal piu' conveniente: ci si ferma al primo legale
+        SmallVector<SmallVector<unsigned, 3>, 6> orders;
+        getInterchangeOrders(nest, SE, DL, orders);
+        for (ArrayRef<unsigned> order : orders) {
+            if (llvm::is_sorted(order)) {
+                PASS_LOG << "The original order is already the best legal one \n";
+                break;
+            }
+            if (isInterchangeLegal(nest, order, SE, DI)) {
+                interchangeLoops(nest, order, SE);
+                changed = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+//string attribute of the functions outlined by the parallelization: they already run inside a parallel region
+static const char *ParallelOutlinedAttr = "loop-parallelize-outlined";
+
+//a loop is DOALL when its iterations can run in any order, at the same time: no value flows from an
+//iteration to another, through registers or memory, and no value computed in the loop is used after it
+bool isParallelLoop(const nestLevel &level, ScalarEvolution &SE, DependenceInfo &DI) {
+    Loop *L = level.loop;
+    if (!L->getExitBlock() || !L->getExitBlock()->phis().empty()) {
+        PASS_LOG << "Loop " << L->getHeader()->getName() << " has no single exit block without phis \n";
+        return false;
+    }
+
+    SmallVector<Instruction *, 16> memInsts;
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            for (User *U : I.users()) {
+                if (!L->contains(cast<Instruction>(U))) {
+                    PASS_LOG << I << " is used after the loop \n";
+                    return false;
+                }
+            }
+            //the threads run the iterations with no order among them: calls like printf can't be split
+            bool isSimpleAccess = true;
+            if (auto *load = dyn_cast<LoadInst>(&I)) {
+                isSimpleAccess = load->isSimple();
+            } else if (auto *store = dyn_cast<StoreInst>(&I)) {
+                isSimpleAccess = store->isSimple();
+            }
+            if (!isSimpleAccess || I.mayThrow() || (I.mayHaveSideEffects() && !isa<StoreInst>(I)) || isa<AllocaInst>(I)) {
+                PASS_LOG << "Cannot run " << I << " in parallel \n";
+                return false;
+            }
+            if (I.mayReadOrWriteMemory()) {
+                memInsts.push_back(&I);
+            }
+        }
+    }
+
+    return areIterationsIndependent(L, memInsts, SE, DI);
+}
+
+//ident_t of the OpenMP runtime, the source location passed to the __kmpc calls. The flags are KMP_IDENT_KMPC (2),
+//with KMP_IDENT_WORK_LOOP (0x200) for the calls of a worksharing loop
+Constant *getOpenMPIdent(Module &M, unsigned flags) {
+    std::string name = ("__kmpc_loc." + Twine(flags)).str();
+    if (GlobalVariable *ident = M.getNamedGlobal(name)) {
+        return ident;
+    }
+
+    LLVMContext &Ctx = M.getContext();
+    Type *int32Ty = Type::getInt32Ty(Ctx);
+    Type *int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+    StructType *identTy = StructType::getTypeByName(Ctx, "struct.ident_t");
+    if (!identTy) {
+        identTy = StructType::create(Ctx, {int32Ty, int32Ty, int32Ty, int32Ty, int8PtrTy}, "struct.ident_t");
+    }
+
+    //psource: ";file;function;line;column;;", unknown for the loops outlined here
+    StringRef source = ";unknown;unknown;0;0;;";
+    GlobalVariable *sourceGV = M.getNamedGlobal("__kmpc_loc.source");
+    if (!sourceGV) {
+        Constant *sourceInit = ConstantDataArray::getString(Ctx, source);
+        sourceGV = new GlobalVariable(M, sourceInit->getType(), true, GlobalValue::PrivateLinkage, sourceInit, "__kmpc_loc.source");
+        sourceGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    }
+
+    Constant *fields[] = {ConstantInt::get(int32Ty, 0), ConstantInt::get(int32Ty, flags), ConstantInt::get(int32Ty, 0),
+                          ConstantInt::get(int32Ty, source.size()), ConstantExpr::getPointerCast(sourceGV, int8PtrTy)};
+    auto *ident = new GlobalVariable(M, identTy, true, GlobalValue::PrivateLinkage, ConstantStruct::get(identTy, fields), name);
+    ident->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return ident;
+}
+
+//move the iterations of L into a new function, the microtask run by every thread of the team:
+//void F.omp_outlined(i32 *gtid, i32 *btid, captured values...). Each thread asks the runtime for its
+//chunks of the normalized iterations [0, tripCount - 1] and runs a copy of the body on them:
+//
+//  entry:           __kmpc_for_static_init(lb = 0, ub = tripCount - 1, stride)
+//  omp.dispatch:    ub = min(ub, tripCount - 1); if lb > ub goto omp.exit
+//  header.omp:      k = phi [lb, omp.dispatch], [k + 1, latch.omp]; iv = start + k * step; if k > ub goto omp.dispatch.inc
+//  ... body ...
+//  omp.dispatch.inc: lb += stride; ub += stride; goto omp.dispatch
+//  omp.exit:        __kmpc_for_static_fini
+//
+//With a chunk size the runtime hands out chunks round robin (kmp_sch_static_chunked), otherwise a single
+//contiguous block per thread (kmp_sch_static) and the dispatch loop runs once.
+//Captured pointers are passed as they are, any other value through a stack slot
+Function *outlineParallelLoop(const nestLevel &level, Value *tripCount, ArrayRef<Value *> captured) {
+    Loop *L = level.loop;
+    Function &F = *L->getHeader()->getParent();
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    Type *voidTy = Type::getVoidTy(Ctx);
+    Type *int32Ty = Type::getInt32Ty(Ctx);
+    Type *int32PtrTy = PointerType::getUnqual(int32Ty);
+    Type *ivTy = level.iv->getType();
+    bool isSigned = level.exitCmp->isSigned();
+
+    SmallVector<Type *, 8> params = {int32PtrTy, int32PtrTy};
+    for (Value *V : captured) {
+        params.push_back(V->getType()->isPointerTy() ? V->getType() : PointerType::getUnqual(V->getType()));
+    }
+    Function *outlined = Function::Create(FunctionType::get(voidTy, params, false), GlobalValue::InternalLinkage,
+                                          F.getName() + ".omp_outlined", M);
+    //same target of F: the other attributes (noreturn, memory, norecurse...) describe F, not the loop body
+    for (StringRef kind : {"target-cpu", "target-features", "tune-cpu"}) {
+        if (F.hasFnAttribute(kind)) {
+            outlined->addFnAttr(F.getFnAttribute(kind));
+        }
+    }
+    outlined->addFnAttr(ParallelOutlinedAttr);
+    outlined->addParamAttr(0, Attribute::NoAlias);
+    outlined->addParamAttr(1, Attribute::NoAlias);
+
+    BasicBlock *entry = BasicBlock::Create(Ctx, "entry", outlined);
+    BasicBlock *dispatch = BasicBlock::Create(Ctx, "omp.dispatch", outlined);
+    BasicBlock *dispatchInc = BasicBlock::Create(Ctx, "omp.dispatch.inc", outlined);
+    BasicBlock *exit = BasicBlock::Create(Ctx, "omp.exit", outlined);
+
+    //the captured values, loaded from their slot when they are not pointers
+    ValueToValueMapTy VMap;
+    IRBuilder<> builder(entry);
+    for (unsigned k = 0; k < captured.size(); ++k) {
+        Value *arg = outlined->getArg(k + 2);
+        arg->setName(captured[k]->getName());
+        //a restrict pointer of F stays restrict: the iterations of the threads touch different elements
+        if (auto *A = dyn_cast<Argument>(captured[k]); A && A->hasNoAliasAttr()) {
+            outlined->addParamAttr(k + 2, Attribute::NoAlias);
+        }
+        if (!captured[k]->getType()->isPointerTy()) {
+            arg = builder.CreateLoad(captured[k]->getType(), arg, captured[k]->getName());
+        }
+        VMap[captured[k]] = arg;
+    }
+    auto mapped = [&](Value *V) {
+        Value *mappedValue = VMap.lookup(V);
+        return mappedValue ? mappedValue : V;
+    };
+
+    unsigned ivBits = ivTy->getIntegerBitWidth();
+    Type *ivPtrTy = PointerType::getUnqual(ivTy);
+    Constant *loopIdent = getOpenMPIdent(M, 0x202);
+    std::string suffix = (Twine(ivBits / 8) + (isSigned ? "" : "u")).str();
+    FunctionCallee staticInit = M.getOrInsertFunction("__kmpc_for_static_init_" + suffix, voidTy, loopIdent->getType(), int32Ty,
+                                                      int32Ty, int32PtrTy, ivPtrTy, ivPtrTy, ivPtrTy, ivTy, ivTy);
+    FunctionCallee staticFini = M.getOrInsertFunction("__kmpc_for_static_fini", voidTy, loopIdent->getType(), int32Ty);
+
+    Value *gtid = builder.CreateLoad(int32Ty, outlined->getArg(0), "gtid");
+    Value *lastIter = builder.CreateAlloca(int32Ty, nullptr, "omp.is_last");
+    Value *lowerPtr = builder.CreateAlloca(ivTy, nullptr, "omp.lb");
+    Value *upperPtr = builder.CreateAlloca(ivTy, nullptr, "omp.ub");
+    Value *stridePtr = builder.CreateAlloca(ivTy, nullptr, "omp.stride");
+    Value *lastIndex = builder.CreateSub(mapped(tripCount), ConstantInt::get(ivTy, 1), "omp.last_index");
+    builder.CreateStore(ConstantInt::get(int32Ty, 0), lastIter);
+    builder.CreateStore(ConstantInt::get(ivTy, 0), lowerPtr);
+    builder.CreateStore(lastIndex, upperPtr);
+    builder.CreateStore(ConstantInt::get(ivTy, 1), stridePtr);
+    //kmp_sch_static_chunked = 33, kmp_sch_static = 34
+    unsigned schedule = ParallelChunkSize ? 33 : 34;
+    builder.CreateCall(staticInit, {loopIdent, gtid, ConstantInt::get(int32Ty, schedule), lastIter, lowerPtr, upperPtr,
+                                    stridePtr, ConstantInt::get(ivTy, 1), ConstantInt::get(ivTy, ParallelChunkSize)});
+    builder.CreateBr(dispatch);
+
+    builder.SetInsertPoint(dispatch);
+    Value *lower = builder.CreateLoad(ivTy, lowerPtr, "omp.lb.val");
+    Value *upper = builder.CreateLoad(ivTy, upperPtr, "omp.ub.val");
+    Value *beyond = builder.CreateICmp(isSigned ? ICmpInst::ICMP_SGT : ICmpInst::ICMP_UGT, upper, lastIndex);
+    upper = builder.CreateSelect(beyond, lastIndex, upper, "omp.ub.min");
+    Value *hasChunk = builder.CreateICmp(isSigned ? ICmpInst::ICMP_SLE : ICmpInst::ICMP_ULE, lower, upper);
+
+    //copy of the loop, leaving it to the next chunk
+    SmallVector<BasicBlock *, 16> clones;
+    for (BasicBlock *BB : L->blocks()) {
+        BasicBlock *clone = CloneBasicBlock(BB, VMap, ".omp", outlined);
+        VMap[BB] = clone;
+        clones.push_back(clone);
+    }
+    VMap[L->getExitBlock()] = dispatchInc;
+    remapInstructionsInBlocks(clones, VMap);
+    //the debug locations refer to the subprogram of F
+    for (BasicBlock *clone : clones) {
+        for (Instruction &I : make_early_inc_range(*clone)) {
+            if (isa<DbgInfoIntrinsic>(I)) {
+                I.eraseFromParent();
+            } else {
+                I.setDebugLoc(DebugLoc());
+            }
+        }
+    }
+    auto *header = cast<BasicBlock>(VMap[L->getHeader()]);
+    auto *latch = cast<BasicBlock>(VMap[L->getLoopLatch()]);
+    builder.CreateCondBr(hasChunk, header, exit);
+
+    //the induction variable comes from the normalized index k, the original increment dies with it
+    auto *oldIV = cast<PHINode>(VMap[level.iv]);
+    auto *oldNext = cast<BinaryOperator>(VMap[level.iv->getIncomingValueForBlock(L->getLoopLatch())]);
+    auto *oldCmp = cast<ICmpInst>(VMap[level.exitCmp]);
+    builder.SetInsertPoint(oldIV);
+    PHINode *index = builder.CreatePHI(ivTy, 2, "omp.iv");
+    builder.SetInsertPoint(oldCmp);
+    Value *iv = index;
+    if (level.step != 1) {
+        iv = builder.CreateMul(iv, ConstantInt::get(ivTy, level.step), "", false, oldNext->hasNoSignedWrap());
+    }
+    auto *start = dyn_cast<ConstantInt>(level.start);
+    if (!start || !start->isZero()) {
+        iv = builder.CreateAdd(mapped(level.start), iv, level.iv->getName(), false, oldNext->hasNoSignedWrap());
+    }
+    oldCmp->replaceAllUsesWith(builder.CreateICmp(isSigned ? ICmpInst::ICMP_SLE : ICmpInst::ICMP_ULE, index, upper));
+    oldIV->replaceAllUsesWith(iv);
+    oldIV->eraseFromParent();
+    oldNext->eraseFromParent();
+    oldCmp->eraseFromParent();
+
+    builder.SetInsertPoint(latch->getTerminator());
+    Value *nextIndex = builder.CreateAdd(index, ConstantInt::get(ivTy, 1), "omp.iv.next", true, isSigned);
+    index->addIncoming(lower, dispatch);
+    index->addIncoming(nextIndex, latch);
+
+    builder.SetInsertPoint(dispatchInc);
+    Value *stride = builder.CreateLoad(ivTy, stridePtr, "omp.stride.val");
+    builder.CreateStore(builder.CreateAdd(lower, stride), lowerPtr);
+    builder.CreateStore(builder.CreateAdd(builder.CreateLoad(ivTy, upperPtr), stride), upperPtr);
+    builder.CreateBr(dispatch);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateCall(staticFini, {loopIdent, gtid});
+    builder.CreateRetVoid();
+
+    //the clones were appended after the exit: keep the blocks in the order they run
+    dispatchInc->moveAfter(clones.back());
+    exit->moveAfter(dispatchInc);
+    return outlined;
+}
+
+//replace L with a call to __kmpc_fork_call running its outlined iterations on all the threads. When the
+//trip count is only known at runtime the original loop stays behind a check, for the short runs
+void parallelizeLoop(const nestLevel &level, const SCEV *tripCount, DomTreeUpdater &DTU, LoopInfo &LI, ScalarEvolution &SE) {
+    Loop *L = level.loop;
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *header = L->getHeader();
+    BasicBlock *exit = L->getExitBlock();
+    Function &F = *header->getParent();
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    const DataLayout &DL = M.getDataLayout();
+
+    SCEVExpander expander(SE, DL, "loop-parallelize");
+    Value *tripCountValue = expander.expandCodeFor(tripCount, level.iv->getType(), preheader->getTerminator());
+
+    //values defined before the loop and used by its copy in the outlined function
+    SetVector<Value *> captured;
+    if (!isa<Constant>(tripCountValue)) {
+        captured.insert(tripCountValue);
+    }
+    for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+            if (&I == level.exitCmp) {
+                continue;
+            }
+            for (Value *V : I.operands()) {
+                auto *def = dyn_cast<Instruction>(V);
+                if (isa<Argument>(V) || (def && !L->contains(def))) {
+                    captured.insert(V);
+                }
+            }
+        }
+    }
+    Function *outlined = outlineParallelLoop(level, tripCountValue, captured.getArrayRef());
+
+    //void __kmpc_fork_call(ident_t *loc, kmp_int32 argc, kmpc_micro microtask, ...)
+    Type *voidTy = Type::getVoidTy(Ctx);
+    Type *int32Ty = Type::getInt32Ty(Ctx);
+    Type *int32PtrTy = PointerType::getUnqual(int32Ty);
+    Type *microtaskTy = PointerType::getUnqual(FunctionType::get(voidTy, {int32PtrTy, int32PtrTy}, true));
+    Constant *ident = getOpenMPIdent(M, 0x2);
+    FunctionCallee forkCall = M.getOrInsertFunction("__kmpc_fork_call", FunctionType::get(voidTy, {ident->getType(), int32Ty, microtaskTy}, true));
+
+    BasicBlock *parallel = BasicBlock::Create(Ctx, header->getName() + ".parallel", &F, header);
+    IRBuilder<> builder(parallel);
+    SmallVector<Value *, 8> args = {ident, ConstantInt::get(int32Ty, captured.size()), builder.CreateBitCast(outlined, microtaskTy)};
+    IRBuilder<> entryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+    for (Value *V : captured) {
+        if (V->getType()->isPointerTy()) {
+            args.push_back(V);
+            continue;
+        }
+        AllocaInst *slot = entryBuilder.CreateAlloca(V->getType(), nullptr, V->getName() + ".omp.slot");
+        builder.CreateStore(V, slot);
+        args.push_back(slot);
+    }
+    builder.CreateCall(forkCall, args);
+    builder.CreateBr(exit);
+    if (Loop *parent = L->getParentLoop()) {
+        parent->addBasicBlockToLoop(parallel, LI);
+    }
+
+    Instruction *oldTerminator = preheader->getTerminator();
+    if (isa<Constant>(tripCountValue)) {
+        //the loop always runs in parallel: the sequential version is deleted
+        SE.forgetLoop(L);
+        BranchInst::Create(parallel, oldTerminator);
+        oldTerminator->eraseFromParent();
+        DTU.applyUpdates({{DominatorTree::Insert, preheader, parallel}, {DominatorTree::Insert, parallel, exit},
+                          {DominatorTree::Delete, preheader, header}});
+        LI.erase(L);
+        deleteUnreachableBlocks(F, LI, DTU);
+    } else {
+        builder.SetInsertPoint(oldTerminator);
+        unsigned minTripCount = std::max(1u, (unsigned)ParallelMinTripCount);
+        Value *enough = builder.CreateICmp(level.exitCmp->isSigned() ? ICmpInst::ICMP_SGE : ICmpInst::ICMP_UGE, tripCountValue,
+                                           ConstantInt::get(tripCountValue->getType(), minTripCount), "omp.enough_iterations");
+        BranchInst::Create(parallel, header, enough, oldTerminator);
+        oldTerminator->eraseFromParent();
+        DTU.applyUpdates({{DominatorTree::Insert, preheader, parallel}, {DominatorTree::Insert, parallel, exit}});
+    }
+    PASS_LOG << "Loop " << header->getName() << " runs in parallel in " << outlined->getName() << "\n";
+}
+
+bool runParallelizationOnFunction(Function &F, FunctionAnalysisManager &AM) {
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Lazy);
+
+    // Si parallelizza il loop piu' esterno possibile: i loop interni vengono considerati solo se il loop
+    // che li contiene non e' parallelo. I candidati vengono scelti prima di trasformarli
+    SmallVector<std::pair<nestLevel, const SCEV *>, 4> candidates;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (llvm::any_of(candidates, [&](const std::pair<nestLevel, const SCEV *> &C) { return C.first.loop->contains(L); })) {
+            continue;
+        }
+        nestLevel level;
+        if (!getNestLevel(L, L, SE, level)) {
+            continue;
+        }
+        unsigned ivBits = level.iv->getType()->getIntegerBitWidth();
+        const SCEV *tripCount = SE.getExitCount(L, L->getHeader(), ScalarEvolution::ExitCountKind::Exact);
+        if ((ivBits != 32 && ivBits != 64) || isa<SCEVCouldNotCompute>(tripCount)) {
+            continue;
+        }
+        PASS_LOG << "Analyzing loop " << L->getHeader()->getName() << ", " << *tripCount << " iterations \n";
+
+        auto *constantTripCount = dyn_cast<SCEVConstant>(tripCount);
+        if (constantTripCount && constantTripCount->getAPInt().ult(std::max(1u, (unsigned)ParallelMinTripCount))) {
+            PASS_LOG << "Too few iterations to run in parallel \n";
+            continue;
+        }
+        if (!isParallelLoop(level, SE, DI)) {
+            continue;
+        }
+        candidates.push_back({level, tripCount});
+    }
+
+    for (auto &candidate : candidates) {
+        parallelizeLoop(candidate.first, candidate.second, DTU, LI, SE);
+        DTU.flush();
+    }
+    return !candidates.empty();
+}
+
+struct LoopFusionPass : public PassInfoMixin<LoopFusionPass> {
+    //false in the default pipelines, unless -default-pipeline-versioning: no runtime checks are emitted
+    bool versioning;
+
+    LoopFusionPass(bool versioning = true) : versioning(versioning) {}
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        bool changed = runOnFunction(F, AM, versioning ? (unsigned)FusionMaxRuntimeChecks : 0);
+        
+        // Se `runOnFunction` ha modificato l'IR, dobbiamo invalidare le analisi.
+        // Dominator tree, post dominator tree e LoopInfo vengono aggiornati durante la fusione.
+        // Altrimenti, possiamo preservarle tutte.
+        if (changed) {
+            PreservedAnalyses PA;
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<PostDominatorTreeAnalysis>();
+            PA.preserve<LoopAnalysis>();
+            return PA;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+
+struct LoopDistributionPass : public PassInfoMixin<LoopDistributionPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        bool changed = runDistributionOnFunction(F, AM);
+
+        // Il dominator tree e LoopInfo vengono aggiornati durante la distribuzione
+        if (changed) {
+            PreservedAnalyses PA;
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<LoopAnalysis>();
+            return PA;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+
+struct LoopParallelAccessesPass : public PassInfoMixin<LoopParallelAccessesPass> {
+    // Nelle pipeline di default il vectorizer decide da solo se conviene vettorizzare:
+    // un vectorize.enable forzato diventerebbe un warning per ogni loop che non riesce a vettorizzare
+    bool forceVectorize;
+
+    LoopParallelAccessesPass(bool forceVectorize = true) : forceVectorize(forceVectorize) {}
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        bool changed = runParallelAccessesOnFunction(F, AM, forceVectorize);
+
+        // Cambiano solo i metadati: il CFG e le analisi dei loop restano valide
+        if (changed) {
+            PreservedAnalyses PA;
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<LoopAnalysis>();
+            PA.preserve<ScalarEvolutionAnalysis>();
+            return PA;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+
+struct LoopTilingPass : public PassInfoMixin<LoopTilingPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        bool changed = runTilingOnFunction(F, AM);
+
+        // Il dominator tree e LoopInfo vengono aggiornati durante il tiling
+        if (changed) {
+            PreservedAnalyses PA;
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<LoopAnalysis>();
+            return PA;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+
+struct LoopInterchangePass : public PassInfoMixin<LoopInterchangePass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        bool changed = runInterchangeOnFunction(F, AM);
+
+        // Vengono spostate solo istruzioni: il CFG, il dominator tree e LoopInfo restano validi
+        if (changed) {
+            PreservedAnalyses PA;
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<LoopAnalysis>();
+            return PA;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+
+struct LoopIdiomPass : public PassInfoMixin<LoopIdiomPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        bool changed = runIdiomOnFunction(F, AM);
+
+        // Il dominator tree e LoopInfo vengono aggiornati quando un loop vuoto viene eliminato
+        if (changed) {
+            PreservedAnalyses PA;
+            PA.preserve<DominatorTreeAnalysis>();
+            PA.preserve<LoopAnalysis>();
+            return PA;
+        }
+        return PreservedAnalyses::all();
+    }
+};
+
+struct LoopParallelizePass : public PassInfoMixin<LoopParallelizePass> {
+    // Pass di modulo: la parallelizzazione aggiunge al modulo le funzioni outlined
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+        // Le funzioni create durante il pass non vengono riconsiderate
+        SmallVector<Function *, 16> functions;
+        for (Function &F : M) {
+            if (!F.isDeclaration() && !F.hasFnAttribute(ParallelOutlinedAttr)) {
+                functions.push_back(&F);
+            }
+        }
+
+        bool changed = false;
+        for (Function *F : functions) {
+            if (runParallelizationOnFunction(*F, FAM)) {
+                FAM.invalidate(*F, PreservedAnalyses::none());
+                changed = true;
+            }
+        }
+        return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+};
+
+} // namespace
+
+//registration of the passes by name, for opt -passes="..."
+void registerAssignment4Pipelines(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "loop-fusion-pass") {
+                FPM.addPass(LoopFusionPass());
+                return true;
+            }
+            if (Name == "loop-distribution-pass") {
+                FPM.addPass(LoopDistributionPass());
+                return true;
+            }
+            if (Name == "loop-parallel-accesses-pass") {
+                FPM.addPass(LoopParallelAccessesPass());
+                return true;
+            }
+            if (Name == "loop-tiling-pass") {
+                FPM.addPass(LoopTilingPass());
+                return true;
+            }
+            if (Name == "loop-interchange-pass") {
+                FPM.addPass(LoopInterchangePass());
+                return true;
+            }
+            if (Name == "loop-idiom-pass") {
+                FPM.addPass(LoopIdiomPass());
+                return true;
+            }
+            return false;
+        }
+    );
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "loop-parallelize-pass") {
+                MPM.addPass(LoopParallelizePass());
+                return true;
+            }
+            return false;
+        }
+    );
+}
+
+//registration of the passes in the default pipelines (clang -O2), used by the unified plugin.
+//Nothing is added at -O0
+void registerAssignment4ExtensionPoints(PassBuilder &PB) {
+    //the nest transformations only handle top-tested loops, while the simplification pipeline rotates them:
+    //they run at its start, after the same canonicalisation done by script.sh (mem2reg, loop-simplify).
+    //The outlined functions of the parallelization then go through the whole pipeline, vectorizer included
+    PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel Level) {
+            if (Level == OptimizationLevel::O0) return;
+            if (DefaultPipelineLoopTransforms) {
+                FunctionPassManager FPM;
+                FPM.addPass(PromotePass());
+                FPM.addPass(LoopSimplifyPass());
+                FPM.addPass(DefaultPipelinePass(LoopDistributionPass(), DefaultPipelineLoopTransformsLog));
+                FPM.addPass(DefaultPipelinePass(LoopInterchangePass(), DefaultPipelineLoopTransformsLog));
+                FPM.addPass(DefaultPipelinePass(LoopFusionPass(DefaultPipelineVersioning), DefaultPipelineLoopTransformsLog));
+                FPM.addPass(DefaultPipelinePass(LoopIdiomPass(), DefaultPipelineLoopTransformsLog));
+                if (DefaultPipelineTiling) {
+                    FPM.addPass(DefaultPipelinePass(LoopTilingPass(), DefaultPipelineLoopTransformsLog));
+                }
+                FPM.addPass(DefaultPipelinePass(LoopParallelAccessesPass(false), DefaultPipelineLoopTransformsLog));
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            }
+            if (DefaultPipelineParallelize) {
+                FunctionPassManager FPM;
+                FPM.addPass(PromotePass());
+                FPM.addPass(LoopSimplifyPass());
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+                MPM.addPass(DefaultPipelinePass(LoopParallelizePass(), DefaultPipelineLoopTransformsLog));
+            }
+        }
+    );
+    //the loops annotated above keep their metadata through the pipeline, like the ones annotated by clang for
+    //#pragma clang loop vectorize(assume_safety). Right before the vectorizer the annotation is tried again on
+    //the innermost loops that did not exist at the start, es. the ones brought in by the inliner
+    PB.registerVectorizerStartEPCallback(
+        [](FunctionPassManager &FPM, OptimizationLevel Level) {
+            if (Level == OptimizationLevel::O0 || !DefaultPipelineLoopTransforms) return;
+            FPM.addPass(LoopSimplifyPass());
+            FPM.addPass(DefaultPipelinePass(LoopParallelAccessesPass(false), DefaultPipelineLoopTransformsLog));
         }
+    );
+}
+
+// Versione dei pass, fa parte anche della chiave della cache per funzione del driver
+const char *getAssignment4Version() {
+    return "v0.1";
+}
+
+#ifndef UNIFIED_PLUGIN
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return {
+        LLVM_PLUGIN_API_VERSION, "MyLoopFusionPlugin", getAssignment4Version(),
+        registerAssignment4Pipelines
     };
-}
\ No newline at end of file
+}
+#endif
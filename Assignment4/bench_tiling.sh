@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# ---------------------------------------------------------------------------
+# bench_tiling.sh – Confronta test/bench_loop_tiling.c con e senza Loop Tiling
+# Uso:   ./bench_tiling.sh [dimensione_tile]
+# Senza argomenti la dimensione dei tile viene ricavata dalla cache
+# ---------------------------------------------------------------------------
+
+set -euo pipefail            # interrompe su errore, pipe, variabili unset
+
+SRC_PATH="test/bench_loop_tiling.c"
+TILE_SIZE="${1:-0}"
+
+# 1. IR canonicalizzato, comune alle due versioni
+clang-18 -O0 -S -emit-llvm -Xclang -disable-O0-optnone \
+         "${SRC_PATH}" -o bench.ll
+opt-18 -passes="mem2reg,loop-simplify" -S bench.ll -o bench.clean.ll
+
+# 2. Versione con i tile
+opt-18 -load=./build/libMyLLVMPasses.so \
+       -load-pass-plugin=./build/libMyLLVMPasses.so \
+       -passes="loop-tiling-pass" -loop-tiling-tile-size="${TILE_SIZE}" \
+       -S bench.clean.ll -o bench.tiled.ll
+
+# 3. Stesse ottimizzazioni successive per entrambe
+clang-18 -O2 bench.clean.ll -o bench_plain
+clang-18 -O2 bench.tiled.ll -o bench_tiled
+
+# 4. Tempi e cache miss
+for BIN in bench_plain bench_tiled; do
+  echo "➜ ${BIN}"
+  if command -v perf > /dev/null; then
+    perf stat -e cache-references,cache-misses "./${BIN}"
+  else
+    "./${BIN}"
+  fi
+done
@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+# ---------------------------------------------------------------------------
+# bench_vectorize.sh – Confronta test/bench_loop_vectorize.c senza fusione,
+#                      con la fusione e con la fusione che marca i loop paralleli
+# Uso:   ./bench_vectorize.sh
+# Per ogni versione conta i controlli di alias a runtime aggiunti dal vectorizer
+# ---------------------------------------------------------------------------
+
+set -euo pipefail            # interrompe su errore, pipe, variabili unset
+
+SRC_PATH="test/bench_loop_vectorize.c"
+PLUGIN="./build/libMyLLVMPasses.so"
+
+# 1. IR canonicalizzato, comune alle tre versioni
+clang-18 -O0 -S -emit-llvm -Xclang -disable-O0-optnone \
+         "${SRC_PATH}" -o bench.ll
+opt-18 -passes="mem2reg,loop-simplify" -S bench.ll -o bench.plain.ll
+
+# 2. Loop fusi, poi loop fusi con llvm.loop.parallel_accesses
+opt-18 -load-pass-plugin="${PLUGIN}" -passes="loop-fusion-pass" \
+       -S bench.plain.ll -o bench.fused.ll
+opt-18 -load="${PLUGIN}" -load-pass-plugin="${PLUGIN}" -passes="loop-fusion-pass" \
+       -loop-fusion-annotate-parallel -S bench.plain.ll -o bench.annotated.ll
+
+# 3. Stesse ottimizzazioni successive: controlli a runtime e tempi
+for VERSION in plain fused annotated; do
+  clang-18 -O2 -S -emit-llvm "bench.${VERSION}.ll" -o "bench.${VERSION}.O2.ll"
+  clang-18 -O2 "bench.${VERSION}.O2.ll" -o "bench_${VERSION}"
+  echo "➜ ${VERSION}: $(grep -c '^vector.memcheck' "bench.${VERSION}.O2.ll" || true) blocchi vector.memcheck"
+  "./bench_${VERSION}"
+done
@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+# ---------------------------------------------------------------------------
+# parallel_test.sh – Esegue test/test_loop_parallel.c parallelizzato con libomp
+# Uso:   ./parallel_test.sh <cartella_libomp> [numero_thread]
+# La cartella e' quella che contiene libomp.so, es. openmp/build/runtime/src
+# ---------------------------------------------------------------------------
+
+set -euo pipefail            # interrompe su errore, pipe, variabili unset
+
+SRC_PATH="test/test_loop_parallel.c"
+LIBOMP_DIR="${1:?cartella di libomp.so mancante}"
+THREADS="${2:-4}"
+
+# 1. IR canonicalizzato
+clang-18 -O0 -S -emit-llvm -Xclang -disable-O0-optnone \
+         "${SRC_PATH}" -o parallel.ll
+opt-18 -passes="mem2reg,loop-simplify" -S parallel.ll -o parallel.clean.ll
+
+# 2. Loop DOALL eseguiti dai thread del runtime OpenMP
+opt-18 -load-pass-plugin=./build/libMyLLVMPasses.so \
+       -passes="loop-parallelize-pass" \
+       -S parallel.clean.ll -o parallel.omp.ll
+
+# 3. Link con la libomp compilata in locale
+clang-18 -O2 parallel.omp.ll -o parallel_test \
+         -L"${LIBOMP_DIR}" -lomp -Wl,-rpath,"${LIBOMP_DIR}"
+
+# 4. Stesso risultato con un thread e con piu' thread
+for T in 1 "${THREADS}"; do
+  echo "➜ ${T} thread"
+  OMP_NUM_THREADS="${T}" ./parallel_test
+done
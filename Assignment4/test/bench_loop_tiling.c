@@ -0,0 +1,58 @@
+// test/bench_loop_tiling.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N 1024
+#define M 4096
+
+void matmul(float *restrict a, float *restrict b, float *restrict c, int n) {
+  // b viene letta per colonne e riletta per ogni riga di a: con i tile
+  // le sue righe restano in cache fra un'iterazione di i e la successiva
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      for (int k = 0; k < n; k++)
+        c[i * n + j] += a[i * n + k] * b[k * n + j];
+}
+
+void transpose(float *restrict a, float *restrict b, int n) {
+  // b viene scritta per colonne: senza i tile ogni store tocca una linea diversa
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      b[j * n + i] = a[i * n + j];
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  float *a = malloc(sizeof(float) * M * M);
+  float *b = malloc(sizeof(float) * M * M);
+  float *c = calloc(N * N, sizeof(float));
+  for (int i = 0; i < M * M; i++) {
+    a[i] = i % 13;
+    b[i] = i % 7;
+  }
+
+  double start = now();
+  matmul(a, b, c, N);
+  printf("matmul    %dx%d: %.3f s\n", N, N, now() - start);
+
+  start = now();
+  transpose(a, b, M);
+  printf("transpose %dx%d: %.3f s\n", M, M, now() - start);
+
+  // Il checksum permette di confrontare i risultati delle due versioni
+  double sum = 0;
+  for (int i = 0; i < N * N; i++)
+    sum += c[i] + b[i];
+  printf("checksum %f\n", sum);
+
+  free(a);
+  free(b);
+  free(c);
+  return 0;
+}
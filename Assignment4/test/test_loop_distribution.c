@@ -0,0 +1,27 @@
+// test/test_loop_distribution.c
+void recurrence_test(int *restrict a, int *restrict b, int *restrict c, int n) {
+  // La prima istruzione e' vettorizzabile, la seconda e' una ricorrenza su c:
+  // il loop viene diviso in due loop, il primo scrive a, il secondo la rilegge
+  for (int i = 0; i < n; i++) {
+    a[i] = b[i] + 1;
+    c[i + 1] = c[i] * a[i];
+  }
+}
+
+int reduction_test(int *restrict a, int *restrict b, int n) {
+  // La riduzione su prod resta nell'ultimo loop, che calcola il valore usato dopo il loop
+  int prod = 1;
+  for (int i = 0; i < n; i++) {
+    a[i] = b[i] * 2;
+    prod *= b[i];
+  }
+  return prod;
+}
+
+void anti_dependence_test(int *restrict a, int *restrict b, int n) {
+  // Entrambe le parti sono vettorizzabili: dividere il loop non conviene
+  for (int i = 1; i < n; i++) {
+    b[i] = a[i + 1];
+    a[i] = i;
+  }
+}
@@ -27,4 +27,199 @@ void non_adjacent_test(int *a, int *b, int n) {
   for (int i = 0; i < n; i++) {
     b[i] = a[i];
   }
-}
\ No newline at end of file
+}
+
+void non_adjacent_independent_test(int *restrict a, int *restrict b, int *restrict c, int n) {
+  // Loop A
+  for (int i = 0; i < n; i++) {
+    a[i] = i;
+  }
+
+  // Codice indipendente dai loop: viene spostato sopra il Loop A
+  int x = n * 2;
+  c[0] = x;
+
+  // Loop B
+  for (int i = 0; i < n; i++) {
+    b[i] = a[i];
+  }
+}
+
+void peeling_test(int *restrict a, int *restrict b) {
+  // Loop 1: 100 iterazioni
+  for (int i = 0; i < 100; i++) {
+    a[i] = i * 2;
+  }
+
+  // Loop 2: 99 iterazioni, la prima iterazione del Loop 1 viene "peelata"
+  for (int i = 0; i < 99; i++) {
+    b[i] = a[i] + 5;
+  }
+}
+
+void nest_fusion_test(int a[][100], int b[][100], int n) {
+  // Nest 1
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 100; j++) {
+      a[i][j] = i + j;
+    }
+  }
+
+  // Nest 2: stessi bound a ogni livello, viene fuso livello per livello
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 100; j++) {
+      b[i][j] = a[i][j] * 2;
+    }
+  }
+}
+
+void nest_continue_test(int a[][100], int b[][100], int n) {
+  // Nest 1
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 100; j++) {
+      a[i][j] = i + j;
+    }
+  }
+
+  // Nest 2: il continue porta al latch del loop interno da due blocchi. Il loop interno non si puo'
+  // riallacciare, quindi i nest non vengono fusi (nemmeno il solo livello esterno)
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 100; j++) {
+      if (a[i][j] == 7) {
+        continue;
+      }
+      b[i][j] = a[i][j] * 2;
+    }
+  }
+}
+
+int opaque_sum(int *a, int n);
+
+void opaque_call_test(int *restrict a, int *restrict b, int n) {
+  // La chiamata nel Loop 2 puo' leggere tutta a: dopo la fusione vedrebbe solo i valori
+  // scritti fino all'iterazione corrente, quindi i loop non vengono fusi
+  for (int i = 0; i < n; i++) {
+    a[i] = i;
+  }
+
+  for (int i = 0; i < n; i++) {
+    b[i] = opaque_sum(a, n);
+  }
+}
+
+void non_canonical_iv_test(int *restrict a, int *restrict b, int *restrict c, int n) {
+  // Loop 1: parte da 1 e arriva a n compreso
+  for (int i = 1; i <= n; i++) {
+    a[i] = i;
+  }
+
+  // Loop 2: parte da 0, con una seconda variabile di induzione a passo 4. Legge il valore di a
+  // scritto nella stessa iterazione del loop 1, quindi la fusione e' anche conveniente
+  for (int i = 0, j = 0; i < n; i++, j += 4) {
+    b[i] = a[i + 1] + j;
+  }
+
+  // Loop 3: stesso numero di iterazioni, conta all'indietro e legge b nell'ordine in cui e' scritto
+  for (int i = n; i > 0; i--) {
+    c[i] = b[n - i] * 2;
+  }
+}
+
+int reduction_test(int *restrict a, int n) {
+  // Loop 1: somma degli elementi di a
+  int sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += a[i];
+  }
+
+  // Loop 2: massimo degli elementi di a, l'accumulatore viene portato nel loop fuso
+  int max = -2147483647 - 1;
+  for (int i = 0; i < n; i++) {
+    max = a[i] > max ? a[i] : max;
+  }
+
+  return sum + max;
+}
+
+void temporary_array_test(int *restrict b) {
+  // Array temporaneo: dopo la fusione il valore viene inoltrato e l'array eliminato
+  int tmp[100];
+
+  // Loop produttore
+  for (int i = 0; i < 100; i++) {
+    tmp[i] = i * 2;
+  }
+
+  // Loop consumatore
+  for (int i = 0; i < 100; i++) {
+    b[i] = tmp[i] + 5;
+  }
+}
+
+void runtime_check_test(int *a, int *b, int *c, int n) {
+  // a, b e c possono sovrapporsi: i loop vengono fusi solo dietro un controllo a runtime,
+  // altrimenti viene eseguita la copia non fusa
+  for (int i = 0; i < n; i++) {
+    a[i] = b[i] * 2;
+  }
+
+  for (int i = 0; i < n; i++) {
+    c[i] = a[i] + b[i];
+  }
+}
+
+void equivalent_guards_test(int *restrict a, int *restrict b, int n) {
+  // Dopo loop-rotate ogni loop ha una guardia: 0 < n e n > 0 sono la stessa condizione
+  // scritta in modo diverso, quindi la seconda guardia viene rimossa e i loop fusi
+  for (int i = 0; i < n; i++) {
+    a[i] = i;
+  }
+
+  for (int i = 0; n > i; i++) {
+    b[i] = a[i] * 3;
+  }
+}
+
+void implied_guard_test(int *restrict a, int *restrict b, int n) {
+  // La guardia del Loop 1 (n > 10) implica quella del Loop 2 (n > 0) ma non il contrario:
+  // dopo il Loop 1 la seconda guardia non viene controllata, mentre se il Loop 1 viene saltato
+  // la guardia decide se eseguire una copia non fusa del Loop 2
+  if (n > 10) {
+    for (int i = 0; i < n; i++) {
+      a[i] = i;
+    }
+  }
+
+  if (n > 0) {
+    for (int i = 0; i < n; i++) {
+      b[i] = a[i] * 3;
+    }
+  }
+}
+
+void guarded_loops_test(int *restrict a, int *restrict b, int n) {
+  // Loop con guardia ma non ruotati (solo mem2reg e loop-simplify): la prima guardia decide per entrambi
+  if (n > 0) {
+    for (int i = 0; i < n; i++) {
+      a[i] = i;
+    }
+  }
+
+  if (n > 0) {
+    for (int i = 0; i < n; i++) {
+      b[i] = a[i] * 3;
+    }
+  }
+}
+
+void disjoint_arrays_test(int *restrict a, int *restrict b, int n) {
+  // I due loop sono fondibili ma non condividono dati: il modello di costo non trova riuso
+  // e la fusione viene scartata (-loop-fusion-ignore-cost-model la forza)
+  for (int i = 0; i < n; i++) {
+    a[i] = i;
+  }
+
+  for (int i = 0; i < n; i++) {
+    b[i] = i * 2;
+  }
+}
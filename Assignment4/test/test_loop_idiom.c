@@ -0,0 +1,62 @@
+// test/test_loop_idiom.c
+#define N 64
+
+void zero_test(int *a, int n) {
+  // Ogni iterazione azzera un elemento: il loop diventa un memset e viene eliminato
+  for (int i = 0; i < n; i++)
+    a[i] = 0;
+}
+
+void pattern_test(int *a, int n) {
+  // -1 ha tutti i byte uguali (0xff): anche questo e' un memset
+  for (int i = 0; i < n; i++)
+    a[i] = -1;
+}
+
+void not_bytewise_test(int *a, int n) {
+  // 5 come int non si ottiene ripetendo un solo byte: il loop resta com'e'
+  for (int i = 0; i < n; i++)
+    a[i] = 5;
+}
+
+void copy_test(int *restrict a, int *restrict b, int n) {
+  // Copia fra array che non si sovrappongono: memcpy
+  for (int i = 0; i < n; i++)
+    a[i] = b[i];
+}
+
+void shift_down_test(int *a, long n) {
+  // Ogni elemento viene letto prima di essere sovrascritto: le regioni si
+  // sovrappongono ma la copia e' equivalente a un memmove
+  for (long i = 0; i < n - 1; i++)
+    a[i] = a[i + 1];
+}
+
+void shift_up_test(int *a, long n) {
+  // Ogni iterazione legge il valore scritto da quella precedente (a[0] si propaga):
+  // non e' una copia, il loop resta com'e'
+  for (long i = 0; i < n - 1; i++)
+    a[i + 1] = a[i];
+}
+
+void reverse_test(char *a, int n) {
+  // Il loop scorre l'array all'indietro: il memset parte dall'ultimo elemento scritto
+  for (int i = n - 1; i >= 0; i--)
+    a[i] = 0;
+}
+
+void mixed_test(int *restrict a, int *restrict b, int n) {
+  // Il loop fa anche altro lavoro: lo store viene sostituito da un memset
+  // ma il loop rimane per calcolare b
+  for (int i = 0; i < n; i++) {
+    a[i] = 0;
+    b[i] = b[i] * 2;
+  }
+}
+
+void matrix_row_test(int a[][N], int n) {
+  // Solo il loop interno scrive elementi consecutivi: ogni riga diventa un memset
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < N; j++)
+      a[i][j] = 0;
+}
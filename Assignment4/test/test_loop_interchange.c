@@ -0,0 +1,75 @@
+// test/test_loop_interchange.c
+#define N 64
+
+void column_major_test(float a[][N], float b[][N]) {
+  // Il loop interno scorre le colonne: dopo l'interchange i e' il loop esterno
+  // e gli accessi del loop interno diventano consecutivi
+  for (int j = 0; j < N; j++)
+    for (int i = 0; i < N; i++)
+      a[i][j] = a[i][j] + b[i][j];
+}
+
+void column_major_flat_test(float *restrict a, float *restrict b, int n) {
+  // Stesso caso con gli indici linearizzati: DependenceInfo non separa i * n + j,
+  // gli stride calcolati con SCEV mostrano che a viene letta e scritta nella stessa iterazione
+  for (int j = 0; j < n; j++)
+    for (int i = 0; i < n; i++)
+      a[i * n + j] = a[i * n + j] * 2 + b[i * n + j];
+}
+
+void matmul_test(float *restrict a, float *restrict b, float *restrict c, int n) {
+  // Nell'ordine i, j, k b viene letta per colonne: l'ordine migliore e' i, k, j
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      for (int k = 0; k < n; k++)
+        c[i * n + j] += a[i * n + k] * b[k * n + j];
+}
+
+void reverse_nest_test(float a[][N][N], float b[][N][N]) {
+  // I tre livelli sono in ordine inverso: l'interchange li riporta a i, j, k
+  for (int k = 0; k < N; k++)
+    for (int j = 0; j < N; j++)
+      for (int i = 0; i < N; i++)
+        a[i][j][k] = b[i][j][k];
+}
+
+void partially_legal_test(float a[][N][N]) {
+  // Dipendenza con distanza (+1, 0, -1) nell'ordine k, j, i: ogni ordine con k interno
+  // la inverte, viene scelto k, i, j che rende consecutivi gli accessi per quanto legale
+  for (int k = 1; k < N; k++)
+    for (int j = 0; j < N; j++)
+      for (int i = 0; i < N - 1; i++)
+        a[i][j][k] = a[i + 1][j][k - 1];
+}
+
+void illegal_test(float a[][N]) {
+  // Dipendenza con distanza (+1, -1) nell'ordine j, i: scambiare i loop la inverte,
+  // il nest resta com'e'
+  for (int j = 1; j < N; j++)
+    for (int i = 0; i < N - 1; i++)
+      a[i][j] = a[i + 1][j - 1];
+}
+
+void row_major_test(float a[][N], float b[][N]) {
+  // Gli accessi sono gia' consecutivi nel loop interno: nessun interchange
+  for (int i = 0; i < N; i++)
+    for (int j = 0; j < N; j++)
+      a[i][j] = b[i][j] * 3;
+}
+
+void transpose_test(float *restrict a, float *restrict b, int n) {
+  // In entrambi gli ordini uno dei due array viene scritto o letto per colonne:
+  // l'interchange non conviene
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      b[j * n + i] = a[i * n + j];
+}
+
+float reduction_test(float a[][N]) {
+  // La somma attraversa le iterazioni di entrambi i loop: il nest non viene considerato
+  float sum = 0;
+  for (int j = 0; j < N; j++)
+    for (int i = 0; i < N; i++)
+      sum += a[i][j];
+  return sum;
+}
@@ -0,0 +1,113 @@
+// test/test_loop_parallel.c
+#include <stdio.h>
+
+#define N 100000
+#define M 1200
+
+void scale_test(int *restrict a, int *restrict b, int n) {
+  // Ogni iterazione scrive solo il proprio elemento: il loop e' DOALL,
+  // con n sotto la soglia resta la versione sequenziale
+  for (int i = 0; i < n; i++)
+    a[i] = b[i] * 2 + 1;
+}
+
+void nest_test(float *restrict a, float *restrict b, int n, int m) {
+  // DependenceInfo non separa i * m + j, gli stride di SCEV si':
+  // viene parallelizzato il loop esterno, ogni thread si occupa di alcune righe
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < m; j++)
+      a[i * m + j] = b[i * m + j] + i;
+}
+
+void inner_test(float a[][M], int n) {
+  // Il loop esterno legge la riga scritta dall'iterazione precedente: si parallelizza quello interno
+  for (int i = 1; i < n; i++)
+    for (int j = 0; j < M; j++)
+      a[i][j] = a[i - 1][j] * 0.5f;
+}
+
+void constant_test(long *a) {
+  // Trip count costante sopra la soglia: il loop sequenziale viene eliminato
+  for (long i = 0; i < N; i++)
+    a[i] = i * i;
+}
+
+void carried_test(int *a, int n) {
+  // Ogni iterazione legge il valore scritto dalla precedente: non parallelizzabile
+  for (int i = 0; i < n - 1; i++)
+    a[i + 1] = a[i] + 1;
+}
+
+int reduction_test(int *a, int n) {
+  // La somma passa da un'iterazione all'altra: non parallelizzabile
+  int sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += a[i];
+  return sum;
+}
+
+void call_test(int *a, int n) {
+  // printf non puo' essere eseguita in ordine sparso da piu' thread
+  for (int i = 0; i < n; i++) {
+    a[i] = i;
+    printf("%d\n", i);
+  }
+}
+
+__attribute__((noinline, pure)) int peek(const int *a) {
+  return a[0];
+}
+
+void nest_call_test(int *restrict a, int *restrict b, int n, int m) {
+  // peek legge tutto a, che scrivono anche le altre iterazioni, e una chiamata non ha un indirizzo
+  // da cui ricavare gli stride: nessuno dei due loop viene parallelizzato
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < m; j++) {
+      a[i * m + j] = i + j;
+      b[i * m + j] = peek(a);
+    }
+}
+
+void small_test(int *a) {
+  // Troppo poche iterazioni per pagare la creazione dei thread
+  for (int i = 0; i < 16; i++)
+    a[i] = 0;
+}
+
+static int a[N], b[N];
+static float f[M][M], g[M * M];
+static long l[N];
+
+int main(void) {
+  // I risultati vengono confrontati con i valori attesi: stampa OK se la versione parallela e' corretta
+  int ok = 1;
+  for (int i = 0; i < N; i++)
+    b[i] = i % 1000;
+  scale_test(a, b, N);
+  scale_test(a, b, 10);
+  for (int i = 0; i < N; i++)
+    ok &= a[i] == (i % 1000) * 2 + 1;
+
+  nest_test(&f[0][0], g, M, M);
+  for (int i = 0; i < M; i++)
+    ok &= f[i][M - 1] == i;
+
+  for (int j = 0; j < M; j++)
+    f[0][j] = j;
+  inner_test(f, M);
+  ok &= f[2][100] == 25;
+
+  constant_test(l);
+  ok &= l[N - 1] == (long)(N - 1) * (N - 1);
+
+  carried_test(a, N);
+  ok &= a[N - 1] == N;
+  ok &= reduction_test(b, 2000) == 999 * 1000;
+  nest_call_test(a, b, 100, 100);
+  ok &= b[100 * 100 - 1] == 0;
+  small_test(a);
+  ok &= a[15] == 0;
+
+  printf("%s\n", ok ? "OK" : "ERRORE");
+  return !ok;
+}
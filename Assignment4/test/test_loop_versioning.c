@@ -0,0 +1,32 @@
+// test/test_loop_versioning.c
+#include <stdio.h>
+
+#define N 16
+
+void last_element_overlap_test(int *a, int *b, int *c) {
+  // b puo' sovrapporsi ad a: i loop vengono fusi solo dietro un controllo a runtime.
+  // Con b = a + N - 1, b[0] e' l'ultimo elemento scritto dal Loop 1: l'intervallo di a deve
+  // comprendere anche l'ultima iterazione, altrimenti viene scelta la versione fusa
+  for (int i = 0; i < N; i++) {
+    a[i] = i;
+  }
+
+  for (int i = 0; i < N; i++) {
+    c[i] = b[i] * 2;
+  }
+}
+
+static int buf[2 * N], c[N];
+
+int main(void) {
+  // La versione fusa leggerebbe b[0] prima che il Loop 1 lo scriva: stampa OK se viene eseguita la copia non fusa
+  last_element_overlap_test(buf, buf + N - 1, c);
+  int ok = c[0] == 2 * (N - 1);
+
+  // Senza sovrapposizione viene eseguita la versione fusa
+  last_element_overlap_test(buf, buf + N, c);
+  ok &= c[N - 2] == 0;
+
+  printf("%s\n", ok ? "OK" : "ERRORE");
+  return !ok;
+}
@@ -0,0 +1,903 @@
+// Driver in-process: carica il modulo una volta (bitcode o IR testuale), esegue la canonicalizzazione e i pass
+// custom in memoria con un solo PassBuilder e scrive il bitcode, senza i file .ll intermedi di script.sh.
+// Per ogni fase riporta il tempo trascorso e il picco di memoria del processo.
+// Con piu' moduli in ingresso lavora in batch: i moduli vengono divisi fra i worker di un thread pool
+// con work stealing, ognuno con il suo LLVMContext, e ogni risultato viene scritto accanto al suo input.
+// Con -lazy il bitcode viene caricato in modo lazy e le funzioni vengono materializzate una alla volta:
+// solo quelle con almeno un loop passano dalle pipeline, le altre non vedono ne' pass ne' analisi.
+// Con -cache-dir i corpi ottimizzati vengono salvati su disco, uno per funzione: chi ritrova una funzione
+// gia' ottimizzata con le stesse pipeline innesta il corpo salvato invece di rieseguire i pass
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "PassLog.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFilenames(
+    cl::Positional, cl::OneOrMore, cl::desc("<input bitcode or textual IR>... (@file reads the list from file)"));
+
+static cl::opt<std::string> OutputFilename(
+    "o", cl::init("optimized.bc"), cl::value_desc("filename"),
+    cl::desc("Output file with a single input, optimized.bc by default"));
+
+static cl::opt<bool> OutputAssembly(
+    "S", cl::desc("Write textual IR instead of bitcode"));
+
+static cl::opt<std::string> CanonicalizePipeline(
+    "canonicalize", cl::init("function(mem2reg,loop-simplify)"),
+    cl::desc("Canonicalization run before the custom passes, with the syntax of opt -passes"));
+
+static cl::opt<std::string> PassPipeline(
+    "passes", cl::init(""),
+    cl::desc("Custom passes, with the syntax of opt -passes (es. loop-fusion-pass, default<O2>)"));
+
+static cl::opt<bool> DisableVerify(
+    "disable-verify", cl::desc("Do not verify the module after the passes"));
+
+static cl::opt<bool> LazyLoad(
+    "lazy",
+    cl::desc("Load bitcode lazily and materialize one function at a time: only functions with loops "
+             "are canonicalized and optimized, -canonicalize and -passes must be function pipelines"));
+
+static cl::opt<std::string> CacheDir(
+    "cache-dir", cl::value_desc("directory"),
+    cl::desc("Per-function cache of the optimized bodies: functions already optimized with the same "
+             "pipelines are spliced from the cache, -canonicalize and -passes must be function pipelines"));
+
+static cl::opt<unsigned> CacheSizeMB(
+    "cache-size-mb", cl::init(256), cl::value_desc("MB"),
+    cl::desc("Size cap of -cache-dir, the least recently used entries are removed first"));
+
+static cl::opt<unsigned> Jobs(
+    "j", cl::Prefix, cl::init(0), cl::value_desc("N"),
+    cl::desc("Worker threads in batch mode, one per core when 0"));
+
+// Funzioni di registrazione definite nei MyPasses.cpp dei singoli assignment
+void registerAssignment1Pipelines(PassBuilder &PB);
+void registerAssignment1ExtensionPoints(PassBuilder &PB);
+void registerAssignment3Pipelines(PassBuilder &PB);
+void registerAssignment3ExtensionPoints(PassBuilder &PB);
+void registerAssignment4Pipelines(PassBuilder &PB);
+void registerAssignment4ExtensionPoints(PassBuilder &PB);
+const char *getAssignment1Version();
+const char *getAssignment3Version();
+const char *getAssignment4Version();
+
+// Una fase del driver: il tempo trascorso e il picco di memoria residente alla sua fine
+struct StageReport {
+    std::string Name;
+    double WallTime;
+    double PeakMemory;
+};
+
+// Il risultato dell'ottimizzazione di un modulo, raccolto dal worker che l'ha eseguita
+struct ModuleResult {
+    std::string Output;
+    bool Ok = false;
+    std::string Error;
+    std::vector<StageReport> Stages;
+    double Latency = 0;
+    unsigned OptimizedFunctions = 0; // solo con -lazy: funzioni con loop passate dalle pipeline
+    unsigned SkippedFunctions = 0;   // solo con -lazy: funzioni senza loop lasciate com'erano
+    unsigned CacheHits = 0;          // solo con -cache-dir: corpi innestati dalla cache
+    unsigned CacheMisses = 0;
+    unsigned NotCacheable = 0;       // funzioni che non si possono ricollegare al modulo per nome
+    double CacheSavedTime = 0;       // tempo di ottimizzazione delle funzioni innestate, misurato alla scrittura
+    std::string Log;                 // solo in batch: il logging dei pass, stampato nell'ordine degli input
+};
+
+// Quello che oltre alla funzione stessa puo' cambiare il risultato dei pass: versioni di LLVM e dei pass,
+// pipeline e le altre opzioni della riga di comando. Calcolato una volta in main, poi solo letto dai worker
+std::string CacheContext;
+
+// Picco di memoria residente del processo fino a questo momento, in MB
+double getPeakMemoryMB() {
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+#ifdef __APPLE__
+    return Usage.ru_maxrss / (1024.0 * 1024.0); // byte su macOS
+#else
+    return Usage.ru_maxrss / 1024.0;            // KB su Linux
+#endif
+}
+
+// La TargetMachine serve al TargetTransformInfo dei pass (es. dimensione della cache per il tiling).
+// Se il target non e' disponibile restituisce nullptr e i pass usano il TargetTransformInfo generico
+std::unique_ptr<TargetMachine> createTargetMachine(const std::string &TripleName, std::string &ErrorMessage) {
+    const Target *T = TargetRegistry::lookupTarget(TripleName, ErrorMessage);
+    if (!T) {
+        return nullptr;
+    }
+    return std::unique_ptr<TargetMachine>(T->createTargetMachine(TripleName, "", "", TargetOptions(), {}));
+}
+
+std::string getTargetTriple(const Module &M) {
+    return M.getTargetTriple().empty() ? sys::getDefaultTargetTriple() : M.getTargetTriple();
+}
+
+// Apre il bitcode senza leggere i corpi delle funzioni: vengono materializzati su richiesta.
+// Il buffer passa al modulo, che lo tiene finche' restano funzioni da materializzare
+std::unique_ptr<Module> loadLazyModule(const std::string &Input, LLVMContext &Ctx, std::string &ErrorMessage) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFileOrSTDIN(Input);
+    if (std::error_code EC = Buffer.getError()) {
+        ErrorMessage = EC.message();
+        return nullptr;
+    }
+    Expected<std::unique_ptr<Module>> M = getOwningLazyBitcodeModule(std::move(*Buffer), Ctx);
+    if (!M) {
+        ErrorMessage = toString(M.takeError()) + " (-lazy needs bitcode input)";
+        return nullptr;
+    }
+    return std::move(*M);
+}
+
+// Un ciclo nel CFG ha sempre almeno un arco all'indietro nella visita in profondita':
+// FindFunctionBackedges li trova senza costruire DominatorTree e LoopInfo
+bool hasLoops(const Function &F) {
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> Backedges;
+    FindFunctionBackedges(F, Backedges);
+    return !Backedges.empty();
+}
+
+// Copia F in un modulo a se', con le dichiarazioni dei valori globali che usa.
+// Per la chiave della cache (ForKey) restano definite, con i loro inizializzatori, tutte le costanti globali:
+// i pass possono ripiegarne i valori. Per la voce della cache restano definite solo le costanti locali
+// unnamed_addr, che si possono duplicare; le altre variabili locali diventano dichiarazioni esterne
+// e i loro nomi finiscono in Locals, per ricollegarle al modulo al momento dell'innesto.
+// Restituisce nullptr se F usa valori che non si possono ricollegare per nome
+std::unique_ptr<Module> extractFunction(Function &F, bool ForKey, std::vector<std::string> *Locals) {
+    auto KeepDefinition = [&](const GlobalVariable *GV) {
+        if (!GV->isConstant() || !GV->hasDefinitiveInitializer()) return false;
+        return ForKey || (GV->hasLocalLinkage() && GV->hasGlobalUnnamedAddr());
+    };
+
+    // --- Valori globali usati da F, anche dentro le espressioni costanti e gli inizializzatori copiati ---
+    SetVector<GlobalValue *> Referenced;
+    SmallPtrSet<const Constant *, 32> Visited;
+    SmallVector<Constant *, 32> Worklist;
+    auto Push = [&](Value *V) {
+        if (auto *C = dyn_cast<Constant>(V)) {
+            if (Visited.insert(C).second) Worklist.push_back(C);
+        }
+    };
+    for (Instruction &I : instructions(F)) {
+        for (Value *Op : I.operands()) Push(Op);
+    }
+    if (F.hasPersonalityFn()) Push(F.getPersonalityFn());
+    while (!Worklist.empty()) {
+        Constant *C = Worklist.pop_back_val();
+        if (isa<BlockAddress>(C) || isa<GlobalAlias>(C) || isa<GlobalIFunc>(C)) return nullptr;
+        if (auto *GV = dyn_cast<GlobalValue>(C)) {
+            if (GV == &F) continue;
+            if (!GV->hasName()) return nullptr;
+            Referenced.insert(GV);
+            auto *Var = dyn_cast<GlobalVariable>(GV);
+            if (Var && KeepDefinition(Var)) Push(Var->getInitializer());
+            continue;
+        }
+        for (Value *Op : C->operands()) Push(Op);
+    }
+
+    // --- Il modulo: nome fisso, cosi' la chiave dipende solo dal contenuto ---
+    const Module &M = *F.getParent();
+    auto NewM = std::make_unique<Module>("cache", F.getContext());
+    NewM->setTargetTriple(M.getTargetTriple());
+    NewM->setDataLayout(M.getDataLayout());
+
+    ValueToValueMapTy VMap;
+    Function *NewF = Function::Create(F.getFunctionType(), ForKey ? F.getLinkage() : GlobalValue::ExternalLinkage,
+                                      F.getAddressSpace(), F.getName(), NewM.get());
+    VMap[&F] = NewF;
+    for (GlobalValue *GV : Referenced) {
+        GlobalValue *NewGV;
+        if (auto *Callee = dyn_cast<Function>(GV)) {
+            Function *NewCallee = Function::Create(Callee->getFunctionType(), GlobalValue::ExternalLinkage,
+                                                   Callee->getAddressSpace(), Callee->getName(), NewM.get());
+            NewCallee->setAttributes(Callee->getAttributes());
+            NewCallee->setCallingConv(Callee->getCallingConv());
+            NewGV = NewCallee;
+        } else {
+            auto *Var = cast<GlobalVariable>(GV);
+            auto *NewVar = new GlobalVariable(*NewM, Var->getValueType(), Var->isConstant(),
+                                              KeepDefinition(Var) ? Var->getLinkage() : GlobalValue::ExternalLinkage,
+                                              nullptr, Var->getName(), nullptr, Var->getThreadLocalMode(),
+                                              Var->getAddressSpace());
+            NewVar->setAlignment(Var->getAlign());
+            NewVar->setUnnamedAddr(Var->getUnnamedAddr());
+            NewGV = NewVar;
+        }
+        if (Locals && GV->hasLocalLinkage() && !(isa<GlobalVariable>(GV) && KeepDefinition(cast<GlobalVariable>(GV)))) {
+            Locals->push_back(GV->getName().str());
+        }
+        VMap[GV] = NewGV;
+    }
+    for (GlobalValue *GV : Referenced) {
+        auto *Var = dyn_cast<GlobalVariable>(GV);
+        if (Var && KeepDefinition(Var)) {
+            cast<GlobalVariable>(VMap[GV])->setInitializer(MapValue(Var->getInitializer(), VMap));
+        }
+    }
+
+    for (auto Args : zip(F.args(), NewF->args())) {
+        std::get<1>(Args).setName(std::get<0>(Args).getName());
+        VMap[&std::get<0>(Args)] = &std::get<1>(Args);
+    }
+    SmallVector<ReturnInst *, 8> Returns;
+    CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+    return NewM;
+}
+
+// Percorso della voce di cache di F: SHA1 del contesto, dei linkage dei valori globali usati e del bitcode
+// di F estratto dal modulo. Vuoto se F non si puo' mettere in cache (senza nome, in un comdat, con debug info,
+// o se un valore globale della voce non ha un omonimo nel modulo)
+std::string getCacheEntryPath(Function &F) {
+    if (!F.hasName() || F.hasComdat() || F.getSubprogram()) return "";
+    std::unique_ptr<Module> Key = extractFunction(F, true, nullptr);
+    if (!Key) return "";
+
+    std::string Buffer = CacheContext;
+    raw_string_ostream OS(Buffer);
+    for (const GlobalValue &GV : Key->global_values()) {
+        GlobalValue *Original = F.getParent()->getNamedValue(GV.getName());
+        if (!Original) return "";
+        OS << GV.getName() << ' ' << (unsigned)Original->getLinkage() << '\n';
+    }
+    WriteBitcodeToFile(*Key, OS);
+    OS.flush();
+
+    SmallString<128> Path(CacheDir);
+    sys::path::append(Path, "llvmcache-" + toHex(SHA1::hash(arrayRefFromStringRef(Buffer)), true));
+    return std::string(Path);
+}
+
+// Una voce della cache letta dal disco, in attesa di essere innestata nel modulo
+struct CachedFunction {
+    std::string Name;
+    std::unique_ptr<Module> Entry;
+    std::vector<std::string> Locals;
+    double OptimizationTime = 0;
+};
+
+// Legge la voce Path mappandola in memoria. Una voce assente o illeggibile e' un miss.
+// L'accesso aggiorna la data del file, che pruneCache usa per scartare le voci usate meno di recente
+bool readCacheEntry(const std::string &Path, LLVMContext &Ctx, CachedFunction &Hit) {
+    Expected<sys::fs::file_t> FD = sys::fs::openNativeFileForRead(Path);
+    if (!FD) {
+        consumeError(FD.takeError());
+        return false;
+    }
+    sys::fs::file_status Status;
+    std::error_code EC = sys::fs::status(*FD, Status);
+    if (!EC) {
+        sys::fs::mapped_file_region Region(*FD, sys::fs::mapped_file_region::readonly, Status.getSize(), 0, EC);
+        if (!EC) {
+            sys::fs::setLastAccessAndModificationTime(
+                *FD, std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()));
+            // Il modulo viene letto per intero: dopo la lettura non dipende piu' dalla regione mappata
+            Expected<std::unique_ptr<Module>> Entry =
+                parseBitcodeFile(MemoryBufferRef(StringRef(Region.const_data(), Status.getSize()), Path), Ctx);
+            if (Entry) {
+                Hit.Entry = std::move(*Entry);
+            } else {
+                consumeError(Entry.takeError());
+            }
+        }
+    }
+    sys::fs::closeFile(*FD);
+    if (!Hit.Entry) return false;
+
+    // I metadati della voce non devono finire nel modulo con l'innesto
+    if (NamedMDNode *Time = Hit.Entry->getNamedMetadata("assignments.cache.time")) {
+        auto *Seconds = mdconst::extract<ConstantFP>(Time->getOperand(0)->getOperand(0));
+        Hit.OptimizationTime = Seconds->getValueAPF().convertToDouble();
+        Hit.Entry->eraseNamedMetadata(Time);
+    }
+    if (NamedMDNode *Locals = Hit.Entry->getNamedMetadata("assignments.cache.locals")) {
+        for (MDNode *Local : Locals->operands()) {
+            Hit.Locals.push_back(cast<MDString>(Local->getOperand(0))->getString().str());
+        }
+        Hit.Entry->eraseNamedMetadata(Locals);
+    }
+    return true;
+}
+
+// Salva il corpo ottimizzato di F con il tempo impiegato per ottimizzarlo
+void writeCacheEntry(Function &F, const std::string &Path, double OptimizationTime) {
+    std::vector<std::string> Locals;
+    std::unique_ptr<Module> Entry = extractFunction(F, false, &Locals);
+    if (!Entry) return;
+
+    LLVMContext &Ctx = F.getContext();
+    Entry->getOrInsertNamedMetadata("assignments.cache.time")->addOperand(MDTuple::get(
+        Ctx, {ConstantAsMetadata::get(ConstantFP::get(Type::getDoubleTy(Ctx), OptimizationTime))}));
+    NamedMDNode *LocalsMD = Entry->getOrInsertNamedMetadata("assignments.cache.locals");
+    for (const std::string &Name : Locals) {
+        LocalsMD->addOperand(MDTuple::get(Ctx, {MDString::get(Ctx, Name)}));
+    }
+
+    // Scritta in un file temporaneo e poi rinominata: i worker del batch, e altri driver sulla stessa cache,
+    // vedono una voce completa o nessuna
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(sys::path::parent_path(Path) + "/tmp-%%%%%%%%", FD, TempPath)) return;
+    {
+        raw_fd_ostream OS(FD, true);
+        WriteBitcodeToFile(*Entry, OS);
+    }
+    if (sys::fs::rename(TempPath, Path)) {
+        sys::fs::remove(TempPath);
+    }
+}
+
+// Sostituisce il corpo della funzione Hit.Name con quello della voce, restando nella stessa posizione del modulo.
+// Il Linker con linkage locale creerebbe una copia rinominata invece di sostituire o ricollegare il valore:
+// per la durata dell'innesto la funzione e le variabili locali che usa diventano esterne
+bool spliceCachedFunction(Module &M, Linker &L, CachedFunction &Hit) {
+    SmallVector<std::pair<GlobalValue *, GlobalValue::LinkageTypes>, 8> Linkages;
+    for (const std::string &Name : Hit.Locals) {
+        GlobalValue *GV = M.getNamedValue(Name);
+        if (!GV || !GV->hasLocalLinkage()) return false;
+        Linkages.push_back({GV, GV->getLinkage()});
+    }
+    // Le costanti locali copiate nella voce che il modulo ha gia' identiche vengono ricollegate invece di duplicate
+    for (GlobalVariable &EntryVar : Hit.Entry->globals()) {
+        GlobalVariable *Var = M.getGlobalVariable(EntryVar.getName(), true);
+        if (EntryVar.hasInitializer() && Var && Var->hasLocalLinkage() && Var->isConstant() && Var->hasInitializer() &&
+            Var->getInitializer() == EntryVar.getInitializer()) {
+            EntryVar.setInitializer(nullptr);
+            EntryVar.setLinkage(GlobalValue::ExternalLinkage);
+            Linkages.push_back({Var, Var->getLinkage()});
+        }
+    }
+
+    Function *Old = M.getFunction(Hit.Name);
+    GlobalValue::LinkageTypes Linkage = Old->getLinkage();
+    GlobalValue::VisibilityTypes Visibility = Old->getVisibility();
+    GlobalValue::UnnamedAddr UnnamedAddr = Old->getUnnamedAddr();
+    bool DSOLocal = Old->isDSOLocal();
+    auto Next = std::next(Old->getIterator());
+
+    Old->setLinkage(GlobalValue::ExternalLinkage);
+    for (auto &Local : Linkages) {
+        Local.first->setLinkage(GlobalValue::ExternalLinkage);
+    }
+    bool Failed = L.linkInModule(std::move(Hit.Entry), Linker::OverrideFromSrc);
+    for (auto &Local : Linkages) {
+        Local.first->setLinkage(Local.second);
+    }
+
+    Function *New = M.getFunction(Hit.Name);
+    New->setVisibility(Visibility);
+    New->setLinkage(Linkage);
+    New->setDSOLocal(DSOLocal);
+    New->setUnnamedAddr(UnnamedAddr);
+    if (Failed) return false;
+    M.getFunctionList().splice(Next, M.getFunctionList(), New->getIterator());
+    return true;
+}
+
+// Ottimizza un modulo dall'inizio alla fine: caricamento, canonicalizzazione, pass custom, verifica e scrittura.
+// Tutto vive nel contesto Ctx del chiamante, quindi worker diversi non condividono nulla.
+// GetTM restituisce la TargetMachine per il triple del modulo appena caricato
+void optimizeModule(const std::string &Input, LLVMContext &Ctx, function_ref<TargetMachine *(const Module &)> GetTM,
+                    PassInstrumentationCallbacks *PIC, ModuleResult &Result) {
+    // Con -lazy le fasi si ripetono per ogni funzione: i tempi si sommano nella stessa riga del report
+    auto RunStage = [&](StringRef Name, function_ref<void()> Body) {
+        TimeRecord Elapsed = TimeRecord::getCurrentTime(false);
+        Body();
+        TimeRecord End = TimeRecord::getCurrentTime(false);
+        End -= Elapsed;
+        auto Stage = find_if(Result.Stages, [&](const StageReport &S) { return S.Name == Name; });
+        if (Stage == Result.Stages.end()) {
+            Result.Stages.push_back({Name.str(), End.getWallTime(), getPeakMemoryMB()});
+        } else {
+            Stage->WallTime += End.getWallTime();
+            Stage->PeakMemory = getPeakMemoryMB();
+        }
+        Result.Latency += End.getWallTime();
+    };
+
+    // --- Caricamento: parseIRFile riconosce da solo bitcode e IR testuale, con -lazy solo bitcode ---
+    std::unique_ptr<Module> M;
+    SMDiagnostic Err;
+    RunStage("load", [&] { M = LazyLoad ? loadLazyModule(Input, Ctx, Result.Error) : parseIRFile(Input, Err, Ctx); });
+    if (!M) {
+        if (!LazyLoad) {
+            raw_string_ostream OS(Result.Error);
+            Err.print("", OS, false);
+        }
+        return;
+    }
+
+    // --- Un solo PassBuilder e un solo insieme di analisi per tutte le fasi ---
+    PassBuilder PB(GetTM(*M), PipelineTuningOptions(), {}, PIC);
+
+    registerAssignment1Pipelines(PB);
+    registerAssignment3Pipelines(PB);
+    registerAssignment4Pipelines(PB);
+    registerAssignment1ExtensionPoints(PB);
+    registerAssignment3ExtensionPoints(PB);
+    registerAssignment4ExtensionPoints(PB);
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // Una pipeline vuota non e' valida per parsePassPipeline: la fase viene saltata.
+    // Con -lazy e con -cache-dir le pipeline girano su una funzione alla volta e devono essere pipeline di funzione
+    bool PerFunction = LazyLoad || !CacheDir.empty();
+    ModulePassManager Canonicalize, Optimize;
+    FunctionPassManager CanonicalizeFunction, OptimizeFunction;
+    auto ParsePipeline = [&](auto &PM, const std::string &Pipeline) {
+        if (Pipeline.empty()) return true;
+        if (Error E = PB.parsePassPipeline(PM, Pipeline)) {
+            Result.Error = toString(std::move(E));
+            return false;
+        }
+        return true;
+    };
+    if (PerFunction ? !ParsePipeline(CanonicalizeFunction, CanonicalizePipeline) ||
+                       !ParsePipeline(OptimizeFunction, PassPipeline)
+                 : !ParsePipeline(Canonicalize, CanonicalizePipeline) || !ParsePipeline(Optimize, PassPipeline)) {
+        return;
+    }
+
+    if (!PerFunction) {
+        // --- Canonicalizzazione e pass custom, le analisi valide passano da una fase all'altra ---
+        RunStage("canonicalize", [&] { Canonicalize.run(*M, MAM); });
+        RunStage("optimize", [&] { Optimize.run(*M, MAM); });
+    } else {
+        // Pipeline su una sola funzione, le cui analisi vengono scartate appena finita: in memoria ci sono
+        // solo quelle della funzione corrente invece di quelle di tutto il modulo. Restituisce il tempo impiegato
+        auto OptimizeOne = [&](Function &F) {
+            double Before = Result.Latency;
+            RunStage("canonicalize", [&] { CanonicalizeFunction.run(F, FAM); });
+            RunStage("optimize", [&] { OptimizeFunction.run(F, FAM); });
+            FAM.clear(F, F.getName());
+            ++Result.OptimizedFunctions;
+            return Result.Latency - Before;
+        };
+
+        // --- Una funzione alla volta: materializzazione, controllo dei loop, cache e pipeline ---
+        // I corpi trovati nella cache vengono innestati alla fine, con il modulo completo
+        std::vector<CachedFunction> Hits;
+        for (Function &F : *M) {
+            if (F.isMaterializable()) {
+                std::string MaterializeError;
+                RunStage("materialize", [&] {
+                    if (Error E = F.materialize()) MaterializeError = toString(std::move(E));
+                });
+                if (!MaterializeError.empty()) {
+                    Result.Error = F.getName().str() + ": " + MaterializeError;
+                    return;
+                }
+            }
+            if (F.isDeclaration()) continue;
+            if (LazyLoad && !hasLoops(F)) {
+                ++Result.SkippedFunctions;
+                continue;
+            }
+            if (CacheDir.empty()) {
+                OptimizeOne(F);
+                continue;
+            }
+
+            // La chiave si calcola sulla funzione in ingresso, prima di qualsiasi pass
+            std::string EntryPath;
+            CachedFunction Hit;
+            bool Found = false;
+            RunStage("cache-lookup", [&] {
+                EntryPath = getCacheEntryPath(F);
+                Found = !EntryPath.empty() && readCacheEntry(EntryPath, Ctx, Hit);
+            });
+            if (EntryPath.empty()) {
+                ++Result.NotCacheable;
+                OptimizeOne(F);
+            } else if (Found) {
+                Hit.Name = F.getName().str();
+                Hits.push_back(std::move(Hit));
+            } else {
+                ++Result.CacheMisses;
+                double OptimizationTime = OptimizeOne(F);
+                RunStage("cache-store", [&] { writeCacheEntry(F, EntryPath, OptimizationTime); });
+            }
+        }
+
+        // Il BitcodeWriter scrive solo moduli completi: materializza anche alias e inizializzatori rimasti
+        if (LazyLoad) {
+            RunStage("materialize", [&] {
+                if (Error E = M->materializeAll()) Result.Error = toString(std::move(E));
+            });
+            if (!Result.Error.empty()) return;
+        }
+
+        // --- Innesto dei corpi presi dalla cache ---
+        if (!Hits.empty()) {
+            Linker L(*M);
+            for (CachedFunction &Hit : Hits) {
+                bool Spliced = false;
+                RunStage("splice", [&] { Spliced = spliceCachedFunction(*M, L, Hit); });
+                if (Spliced) {
+                    ++Result.CacheHits;
+                    Result.CacheSavedTime += Hit.OptimizationTime;
+                    continue;
+                }
+                // La voce usa una variabile locale che nel modulo non c'e' piu': la funzione si ottimizza
+                ++Result.CacheMisses;
+                OptimizeOne(*M->getFunction(Hit.Name));
+            }
+        }
+    }
+
+    bool Broken = false;
+    std::string VerifierErrors;
+    if (!DisableVerify) {
+        raw_string_ostream OS(VerifierErrors);
+        RunStage("verify", [&] { Broken = verifyModule(*M, &OS); });
+    }
+    if (Broken) {
+        Result.Error = "the optimized module is broken\n" + VerifierErrors;
+        return;
+    }
+
+    // --- Scrittura del risultato ---
+    std::error_code EC;
+    ToolOutputFile Out(Result.Output, EC, OutputAssembly ? sys::fs::OF_Text : sys::fs::OF_None);
+    if (EC) {
+        Result.Error = Result.Output + ": " + EC.message();
+        return;
+    }
+    RunStage("write", [&] {
+        if (OutputAssembly) {
+            M->print(Out.os(), nullptr);
+        } else {
+            WriteBitcodeToFile(*M, Out.os());
+        }
+    });
+    Out.keep();
+    Result.Ok = true;
+}
+
+// Nome del risultato di un modulo in batch: accanto all'input, es. dir/a.bc => dir/a.opt.bc.
+// Dipende solo dall'input, quindi non cambia con il numero di worker o l'ordine di esecuzione
+std::string getBatchOutputName(StringRef Input) {
+    SmallString<128> Output(Input);
+    sys::path::replace_extension(Output, OutputAssembly ? "opt.ll" : "opt.bc");
+    return std::string(Output);
+}
+
+// Percorso assoluto senza . e .., per riconoscere lo stesso file scritto in due modi (a.bc, ./a.bc)
+std::string getCanonicalPath(StringRef Path) {
+    SmallString<128> Canonical(Path);
+    sys::fs::make_absolute(Canonical);
+    sys::path::remove_dots(Canonical, true);
+    return std::string(Canonical);
+}
+
+// Valore del percentile P (0-100) di un insieme di tempi gia' ordinato
+double getPercentile(ArrayRef<double> Sorted, unsigned P) {
+    return Sorted[std::min(Sorted.size() - 1, Sorted.size() * P / 100)];
+}
+
+// Contesto della chiave della cache: tutta la riga di comando, con i @file espansi come fa ParseCommandLineOptions,
+// tranne input, output, -j e le opzioni della cache, che non cambiano il codice ottimizzato
+std::string getCacheContext(int argc, char **argv) {
+    std::string Context = std::string("LLVM ") + LLVM_VERSION_STRING + ", Assignment1 " + getAssignment1Version() +
+                          ", Assignment3 " + getAssignment3Version() + ", Assignment4 " + getAssignment4Version() +
+                          "\n" + CanonicalizePipeline + "\n" + PassPipeline + "\n";
+    SmallVector<const char *, 32> Args(argv + 1, argv + argc);
+    BumpPtrAllocator Alloc;
+    StringSaver Saver(Alloc);
+    cl::ExpandResponseFiles(Saver, cl::TokenizeGNUCommandLine, Args);
+    for (size_t I = 0; I < Args.size(); ++I) {
+        StringRef Arg = Args[I];
+        StringRef Name = Arg.ltrim('-').split('=').first;
+        if (Arg.empty() || is_contained(InputFilenames, Arg)) continue;
+        if (Name == "lazy") continue;
+        if (Name == "o" || Name == "cache-dir" || Name == "cache-size-mb") {
+            if (!Arg.contains('=')) ++I;
+            continue;
+        }
+        if (!Name.empty() && Name.front() == 'j' && Name.drop_front().find_first_not_of("0123456789") == StringRef::npos) {
+            continue;
+        }
+        Context += Arg.str() + "\n";
+    }
+    return Context;
+}
+
+// Riduce la cache sotto -cache-size-mb scartando le voci usate meno di recente, a ogni esecuzione
+void pruneFunctionCache() {
+    CachePruningPolicy Policy;
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.MaxSizeBytes = (uint64_t)CacheSizeMB * 1024 * 1024;
+    pruneCache(CacheDir, Policy);
+}
+
+void printCacheReport(unsigned Hits, unsigned Misses, unsigned NotCacheable, double SavedTime) {
+    unsigned Lookups = Hits + Misses;
+    errs() << format("Function cache: %u hits, %u misses, %u not cacheable, hit rate %.1f%%, %.3f s of optimization saved\n",
+                     Hits, Misses, NotCacheable, Lookups ? 100.0 * Hits / Lookups : 0.0, SavedTime);
+}
+
+// Coda di un worker del batch: il proprietario prende i moduli dalla testa, gli altri worker rubano dalla coda
+struct WorkQueue {
+    std::mutex Lock;
+    std::deque<size_t> Modules;
+};
+
+int runBatch(const char *Argv0) {
+    size_t NumModules = InputFilenames.size();
+    unsigned NumWorkers = Jobs ? (unsigned)Jobs : std::max(1u, llvm::hardware_concurrency().compute_thread_count());
+    NumWorkers = std::min<size_t>(NumWorkers, NumModules);
+
+    std::vector<ModuleResult> Results(NumModules);
+    for (size_t Idx = 0; Idx < NumModules; ++Idx) {
+        Results[Idx].Output = getBatchOutputName(InputFilenames[Idx]);
+    }
+
+    // Due worker non possono scrivere lo stesso file (es. a.bc e a.ll, o lo stesso input ripetuto), ne'
+    // sovrascrivere un input che un altro worker sta leggendo: il batch fallisce prima di partire
+    StringMap<size_t> Inputs, Outputs;
+    for (size_t Idx = 0; Idx < NumModules; ++Idx) {
+        Inputs.try_emplace(getCanonicalPath(InputFilenames[Idx]), Idx);
+    }
+    for (size_t Idx = 0; Idx < NumModules; ++Idx) {
+        std::string Output = getCanonicalPath(Results[Idx].Output);
+        auto Clash = Inputs.find(Output);
+        if (Clash != Inputs.end()) {
+            errs() << Argv0 << ": " << InputFilenames[Idx] << ": the result would overwrite the input "
+                   << InputFilenames[Clash->second] << "\n";
+            return 1;
+        }
+        auto Inserted = Outputs.try_emplace(Output, Idx);
+        if (!Inserted.second) {
+            errs() << Argv0 << ": " << InputFilenames[Inserted.first->second] << " and " << InputFilenames[Idx]
+                   << " would both be written to " << Results[Idx].Output << "\n";
+            return 1;
+        }
+    }
+
+    // I moduli piu' grandi vengono distribuiti per primi, a turno fra i worker: ognuno parte dai suoi moduli
+    // piu' grandi e chi finisce prima ruba i piu' piccoli rimasti agli altri, accorciando la coda dell'esecuzione
+    std::vector<std::pair<uint64_t, size_t>> BySize;
+    for (size_t Idx = 0; Idx < NumModules; ++Idx) {
+        uint64_t Size = 0;
+        sys::fs::file_size(InputFilenames[Idx], Size);
+        BySize.push_back({Size, Idx});
+    }
+    std::stable_sort(BySize.begin(), BySize.end(), [](const std::pair<uint64_t, size_t> &A, const std::pair<uint64_t, size_t> &B) {
+        return A.first > B.first;
+    });
+    std::vector<WorkQueue> Queues(NumWorkers);
+    uint64_t TotalBytes = 0;
+    for (size_t Pos = 0; Pos < BySize.size(); ++Pos) {
+        Queues[Pos % NumWorkers].Modules.push_back(BySize[Pos].second);
+        TotalBytes += BySize[Pos].first;
+    }
+
+    auto NextModule = [&](unsigned Worker, size_t &Idx) {
+        {
+            std::lock_guard<std::mutex> Guard(Queues[Worker].Lock);
+            if (!Queues[Worker].Modules.empty()) {
+                Idx = Queues[Worker].Modules.front();
+                Queues[Worker].Modules.pop_front();
+                return true;
+            }
+        }
+        // Nessun modulo produce nuovo lavoro: quando tutte le code sono vuote il worker ha finito
+        for (unsigned K = 1; K < NumWorkers; ++K) {
+            WorkQueue &Victim = Queues[(Worker + K) % NumWorkers];
+            std::lock_guard<std::mutex> Guard(Victim.Lock);
+            if (!Victim.Modules.empty()) {
+                Idx = Victim.Modules.back();
+                Victim.Modules.pop_back();
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // Il logging dei pass di ogni modulo va in una stringa del worker, non su outs() condiviso fra i thread.
+    // Appena un modulo finisce vengono stampati, sotto il lock, i log pronti nell'ordine degli input
+    std::mutex LogLock;
+    std::vector<bool> LogReady(NumModules, false);
+    size_t NextLog = 0;
+    auto PrintLogs = [&](size_t Idx) {
+        std::lock_guard<std::mutex> Guard(LogLock);
+        LogReady[Idx] = true;
+        for (; NextLog < NumModules && LogReady[NextLog]; ++NextLog) {
+            outs() << Results[NextLog].Log;
+            std::string().swap(Results[NextLog].Log);
+        }
+        outs().flush();
+    };
+
+    TimeRecord Start = TimeRecord::getCurrentTime(false);
+    std::vector<std::thread> Workers;
+    for (unsigned Worker = 0; Worker < NumWorkers; ++Worker) {
+        Workers.emplace_back([&, Worker] {
+            // Le TargetMachine del worker, una per triple: non vengono condivise fra i thread
+            StringMap<std::unique_ptr<TargetMachine>> TargetMachines;
+            auto GetTM = [&](const Module &M) -> TargetMachine * {
+                std::string TripleName = getTargetTriple(M);
+                auto It = TargetMachines.find(TripleName);
+                if (It == TargetMachines.end()) {
+                    std::string ErrorMessage;
+                    It = TargetMachines.insert({TripleName, createTargetMachine(TripleName, ErrorMessage)}).first;
+                }
+                return It->second.get();
+            };
+
+            size_t Idx;
+            while (NextModule(Worker, Idx)) {
+                // Ogni modulo ha il suo LLVMContext, di proprieta' del worker: la memoria di tipi e costanti
+                // viene liberata alla fine del modulo invece di crescere per tutto il batch
+                LLVMContext Ctx;
+                raw_string_ostream Log(Results[Idx].Log);
+                AssignmentsLog = &Log;
+                optimizeModule(InputFilenames[Idx], Ctx, GetTM, nullptr, Results[Idx]);
+                AssignmentsLog = nullptr;
+                Log.flush();
+                PrintLogs(Idx);
+            }
+        });
+    }
+    for (std::thread &T : Workers) {
+        T.join();
+    }
+    TimeRecord End = TimeRecord::getCurrentTime(false);
+    End -= Start;
+
+    // --- Report nell'ordine degli input, indipendente dall'ordine in cui i worker hanno finito ---
+    std::vector<double> Latencies;
+    unsigned Failed = 0;
+    unsigned CacheHits = 0, CacheMisses = 0, NotCacheable = 0;
+    double CacheSavedTime = 0;
+    errs() << "Module                                    Latency (s)\n";
+    for (size_t Idx = 0; Idx < NumModules; ++Idx) {
+        const ModuleResult &R = Results[Idx];
+        if (!R.Ok) {
+            errs() << Argv0 << ": " << InputFilenames[Idx] << ": " << R.Error << "\n";
+            ++Failed;
+            continue;
+        }
+        errs() << format("%-40s %12.3f\n", InputFilenames[Idx].c_str(), R.Latency);
+        Latencies.push_back(R.Latency);
+        CacheHits += R.CacheHits;
+        CacheMisses += R.CacheMisses;
+        NotCacheable += R.NotCacheable;
+        CacheSavedTime += R.CacheSavedTime;
+    }
+    std::sort(Latencies.begin(), Latencies.end());
+
+    double WallTime = End.getWallTime();
+    errs() << "Workers: " << NumWorkers << ", modules: " << NumModules - Failed << " optimized, " << Failed << " failed\n";
+    errs() << format("Wall time: %.3f s, throughput: %.1f modules/s, %.2f MB/s of input\n",
+                     WallTime, NumModules / WallTime, TotalBytes / (1024.0 * 1024.0) / WallTime);
+    if (!Latencies.empty()) {
+        errs() << format("Latency per module: p50 %.3f s, p90 %.3f s, max %.3f s\n",
+                         getPercentile(Latencies, 50), getPercentile(Latencies, 90), Latencies.back());
+    }
+    errs() << format("Peak memory: %.1f MB\n", getPeakMemoryMB());
+    if (!CacheDir.empty()) {
+        printCacheReport(CacheHits, CacheMisses, NotCacheable, CacheSavedTime);
+    }
+    return Failed ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    InitializeNativeTarget();
+    cl::ParseCommandLineOptions(argc, argv, "In-process driver for the passes of the assignments\n");
+
+    if (!CacheDir.empty()) {
+        if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+            errs() << argv[0] << ": " << CacheDir << ": " << EC.message() << "\n";
+            return 1;
+        }
+        CacheContext = getCacheContext(argc, argv);
+    }
+
+    if (InputFilenames.size() > 1) {
+        if (OutputFilename.getNumOccurrences()) {
+            errs() << argv[0] << ": -o needs a single input, in batch mode every result is written next to its input\n";
+            return 1;
+        }
+        int Ret = runBatch(argv[0]);
+        if (!CacheDir.empty()) pruneFunctionCache();
+        return Ret;
+    }
+
+    // --- Un solo modulo: report di ogni fase ---
+    std::unique_ptr<TargetMachine> TM;
+    auto GetTM = [&](const Module &M) {
+        std::string ErrorMessage;
+        TM = createTargetMachine(getTargetTriple(M), ErrorMessage);
+        if (!TM) {
+            errs() << argv[0] << ": " << ErrorMessage << ", using the generic cost model\n";
+        }
+        return TM.get();
+    };
+
+    // Con -time-passes viene riportato anche il tempo di ogni singolo pass
+    PassInstrumentationCallbacks PIC;
+    TimePassesHandler TimePasses(TimePassesIsEnabled);
+    TimePasses.registerCallbacks(PIC);
+
+    LLVMContext Ctx;
+    ModuleResult Result;
+    Result.Output = OutputFilename;
+    optimizeModule(InputFilenames.front(), Ctx, GetTM, &PIC, Result);
+    if (!CacheDir.empty()) pruneFunctionCache();
+    if (!Result.Ok) {
+        errs() << argv[0] << ": " << InputFilenames.front() << ": " << Result.Error << "\n";
+        return 1;
+    }
+
+    // Il report va su stderr: stdout e' gia' usato dal logging dei pass
+    errs() << "Stage          Wall time (s)   Peak memory (MB)\n";
+    for (const StageReport &R : Result.Stages) {
+        errs() << format("%-14s %13.3f %18.1f\n", R.Name.c_str(), R.WallTime, R.PeakMemory);
+    }
+    if (LazyLoad) {
+        errs() << "Functions with loops optimized: " << Result.OptimizedFunctions
+               << ", without loops skipped: " << Result.SkippedFunctions << "\n";
+    }
+    if (!CacheDir.empty()) {
+        printCacheReport(Result.CacheHits, Result.CacheMisses, Result.NotCacheable, Result.CacheSavedTime);
+    }
+    return 0;
+}
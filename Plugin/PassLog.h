@@ -0,0 +1,36 @@
+// Logging dei pass, condiviso dai MyPasses.cpp degli assignment e dal driver
+
+#ifndef ASSIGNMENTS_PASS_LOG_H
+#define ASSIGNMENTS_PASS_LOG_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Stream del logging dei pass: outs() quando vengono eseguiti per nome con opt -passes=..., nullptr quando
+// il logging e' spento. E' per thread: il driver ne da' uno a ogni worker del batch. Una sola variabile anche
+// quando gli assignment sono linkati insieme nel plugin unificato
+inline thread_local llvm::raw_ostream *AssignmentsLog = &llvm::outs();
+
+// Il messaggio viene formattato solo se c'e' uno stream: stampare un'istruzione costa quanto numerare la funzione
+#define PASS_LOG if (!AssignmentsLog) {} else *AssignmentsLog
+
+// Un pass aggiunto alle pipeline di default: gira con il logging spento, salvo l'opzione -default-pipeline-*-log
+// del suo assignment, perche' clang scriverebbe il log sul suo stdout, che con -o - e' anche l'output
+template <typename PassT>
+struct DefaultPipelinePass : llvm::PassInfoMixin<DefaultPipelinePass<PassT>> {
+    PassT Pass;
+    bool KeepLog;
+
+    DefaultPipelinePass(PassT Pass, bool KeepLog) : Pass(std::move(Pass)), KeepLog(KeepLog) {}
+
+    template <typename IRUnitT, typename AnalysisManagerT, typename... ExtraArgTs>
+    llvm::PreservedAnalyses run(IRUnitT &IR, AnalysisManagerT &AM, ExtraArgTs &&...ExtraArgs) {
+        llvm::raw_ostream *Log = AssignmentsLog;
+        if (!KeepLog) AssignmentsLog = nullptr;
+        llvm::PreservedAnalyses PA = Pass.run(IR, AM, std::forward<ExtraArgTs>(ExtraArgs)...);
+        AssignmentsLog = Log;
+        return PA;
+    }
+};
+
+#endif
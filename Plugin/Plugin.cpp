@@ -0,0 +1,30 @@
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+// Funzioni di registrazione definite nei MyPasses.cpp dei singoli assignment
+void registerAssignment1Pipelines(PassBuilder &PB);
+void registerAssignment1ExtensionPoints(PassBuilder &PB);
+void registerAssignment3Pipelines(PassBuilder &PB);
+void registerAssignment3ExtensionPoints(PassBuilder &PB);
+void registerAssignment4Pipelines(PassBuilder &PB);
+void registerAssignment4ExtensionPoints(PassBuilder &PB);
+
+// Plugin unificato: i pass restano disponibili per nome con opt -passes="..." e vengono aggiunti
+// alle pipeline di default, quindi clang -O2 -fpass-plugin=... li applica direttamente durante la build
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return {
+        LLVM_PLUGIN_API_VERSION, "AssignmentsPlugin", "v1.0",
+        [](PassBuilder &PB) {
+            registerAssignment1Pipelines(PB);
+            registerAssignment3Pipelines(PB);
+            registerAssignment4Pipelines(PB);
+
+            registerAssignment1ExtensionPoints(PB);
+            registerAssignment3ExtensionPoints(PB);
+            registerAssignment4ExtensionPoints(PB);
+        }
+    };
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+# ---------------------------------------------------------------------------
+# bench_batch.sh – Scalabilita' del batch di assignments-opt da 1 a N worker
+# Uso:   ./bench_batch.sh lista_moduli.txt [pipeline]
+# La lista contiene un modulo (bitcode o IR) per riga; N e' il numero di core
+# ---------------------------------------------------------------------------
+
+set -euo pipefail            # interrompe su errore, pipe, variabili unset
+
+if [[ $# -lt 1 ]]; then
+  echo "Uso: $0 <lista_moduli.txt> [pipeline]"
+  exit 1
+fi
+LIST="$1"
+PIPELINE="${2:-default<O2>}"
+CORES="$(nproc)"
+
+# 1. Numero di worker: 1, 2, 4, ... fino al numero di core
+JOBS=()
+for ((J = 1; J < CORES; J *= 2)); do
+  JOBS+=("${J}")
+done
+JOBS+=("${CORES}")
+
+# 2. Un batch per ogni numero di worker; il logging dei pass viene scartato
+for J in "${JOBS[@]}"; do
+  echo "➜ ${J} worker"
+  ./build/assignments-opt @"${LIST}" -passes="${PIPELINE}" -j"${J}" 2>&1 > /dev/null \
+    | grep -E "^(Wall time|Latency per module|Peak memory)"
+done
+
+# 3. I risultati non dipendono dal numero di worker: l'ultimo batch li ha lasciati accanto agli input
+echo "Done ✓"